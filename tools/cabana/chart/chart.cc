@@ -216,6 +216,9 @@ void ChartView::updatePlotArea(int left_pos, bool force) {
     x_label_size += QSizeF{5, 5};
     chart()->setPlotArea(rect().adjusted(align_to + left, adjust_top + top, -x_label_size.width() / 2 - right, -x_label_size.height() - bottom));
     chart()->layout()->invalidate();
+    for (auto &s : sigs) {
+      sampleSeries(s);
+    }
     resetChartCache();
   }
 }
@@ -246,6 +249,9 @@ void ChartView::updatePlot(double cur, double min, double max) {
   cur_sec = cur;
   if (min != axis_x->min() || max != axis_x->max()) {
     axis_x->setRange(min, max);
+    for (auto &s : sigs) {
+      sampleSeries(s);
+    }
     updateAxisY();
     updateSeriesPoints();
     // update tooltip
@@ -280,20 +286,31 @@ void ChartView::updateSeriesPoints() {
   }
 }
 
-void ChartView::appendCanEvents(const cabana::Signal *sig, const std::vector<const CanEvent *> &events,
+void ChartView::sampleSeries(SigItem &s) {
+  // about two points per pixel: the min and the max of the points under it
+  const int max_points = std::max<int>(chart()->plotArea().width(), CHART_MIN_WIDTH) * 2;
+  const auto &points = series_type == SeriesType::StepLine ? s.step_vals : s.vals;
+  s.series->replace(s.lod.sample(points, axis_x->min(), axis_x->max(), max_points));
+}
+
+void ChartView::appendCanEvents(const MessageId &msg_id, const cabana::Signal *sig, size_t first, size_t count,
                                 std::vector<QPointF> &vals, std::vector<QPointF> &step_vals) {
-  vals.reserve(vals.size() + events.capacity());
-  step_vals.reserve(step_vals.size() + events.capacity() * 2);
+  vals.reserve(vals.size() + count);
+  step_vals.reserve(step_vals.size() + count * 2);
 
-  double value = 0;
+  // the values of the events are read from the column of the signal
+  const auto &events = can->events(msg_id);
+  auto e = events.cbegin() + first;
+  auto value = can->signalValues(msg_id, sig).cbegin() + first;
   const uint64_t begin_mono_time = can->routeStartTime() * 1e9;
-  for (const CanEvent *e : events) {
-    if (sig->getValue(e->dat, e->size, &value)) {
-      const double ts = (e->mono_time - std::min(e->mono_time, begin_mono_time)) / 1e9;
-      vals.emplace_back(ts, value);
+  for (size_t i = 0; i < count; ++i, ++e, ++value) {
+    if (!std::isnan(*value)) {
+      const uint64_t mono_time = (*e)->mono_time;
+      const double ts = (mono_time - std::min(mono_time, begin_mono_time)) / 1e9;
+      vals.emplace_back(ts, *value);
       if (!step_vals.empty())
         step_vals.emplace_back(ts, step_vals.back().y());
-      step_vals.emplace_back(ts, value);
+      step_vals.emplace_back(ts, *value);
     }
   }
 }
@@ -305,25 +322,40 @@ void ChartView::updateSeries(const cabana::Signal *sig, const MessageEventsMap *
         s.vals.clear();
         s.step_vals.clear();
       }
-      auto events = msg_new_events ? msg_new_events : &can->eventsMap();
-      auto it = events->find(s.msg_id);
-      if (it == events->end() || it->second.empty()) continue;
+      const auto &events = can->events(s.msg_id);
+      size_t first = 0, count = events.size();
+      if (msg_new_events) {
+        auto it = msg_new_events->find(s.msg_id);
+        if (it == msg_new_events->end() || it->second.empty()) continue;
+
+        // the new events were merged as consecutive events of the message
+        auto pos = std::lower_bound(events.cbegin(), events.cend(), it->second.front()->mono_time, CompareCanEvent());
+        first = std::find(pos, events.cend(), it->second.front()) - events.cbegin();
+        count = it->second.size();
+      }
+      if (count == 0) continue;
 
-      if (s.vals.empty() || (it->second.back()->mono_time / 1e9 - can->routeStartTime()) > s.vals.back().x()) {
-        appendCanEvents(s.sig, it->second, s.vals, s.step_vals);
+      // the first changed point of the series, the levels of detail are rebuilt from it
+      size_t from = series_type == SeriesType::StepLine ? s.step_vals.size() : s.vals.size();
+      if (s.vals.empty() || (events[first + count - 1]->mono_time / 1e9 - can->routeStartTime()) > s.vals.back().x()) {
+        appendCanEvents(s.msg_id, s.sig, first, count, s.vals, s.step_vals);
       } else {
         std::vector<QPointF> vals, step_vals;
-        appendCanEvents(s.sig, it->second, vals, step_vals);
-        s.vals.insert(std::lower_bound(s.vals.begin(), s.vals.end(), vals.front().x(), xLessThan),
-                      vals.begin(), vals.end());
-        s.step_vals.insert(std::lower_bound(s.step_vals.begin(), s.step_vals.end(), step_vals.front().x(), xLessThan),
-                           step_vals.begin(), step_vals.end());
+        appendCanEvents(s.msg_id, s.sig, first, count, vals, step_vals);
+        if (vals.empty()) continue;
+
+        auto vals_pos = s.vals.insert(std::lower_bound(s.vals.begin(), s.vals.end(), vals.front().x(), xLessThan),
+                                      vals.begin(), vals.end());
+        auto step_pos = s.step_vals.insert(std::lower_bound(s.step_vals.begin(), s.step_vals.end(), step_vals.front().x(), xLessThan),
+                                           step_vals.begin(), step_vals.end());
+        from = series_type == SeriesType::StepLine ? step_pos - s.step_vals.begin() : vals_pos - s.vals.begin();
       }
 
       if (!can->liveStreaming()) {
         s.segment_tree.build(s.vals);
       }
-      s.series->replace(QVector<QPointF>::fromStdVector(series_type == SeriesType::StepLine ? s.step_vals : s.vals));
+      s.lod.update(series_type == SeriesType::StepLine ? s.step_vals : s.vals, msg_new_events ? from : 0);
+      sampleSeries(s);
     }
   }
   updateAxisY();
@@ -845,7 +877,8 @@ void ChartView::setSeriesType(SeriesType type) {
     }
     for (auto &s : sigs) {
       s.series = createSeries(series_type, s.sig->color);
-      s.series->replace(QVector<QPointF>::fromStdVector(series_type == SeriesType::StepLine ? s.step_vals : s.vals));
+      s.lod.update(series_type == SeriesType::StepLine ? s.step_vals : s.vals);
+      sampleSeries(s);
     }
     updateSeriesPoints();
     updateTitle();
@@ -48,6 +48,7 @@ public:
     std::vector<QPointF> step_vals;
     QPointF track_pt{};
     SegmentTree segment_tree;
+    SeriesLOD lod;
     double min = 0;
     double max = 0;
   };
@@ -64,7 +65,10 @@ private slots:
   void signalRemoved(const cabana::Signal *sig) { removeIf([=](auto &s) { return s.sig == sig; }); }
 
 private:
-  void appendCanEvents(const cabana::Signal *sig, const std::vector<const CanEvent *> &events,
+  // replace the points of the series with the visible ones, sampled down to the width of the plot
+  void sampleSeries(SigItem &s);
+  // append the points of the count events of the message from index first
+  void appendCanEvents(const MessageId &msg_id, const cabana::Signal *sig, size_t first, size_t count,
                        std::vector<QPointF> &vals, std::vector<QPointF> &step_vals);
   void createToolButtons();
   void addSeries(QXYSeries *series);
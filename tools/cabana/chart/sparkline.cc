@@ -15,10 +15,10 @@ void Sparkline::update(const MessageId &msg_id, const cabana::Signal *sig, doubl
 
   if (first != last && !size.isEmpty()) {
     points.clear();
-    double value = 0;
-    for (auto it = first; it != last; ++it) {
-      if (sig->getValue((*it)->dat, (*it)->size, &value)) {
-        points.emplace_back(((*it)->mono_time - (*first)->mono_time) / 1e9, value);
+    auto value = can->signalValues(msg_id, sig).cbegin() + (first - msgs.cbegin());
+    for (auto it = first; it != last; ++it, ++value) {
+      if (!std::isnan(*value)) {
+        points.emplace_back(((*it)->mono_time - (*first)->mono_time) / 1e9, *value);
       }
     }
     const auto [min, max] = std::minmax_element(points.begin(), points.end(),
@@ -178,7 +178,9 @@ bool cabana::Signal::operator==(const cabana::Signal &other) const {
 
 // helper functions
 
-double get_raw_value(const uint8_t *data, size_t data_size, const cabana::Signal &sig) {
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "get_raw_value() loads the signal bytes as a little endian word");
+
+double get_raw_value_bytewise(const uint8_t *data, size_t data_size, const cabana::Signal &sig) {
   int64_t val = 0;
 
   int i = sig.msb / 8;
@@ -208,4 +210,15 @@ void updateMsbLsb(cabana::Signal &s) {
     s.lsb = flipBitPos(flipBitPos(s.start_bit) + s.size - 1);
     s.msb = s.start_bit;
   }
+
+  // little endian signals run from the byte of lsb up to the byte of msb, big endian ones the other way.
+  // a big endian word is swapped, so its last byte ends up in the lowest bits that are shifted out.
+  auto &ex = s.extraction;
+  const int first_byte = (s.is_little_endian ? s.lsb : s.msb) / 8;
+  const int last_byte = (s.is_little_endian ? s.msb : s.lsb) / 8;
+  ex.byte = first_byte;
+  ex.bytes = s.lsb >= 0 && s.size > 0 && last_byte - first_byte < 8 ? last_byte - first_byte + 1 : 0;
+  ex.swap = !s.is_little_endian;
+  ex.shift = (ex.swap ? 8 * (8 - ex.bytes) : 0) + s.lsb % 8;
+  ex.mask = s.size >= 64 ? ~0ULL : (1ULL << s.size) - 1;
 }
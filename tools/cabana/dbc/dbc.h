@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cmath>
+#include <cstring>
 #include <limits>
 #include <string>
 #include <utility>
@@ -57,6 +59,10 @@ public:
   Signal(const Signal &other) = default;
   void update();
   bool getValue(const uint8_t *data, size_t data_size, double *val) const;
+  // decode the signal of each event in [first, last) into values, one value per event.
+  // the value is NaN where the multiplexor selects another signal.
+  template <class Iter>
+  void getValues(Iter first, Iter last, double *values) const;
   QString formatValue(double value) const;
   bool operator==(const cabana::Signal &other) const;
   inline bool operator!=(const cabana::Signal &other) const { return !(*this == other); }
@@ -85,6 +91,16 @@ public:
   // Multiplexed
   int multiplex_value = 0;
   Signal *multiplexor = nullptr;
+
+  // compiled by updateMsbLsb(): the bytes holding the signal are read with a single load,
+  // swapped for big endian, then shifted and masked
+  struct Extraction {
+    int byte = 0;   // first byte read
+    int bytes = 0;  // number of bytes holding the signal, 0 if it spans more than 8
+    int shift = 0;
+    uint64_t mask = 0;
+    bool swap = false;
+  } extraction;
 };
 
 class Msg {
@@ -116,7 +132,37 @@ public:
 }  // namespace cabana
 
 // Helper functions
-double get_raw_value(const uint8_t *data, size_t data_size, const cabana::Signal &sig);
+double get_raw_value_bytewise(const uint8_t *data, size_t data_size, const cabana::Signal &sig);
+// updates msb, lsb and the extraction of a signal from its start bit, size and endianness
 void updateMsbLsb(cabana::Signal &s);
 inline int flipBitPos(int start_bit) { return 8 * (start_bit / 8) + 7 - start_bit % 8; }
 inline QString doubleToString(double value) { return QString::number(value, 'g', std::numeric_limits<double>::digits10); }
+
+inline double get_raw_value(const uint8_t *data, size_t data_size, const cabana::Signal &sig) {
+  const auto &ex = sig.extraction;
+  // truncated data is decoded byte by byte, as far as it goes
+  if (ex.bytes == 0 || (size_t)(ex.byte + ex.bytes) > data_size) {
+    return get_raw_value_bytewise(data, data_size, sig);
+  }
+
+  uint64_t word = 0;
+  std::memcpy(&word, data + ex.byte, (size_t)ex.byte + 8 <= data_size ? 8 : ex.bytes);
+  if (ex.swap) word = __builtin_bswap64(word);
+  int64_t val = (word >> ex.shift) & ex.mask;
+  if (sig.is_signed && sig.size < 64) {
+    val = (int64_t)((uint64_t)val << (64 - sig.size)) >> (64 - sig.size);
+  }
+  return val * sig.factor + sig.offset;
+}
+
+template <class Iter>
+void cabana::Signal::getValues(Iter first, Iter last, double *values) const {
+  for (; first != last; ++first, ++values) {
+    const auto &e = *first;
+    if (multiplexor && get_raw_value(e->dat, e->size, *multiplexor) != multiplex_value) {
+      *values = NAN;
+    } else {
+      *values = get_raw_value(e->dat, e->size, *this);
+    }
+  }
+}
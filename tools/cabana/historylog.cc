@@ -119,14 +119,26 @@ void HistoryLogModel::fetchMore(const QModelIndex &parent) {
   }
 }
 
+// the index of the event it refers to, forward or in reverse
+static inline size_t eventIndex(const CanEventList &events, CanEventList::const_iterator it) { return it - events.cbegin(); }
+static inline size_t eventIndex(const CanEventList &events, CanEventList::const_reverse_iterator it) { return it.base() - events.cbegin() - 1; }
+
 template <class InputIt>
 std::deque<HistoryLogModel::Message> HistoryLogModel::fetchData(InputIt first, InputIt last, uint64_t min_time) {
   std::deque<HistoryLogModel::Message> msgs;
+  // first and last iterate the events of the message, forward or in reverse
+  const auto &events = can->events(msg_id);
+  std::vector<const ChunkedVector<double> *> columns;
+  for (auto sig : sigs) {
+    columns.push_back(&can->signalValues(msg_id, sig));
+  }
   std::vector<double> values(sigs.size());
   for (; first != last && (*first)->mono_time > min_time; ++first) {
     const CanEvent *e = *first;
+    const size_t idx = eventIndex(events, first);
     for (int i = 0; i < sigs.size(); ++i) {
-      sigs[i]->getValue(e->dat, e->size, &values[i]);
+      // a signal that is not multiplexed in keeps its last value
+      if (double value = (*columns[i])[idx]; !std::isnan(value)) values[i] = value;
     }
     if (!filter_cmp || filter_cmp(values[filter_sig_idx], filter_value)) {
       auto &m = msgs.emplace_back();
@@ -1,12 +1,18 @@
 #include "tools/cabana/streams/abstractstream.h"
 
 #include <algorithm>
+#include <limits>
 #include <utility>
 
+#include <QtConcurrent>
+
 #include "common/timing.h"
 #include "tools/cabana/settings.h"
 
 static const int EVENT_NEXT_BUFFER_SIZE = 6 * 1024 * 1024;  // 6MB
+static const uint64_t CHECKPOINT_INTERVAL = 30 * 1e9;  // 30s of route time
+// further than that from a checkpoint, a seek restores the last event of each message only
+static const int MAX_SEEK_REPLAY_EVENTS = 500000;
 
 AbstractStream *can = nullptr;
 
@@ -23,6 +29,10 @@ AbstractStream::AbstractStream(QObject *parent) : QObject(parent) {
   QObject::connect(this, &AbstractStream::seekedTo, this, &AbstractStream::updateLastMsgsTo);
   QObject::connect(dbc(), &DBCManager::DBCFileChanged, this, &AbstractStream::updateMasks);
   QObject::connect(dbc(), &DBCManager::maskUpdated, this, &AbstractStream::updateMasks);
+  // drop the columns of deleted signals before their pointers are reused
+  QObject::connect(dbc(), &DBCManager::DBCFileChanged, this, [this]() { signal_cache_.clear(); });
+  QObject::connect(dbc(), &DBCManager::signalRemoved, this, [this](const cabana::Signal *sig) { signal_cache_.remove(sig); });
+  QObject::connect(dbc(), &DBCManager::msgRemoved, this, [this](MessageId id) { signal_cache_.remove(id); });
   QObject::connect(this, &AbstractStream::streamStarted, [this]() {
     emit StreamNotifier::instance()->changingStream();
     delete can;
@@ -31,6 +41,10 @@ AbstractStream::AbstractStream(QObject *parent) : QObject(parent) {
   });
 }
 
+AbstractStream::~AbstractStream() {
+  stopCheckpoints();
+}
+
 void AbstractStream::updateMasks() {
   std::lock_guard lk(mutex_);
   masks_.clear();
@@ -112,8 +126,8 @@ void AbstractStream::updateEvent(const MessageId &id, double sec, const uint8_t
   new_msgs_.insert(id);
 }
 
-const std::vector<const CanEvent *> &AbstractStream::events(const MessageId &id) const {
-  static std::vector<const CanEvent *> empty_events;
+const CanEventList &AbstractStream::events(const MessageId &id) const {
+  static CanEventList empty_events;
   auto it = events_.find(id);
   return it != events_.end() ? it->second : empty_events;
 }
@@ -127,19 +141,47 @@ const CanData &AbstractStream::lastMessage(const MessageId &id) {
 // it is thread safe to update data in updateLastMsgsTo.
 // updateLastMsgsTo is always called in UI thread.
 void AbstractStream::updateLastMsgsTo(double sec) {
+  stopCheckpoints();
   new_msgs_.clear();
   messages_.clear();
 
   current_sec_ = sec;
   uint64_t last_ts = (sec + routeStartTime()) * 1e9;
-  for (const auto &[id, ev] : events_) {
-    auto it = std::upper_bound(ev.begin(), ev.end(), last_ts, CompareCanEvent());
-    if (it != ev.begin()) {
-      auto prev = std::prev(it);
-      double ts = (*prev)->mono_time / 1e9 - routeStartTime();
-      auto &m = messages_[id];
-      m.compute(id, (*prev)->dat, (*prev)->size, ts, getSpeed(), {});
-      m.count = std::distance(ev.begin(), prev) + 1;
+  // the closest state before sec: a checkpoint, the state the build stopped at, or no events at all
+  const std::unordered_map<MessageId, CanData> *state = nullptr;
+  uint64_t state_ts = 0;
+  auto cp = std::upper_bound(checkpoints_.cbegin(), checkpoints_.cend(), last_ts, [](uint64_t ts, auto &c) { return ts < c.mono_time; });
+  if (cp != checkpoints_.cbegin()) {
+    state = &std::prev(cp)->msgs;
+    state_ts = std::prev(cp)->mono_time;
+  }
+  if (checkpoint_ts_ > state_ts && checkpoint_ts_ <= last_ts + 1) {
+    state = &checkpoint_state_;
+    state_ts = checkpoint_ts_;
+  }
+
+  auto first = std::lower_bound(all_events_.cbegin(), all_events_.cend(), state_ts, CompareCanEvent());
+  auto last = std::upper_bound(first, all_events_.cend(), last_ts, CompareCanEvent());
+  if (last - first <= MAX_SEEK_REPLAY_EVENTS) {
+    if (state) messages_ = *state;
+    const double route_start = routeStartTime();
+    const double speed = getSpeed();
+    for (auto it = first; it != last; ++it) {
+      replayEvent(messages_, *it, route_start, speed);
+    }
+    // back to updating the frequency every second of wall time
+    for (auto &[_, m] : messages_) m.last_freq_update_ts = 0;
+    updateMasks();
+  } else {
+    for (const auto &[id, ev] : events_) {
+      auto it = std::upper_bound(ev.begin(), ev.end(), last_ts, CompareCanEvent());
+      if (it != ev.begin()) {
+        auto prev = std::prev(it);
+        double ts = (*prev)->mono_time / 1e9 - routeStartTime();
+        auto &m = messages_[id];
+        m.compute(id, (*prev)->dat, (*prev)->size, ts, getSpeed(), {});
+        m.count = std::distance(ev.begin(), prev) + 1;
+      }
     }
   }
 
@@ -148,6 +190,7 @@ void AbstractStream::updateLastMsgsTo(double sec) {
                                 [this](const auto &m) { return !last_msgs.count(m.first); });
   last_msgs = messages_;
   emit msgsReceived(nullptr, id_changed);
+  startCheckpoints();
 }
 
 const CanEvent *AbstractStream::newEvent(uint64_t mono_time, const cereal::CanData::Reader &c) {
@@ -169,20 +212,98 @@ void AbstractStream::mergeEvents(const std::vector<const CanEvent *> &events) {
   }
 
   if (!events.empty()) {
+    stopCheckpoints();
+    invalidateCheckpoints(events.front()->mono_time);
     for (const auto &[id, new_e] : msg_events) {
       if (!new_e.empty()) {
         auto &e = events_[id];
-        auto pos = std::upper_bound(e.cbegin(), e.cend(), new_e.front()->mono_time, CompareCanEvent());
+        const size_t pos = std::upper_bound(e.cbegin(), e.cend(), new_e.front()->mono_time, CompareCanEvent()) - e.cbegin();
+        signal_cache_.insert(id, pos, new_e);
         e.insert(pos, new_e.cbegin(), new_e.cend());
       }
     }
     auto pos = std::upper_bound(all_events_.cbegin(), all_events_.cend(), events.front()->mono_time, CompareCanEvent());
-    all_events_.insert(pos, events.cbegin(), events.cend());
+    all_events_.insert(pos - all_events_.cbegin(), events.cbegin(), events.cend());
+    startCheckpoints();
     emit eventsMerged(msg_events);
   }
   lastest_event_ts = all_events_.empty() ? 0 : all_events_.back()->mono_time;
 }
 
+// SignalCache
+
+bool SignalCache::Column::decodes(const cabana::Signal *s) const {
+  auto same = [](const cabana::Signal &l, const cabana::Signal &r) {
+    return l.start_bit == r.start_bit && l.size == r.size && l.is_signed == r.is_signed &&
+           l.is_little_endian == r.is_little_endian && l.factor == r.factor && l.offset == r.offset;
+  };
+  if (!same(sig, *s) || multiplexor.has_value() != (s->multiplexor != nullptr)) return false;
+  return !multiplexor || (sig.multiplex_value == s->multiplex_value && same(*multiplexor, *s->multiplexor));
+}
+
+const ChunkedVector<double> &SignalCache::values(const MessageId &id, const cabana::Signal *sig, const CanEventList &events) {
+  {
+    std::lock_guard lk(lock_);
+    auto &columns = columns_[id];
+    auto it = columns.find(sig);
+    if (it != columns.end() && it->second.decodes(sig)) return it->second.values;
+  }
+
+  // decoded without the lock, charts are updated in parallel
+  Column column = {.sig = *sig};
+  if (sig->multiplexor) column.multiplexor = *sig->multiplexor;
+  std::vector<double> values(events.size());
+  sig->getValues(events.begin(), events.end(), values.data());
+  column.values.insert(0, std::move(values));
+
+  std::lock_guard lk(lock_);
+  auto [it, inserted] = columns_[id].try_emplace(sig, std::move(column));
+  // a column decoded by another thread in the meantime may be read already, it is kept
+  if (!inserted && !it->second.decodes(sig)) {
+    it->second = std::move(column);
+  }
+  return it->second.values;
+}
+
+void SignalCache::insert(const MessageId &id, size_t pos, const std::vector<const CanEvent *> &new_events) {
+  std::lock_guard lk(lock_);
+  auto columns = columns_.find(id);
+  if (columns == columns_.end()) return;
+
+  for (auto it = columns->second.begin(); it != columns->second.end(); /**/) {
+    auto &[sig, column] = *it;
+    if (!column.decodes(sig)) {
+      // edited since, decoded again on next use
+      it = columns->second.erase(it);
+      continue;
+    }
+    std::vector<double> values(new_events.size());
+    sig->getValues(new_events.begin(), new_events.end(), values.data());
+    column.values.insert(pos, std::move(values));
+    ++it;
+  }
+}
+
+void SignalCache::remove(const MessageId &id) {
+  std::lock_guard lk(lock_);
+  // the message is removed from a dbc file shared by several sources
+  for (auto &[msg_id, columns] : columns_) {
+    if (msg_id.address == id.address) columns.clear();
+  }
+}
+
+void SignalCache::remove(const cabana::Signal *sig) {
+  std::lock_guard lk(lock_);
+  for (auto &[_, columns] : columns_) {
+    columns.erase(sig);
+  }
+}
+
+void SignalCache::clear() {
+  std::lock_guard lk(lock_);
+  columns_.clear();
+}
+
 // CanData
 
 namespace {
@@ -203,9 +324,7 @@ inline QColor blend(const QColor &a, const QColor &b) {
 }
 
 // Calculate the frequency of the past minute.
-double calc_freq(const MessageId &msg_id, double current_sec) {
-  const auto &events = can->events(msg_id);
-  uint64_t cur_mono_time = (can->routeStartTime() + current_sec) * 1e9;
+double calc_freq(const CanEventList &events, uint64_t cur_mono_time) {
   uint64_t first_mono_time = std::max<int64_t>(0, cur_mono_time - 59 * 1e9);
   auto first = std::lower_bound(events.begin(), events.end(), first_mono_time, CompareCanEvent());
   auto second = std::lower_bound(first, events.end(), cur_mono_time, CompareCanEvent());
@@ -217,6 +336,10 @@ double calc_freq(const MessageId &msg_id, double current_sec) {
   return 0;
 }
 
+double calc_freq(const MessageId &msg_id, double current_sec) {
+  return calc_freq(can->events(msg_id), (can->routeStartTime() + current_sec) * 1e9);
+}
+
 }  // namespace
 
 void CanData::compute(const MessageId &msg_id, const uint8_t *can_data, const int size, double current_sec,
@@ -284,3 +407,63 @@ void CanData::compute(const MessageId &msg_id, const uint8_t *can_data, const in
   }
   memcpy(dat.data(), can_data, size);
 }
+
+// Checkpoints
+
+void AbstractStream::replayEvent(std::unordered_map<MessageId, CanData> &msgs, const CanEvent *e, double route_start, double speed) const {
+  const MessageId id = {.source = e->src, .address = e->address};
+  const double sec = e->mono_time / 1e9 - route_start;
+  auto &m = msgs[id];
+  // the frequency is updated every second of route time instead of wall time, from the events of this stream
+  if (m.count == 0 || std::floor(sec) != std::floor(m.ts)) {
+    m.freq = calc_freq(events(id), e->mono_time);
+  }
+  m.last_freq_update_ts = std::numeric_limits<double>::infinity();
+  m.compute(id, e->dat, e->size, sec, speed, {});
+}
+
+// runs in a worker thread, from the state before the events at checkpoint_ts_ to the last event.
+void AbstractStream::buildCheckpoints(double route_start, double speed) {
+  uint64_t next_ts = checkpoints_.empty() ? 0 : checkpoints_.back().mono_time + CHECKPOINT_INTERVAL;
+  auto first = std::lower_bound(all_events_.cbegin(), all_events_.cend(), checkpoint_ts_, CompareCanEvent());
+  for (auto it = first; it != all_events_.cend(); ++it) {
+    const uint64_t mono_time = (*it)->mono_time;
+    // stopped between events of different times only, so the state is always before the events at checkpoint_ts_
+    if (it == first || mono_time != (*std::prev(it))->mono_time) {
+      checkpoint_ts_ = mono_time;
+      if (abort_checkpoints_) return;
+
+      if (mono_time >= next_ts) {
+        // no events since the last checkpoint are in [checkpoint time, mono_time)
+        checkpoints_.push_back({.mono_time = mono_time / CHECKPOINT_INTERVAL * CHECKPOINT_INTERVAL, .msgs = checkpoint_state_});
+        next_ts = checkpoints_.back().mono_time + CHECKPOINT_INTERVAL;
+      }
+    }
+    replayEvent(checkpoint_state_, *it, route_start, speed);
+  }
+  if (first != all_events_.cend()) {
+    checkpoint_ts_ = all_events_.back()->mono_time + 1;
+  }
+}
+
+void AbstractStream::startCheckpoints() {
+  checkpoint_future_ = QtConcurrent::run([this, route_start = routeStartTime(), speed = getSpeed()]() {
+    buildCheckpoints(route_start, speed);
+  });
+}
+
+void AbstractStream::stopCheckpoints() {
+  abort_checkpoints_ = true;
+  checkpoint_future_.waitForFinished();
+  abort_checkpoints_ = false;
+}
+
+// the state after mono_time changes when events are merged at mono_time
+void AbstractStream::invalidateCheckpoints(uint64_t mono_time) {
+  if (mono_time >= checkpoint_ts_) return;
+
+  auto it = std::upper_bound(checkpoints_.begin(), checkpoints_.end(), mono_time, [](uint64_t ts, auto &c) { return ts < c.mono_time; });
+  checkpoints_.erase(it, checkpoints_.end());
+  checkpoint_state_ = checkpoints_.empty() ? std::unordered_map<MessageId, CanData>{} : checkpoints_.back().msgs;
+  checkpoint_ts_ = checkpoints_.empty() ? 0 : checkpoints_.back().mono_time;
+}
@@ -1,14 +1,17 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <set>
 #include <unordered_map>
 #include <vector>
 
 #include <QColor>
 #include <QDateTime>
+#include <QFuture>
 
 #include "cereal/messaging/messaging.h"
 #include "tools/cabana/dbc/dbcmanager.h"
@@ -55,13 +58,42 @@ struct BusConfig {
 };
 
 typedef std::unordered_map<MessageId, std::vector<const CanEvent *>> MessageEventsMap;
+// events sorted by time, chunked so events merged out of order don't shift the others
+typedef ChunkedVector<const CanEvent *> CanEventList;
+
+// Decoded values of signals, one column per signal aligned with the events of its message, so
+// each value is decoded once. Columns are decoded on first use, extended as events are merged
+// and decoded again after the signal (or its multiplexor) is edited.
+class SignalCache {
+public:
+  // the value of sig in each of events, NaN where it is not multiplexed in. thread safe.
+  // the column stays valid until events are merged or signals are edited, both in the UI thread.
+  const ChunkedVector<double> &values(const MessageId &id, const cabana::Signal *sig, const CanEventList &events);
+  // new_events were inserted into the events of id at pos
+  void insert(const MessageId &id, size_t pos, const std::vector<const CanEvent *> &new_events);
+  void remove(const MessageId &id);
+  void remove(const cabana::Signal *sig);
+  void clear();
+
+private:
+  struct Column {
+    ChunkedVector<double> values;
+    // what the values were decoded with, a signal is edited in place
+    cabana::Signal sig;
+    std::optional<cabana::Signal> multiplexor;
+    bool decodes(const cabana::Signal *s) const;
+  };
+
+  std::mutex lock_;
+  std::unordered_map<MessageId, std::unordered_map<const cabana::Signal *, Column>> columns_;
+};
 
 class AbstractStream : public QObject {
   Q_OBJECT
 
 public:
   AbstractStream(QObject *parent);
-  virtual ~AbstractStream() {}
+  virtual ~AbstractStream();
   virtual void start() = 0;
   virtual bool liveStreaming() const { return true; }
   virtual void seekTo(double ts) {}
@@ -77,10 +109,13 @@ public:
   virtual void pause(bool pause) {}
 
   inline const std::unordered_map<MessageId, CanData> &lastMessages() const { return last_msgs; }
-  inline const MessageEventsMap &eventsMap() const { return events_; }
-  inline const std::vector<const CanEvent *> &allEvents() const { return all_events_; }
+  inline const CanEventList &allEvents() const { return all_events_; }
   const CanData &lastMessage(const MessageId &id);
-  const std::vector<const CanEvent *> &events(const MessageId &id) const;
+  const CanEventList &events(const MessageId &id) const;
+  // the values of sig aligned with events(id), see SignalCache
+  inline const ChunkedVector<double> &signalValues(const MessageId &id, const cabana::Signal *sig) {
+    return signal_cache_.values(id, sig, events(id));
+  }
 
   size_t suppressHighlighted();
   void clearSuppressed();
@@ -105,7 +140,7 @@ protected:
   void updateEvent(const MessageId &id, double sec, const uint8_t *data, uint8_t size);
   uint64_t lastEventMonoTime() const { return lastest_event_ts; }
 
-  std::vector<const CanEvent *> all_events_;
+  CanEventList all_events_;
   uint64_t lastest_event_ts = 0;
 
 private:
@@ -113,10 +148,30 @@ private:
   void updateLastMsgsTo(double sec);
   void updateMasks();
 
+  // the state of all messages before the events at mono_time
+  struct Checkpoint {
+    uint64_t mono_time;
+    std::unordered_map<MessageId, CanData> msgs;
+  };
+  void replayEvent(std::unordered_map<MessageId, CanData> &msgs, const CanEvent *e, double route_start, double speed) const;
+  void buildCheckpoints(double route_start, double speed);
+  void startCheckpoints();
+  void stopCheckpoints();
+  void invalidateCheckpoints(uint64_t mono_time);
+
   double current_sec_ = 0;
-  MessageEventsMap events_;
+  std::unordered_map<MessageId, CanEventList> events_;
   std::unordered_map<MessageId, CanData> last_msgs;
   std::unique_ptr<MonotonicBuffer> event_buffer_;
+  SignalCache signal_cache_;
+
+  // taken in the background as events are merged, a seek restores the closest one and plays the
+  // events after it forward. only read and written while the build is stopped.
+  std::vector<Checkpoint> checkpoints_;
+  std::unordered_map<MessageId, CanData> checkpoint_state_;  // the state before the events at checkpoint_ts_
+  uint64_t checkpoint_ts_ = 0;
+  std::atomic<bool> abort_checkpoints_ = false;
+  QFuture<void> checkpoint_future_;
 
   // Members accessed in multiple threads. (mutex protected)
   std::mutex mutex_;
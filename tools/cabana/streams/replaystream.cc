@@ -31,11 +31,11 @@ void ReplayStream::mergeSegments() {
 
       std::vector<const CanEvent *> new_events;
       new_events.reserve(seg->log->events.size());
-      for (auto it = seg->log->events.cbegin(); it != seg->log->events.cend(); ++it) {
-        if ((*it)->which == cereal::Event::Which::CAN) {
-          const uint64_t ts = (*it)->mono_time;
-          for (const auto &c : (*it)->event.getCan()) {
-            new_events.push_back(newEvent(ts, c));
+      for (const Event &e : seg->log->events) {
+        if (e.which == cereal::Event::Which::CAN) {
+          capnp::FlatArrayMessageReader reader(e.data);
+          for (const auto &c : reader.getRoot<cereal::Event>().getCan()) {
+            new_events.push_back(newEvent(e.mono_time, c));
           }
         }
       }
@@ -64,7 +64,8 @@ bool ReplayStream::eventFilter(const Event *event) {
   static double prev_update_ts = 0;
   if (event->which == cereal::Event::Which::CAN) {
     double current_sec = event->mono_time / 1e9 - routeStartTime();
-    for (const auto &c : event->event.getCan()) {
+    capnp::FlatArrayMessageReader reader(event->data);
+    for (const auto &c : reader.getRoot<cereal::Event>().getCan()) {
       MessageId id = {.source = c.getSrc(), .address = c.getAddress()};
       const auto dat = c.getDat();
       updateEvent(id, current_sec, (const uint8_t*)dat.begin(), dat.size());
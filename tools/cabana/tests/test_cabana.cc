@@ -1,9 +1,13 @@
 
+#include <numeric>
+#include <random>
+
 #undef INFO
 #include "catch2/catch.hpp"
 #include "tools/replay/logreader.h"
 #include "tools/cabana/dbc/dbcmanager.h"
 #include "tools/cabana/streams/abstractstream.h"
+#include "tools/cabana/util.h"
 
 const std::string TEST_RLOG_URL = "https://commadataci.blob.core.windows.net/openpilotci/0c94aa1e1296d7c6/2021-05-05--19-48-37/0/rlog.bz2";
 
@@ -85,3 +89,182 @@ CM_ SG_ 160 signal_2 "multiple line comment
   REQUIRE(msg->sigs[1]->size == 1);
   REQUIRE(msg->sigs[1]->receiver_name == "XXX");
 }
+
+TEST_CASE("get_raw_value") {
+  std::vector<uint8_t> data(64);
+  for (auto &d : data) d = rand();
+
+  for (int data_size : {3, 8, 64}) {
+    for (bool little_endian : {true, false}) {
+      for (int size = 1; size < 64; ++size) {
+        for (int start_bit = 0; start_bit < data_size * 8; ++start_bit) {
+          cabana::Signal sig{};
+          sig.start_bit = start_bit;
+          sig.size = size;
+          sig.is_little_endian = little_endian;
+          sig.is_signed = start_bit % 2;
+          sig.factor = 0.5;
+          updateMsbLsb(sig);
+          // the compiled extraction decodes what the bytewise one does, truncated data included
+          REQUIRE(get_raw_value(data.data(), data_size, sig) == get_raw_value_bytewise(data.data(), data_size, sig));
+        }
+      }
+    }
+  }
+
+  SECTION("getValues") {
+    DBCFile file("", R"(
+BO_ 162 message_1: 8 XXX
+  SG_ signal_1 M : 0|12@1+ (1,0) [0|4095] "unit" XXX
+  SG_ signal_2 M4 : 12|4@1- (2,1) [0|15] "" XXX
+)");
+    struct Event {
+      uint8_t size = 8;
+      uint8_t dat[8] = {};
+    } events[3];
+    events[0].dat[0] = 4;
+    events[0].dat[1] = 0xf0;
+    events[1].dat[0] = 5;
+    events[2].dat[0] = 4;
+    events[2].dat[1] = 0x30;
+    std::vector<const Event *> ptrs = {&events[0], &events[1], &events[2]};
+
+    double values[3];
+    file.msg(162)->sigs[1]->getValues(ptrs.begin(), ptrs.end(), values);
+    REQUIRE(values[0] == -1);
+    REQUIRE(std::isnan(values[1]));
+    REQUIRE(values[2] == 7);
+  }
+}
+
+TEST_CASE("SignalCache") {
+  DBCFile file("", R"(
+BO_ 160 message_1: 8 XXX
+  SG_ signal_1 : 0|8@1+ (1,0) [0|255] "" XXX
+)");
+  auto sig = file.msg(160)->sigs[0];
+  const MessageId id = {.source = 0, .address = 160};
+
+  std::vector<std::unique_ptr<uint8_t[]>> buffers;
+  auto new_event = [&](uint64_t mono_time, uint8_t value) {
+    CanEvent *e = (CanEvent *)buffers.emplace_back(new uint8_t[sizeof(CanEvent) + 8]()).get();
+    e->address = id.address;
+    e->mono_time = mono_time;
+    e->size = 8;
+    e->dat[0] = value;
+    return (const CanEvent *)e;
+  };
+
+  auto to_vector = [](const ChunkedVector<double> &values) { return std::vector<double>(values.begin(), values.end()); };
+  SignalCache cache;
+  CanEventList events;
+  std::vector<const CanEvent *> new_events = {new_event(1, 10), new_event(3, 30)};
+  events.insert(0, new_events.begin(), new_events.end());
+  REQUIRE(to_vector(cache.values(id, sig, events)) == std::vector<double>{10, 30});
+
+  // merged events extend the column
+  new_events = {new_event(2, 20)};
+  cache.insert(id, 1, new_events);
+  events.insert(1, new_events.begin(), new_events.end());
+  REQUIRE(to_vector(cache.values(id, sig, events)) == std::vector<double>{10, 20, 30});
+
+  // an edited signal is decoded again
+  sig->factor = 2;
+  REQUIRE(to_vector(cache.values(id, sig, events)) == std::vector<double>{20, 40, 60});
+}
+
+TEST_CASE("ChunkedVector") {
+  // runs of all sizes inserted anywhere, as events of segments loaded out of order
+  ChunkedVector<int> chunked;
+  std::vector<int> expected;
+  std::mt19937 rng(42);
+  for (int i = 0; i < 200; ++i) {
+    std::vector<int> run(rng() % 3 == 0 ? 70000 + rng() % 1000 : rng() % 100);
+    std::iota(run.begin(), run.end(), i * 100000);
+    const size_t pos = rng() % (expected.size() + 1);
+    expected.insert(expected.begin() + pos, run.begin(), run.end());
+    if (i % 2 == 0) {
+      chunked.insert(pos, run.begin(), run.end());
+    } else {
+      chunked.insert(pos, std::move(run));
+    }
+  }
+
+  REQUIRE(chunked.size() == expected.size());
+  REQUIRE(std::equal(chunked.begin(), chunked.end(), expected.begin(), expected.end()));
+  REQUIRE(std::equal(chunked.rbegin(), chunked.rend(), expected.rbegin(), expected.rend()));
+  for (int i = 0; i < 1000; ++i) {
+    const size_t n = rng() % expected.size();
+    REQUIRE(chunked[n] == expected[n]);
+    REQUIRE(*(chunked.begin() + n) == expected[n]);
+    REQUIRE((chunked.end() - (expected.size() - n)).index() == n);
+    REQUIRE(std::prev(chunked.begin() + (n + 1)).index() == n);
+  }
+}
+
+TEST_CASE("AbstractStream::seekTo") {
+  struct TestStream : public AbstractStream {
+    TestStream(QObject *parent) : AbstractStream(parent) {}
+    QString routeName() const override { return "test"; }
+    void start() override {}
+    using AbstractStream::mergeEvents;
+  };
+  QObject parent;
+  TestStream stream(&parent);
+
+  // one bit toggles in each event, 10 per second for 200 seconds
+  const MessageId id = {.source = 0, .address = 100};
+  std::vector<std::unique_ptr<uint8_t[]>> buffers;
+  std::vector<const CanEvent *> events;
+  for (int i = 0; i < 2000; ++i) {
+    CanEvent *e = (CanEvent *)buffers.emplace_back(new uint8_t[sizeof(CanEvent) + 8]()).get();
+    e->address = id.address;
+    e->mono_time = (i + 1) * 1e8;
+    e->size = 8;
+    e->dat[0] = i & 1;
+    events.push_back(e);
+  }
+  // merged out of order, as segments loaded after a seek
+  stream.mergeEvents({events.begin() + 1000, events.end()});
+  stream.mergeEvents({events.begin(), events.begin() + 1000});
+
+  // the state is the one of playing all the events up to the time
+  for (double sec : {150.0, 20.0, 199.95}) {
+    emit stream.seekedTo(sec);
+    const int n = std::min<int>(sec * 10, events.size());
+    const auto &m = stream.lastMessage(id);
+    REQUIRE(m.count == n);
+    REQUIRE(m.dat[0] == ((n - 1) & 1));
+    REQUIRE(m.last_changes[0].bit_change_counts[7] == n - 1);
+  }
+}
+
+TEST_CASE("SeriesLOD") {
+  std::vector<QPointF> points;
+  SeriesLOD lod;
+  size_t updated = 0;
+  for (int i = 0; i < 100000; ++i) {
+    points.emplace_back(i * 0.01, (i * 7919) % 100003);
+    // the levels are rebuilt from the first appended point
+    if (i % 997 == 0) {
+      lod.update(points, updated);
+      updated = points.size();
+    }
+  }
+  lod.update(points, updated);
+  SeriesLOD full;
+  full.update(points);
+  auto sampled = lod.sample(points, 0, 1000, 500);
+  REQUIRE(sampled == full.sample(points, 0, 1000, 500));
+  REQUIRE(sampled.size() <= 500);
+
+  // the extremes are kept
+  auto y_less = [](auto &l, auto &r) { return l.y() < r.y(); };
+  REQUIRE(sampled.contains(*std::min_element(points.begin(), points.end(), y_less)));
+  REQUIRE(sampled.contains(*std::max_element(points.begin(), points.end(), y_less)));
+
+  // a range with few points is not sampled, its neighbours included
+  auto first = std::lower_bound(points.begin(), points.end(), 10, [](auto &p, double x) { return p.x() < x; });
+  auto last = std::upper_bound(first, points.end(), 10.5, [](double x, auto &p) { return x < p.x(); });
+  REQUIRE(lod.sample(points, 10, 10.5, 500).size() == std::distance(first, last) + 2);
+}
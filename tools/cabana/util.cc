@@ -2,6 +2,7 @@
 
 #include <algorithm>
 #include <csignal>
+#include <iterator>
 #include <limits>
 #include <memory>
 #include <string>
@@ -50,6 +51,62 @@ std::pair<double, double> SegmentTree::get_minmax(int n, int left, int right, in
   return {std::min(l.first, r.first), std::max(l.second, r.second)};
 }
 
+// SeriesLOD
+
+void SeriesLOD::update(const std::vector<QPointF> &points, size_t from) {
+  auto y_less = [](const QPointF &l, const QPointF &r) { return l.y() < r.y(); };
+  size_t group = BASE_BUCKET_SIZE;
+  size_t k = 0;
+  for (; (k == 0 ? points.size() : levels_[k - 1].size()) > group; ++k) {
+    if (levels_.size() == k) levels_.emplace_back();
+    const auto &src = k == 0 ? points : levels_[k - 1];
+    auto &level = levels_[k];
+
+    // the buckets before from are unchanged
+    const size_t first_bucket = std::min(from / group, level.size() / 2);
+    level.resize(first_bucket * 2);
+    for (size_t i = first_bucket * group; i < src.size(); i += group) {
+      auto [min, max] = std::minmax_element(src.begin() + i, src.begin() + std::min(src.size(), i + group), y_less);
+      if (min->x() > max->x()) std::swap(min, max);
+      level.push_back(*min);
+      level.push_back(*max);
+    }
+    from = first_bucket * 2;
+    // a bucket of the next level merges two buckets of this one
+    group = 4;
+  }
+  levels_.resize(k);
+}
+
+QVector<QPointF> SeriesLOD::sample(const std::vector<QPointF> &points, double min_x, double max_x, int max_points) const {
+  auto first = std::lower_bound(points.begin(), points.end(), min_x, [](auto &p, double x) { return p.x() < x; });
+  auto last = std::upper_bound(first, points.end(), max_x, [](double x, auto &p) { return x < p.x(); });
+  // lines run to the edges of the range
+  const size_t begin = first - points.begin() - (first != points.begin());
+  const size_t end = last - points.begin() + (last != points.end());
+  auto copy = [](auto first, auto last) {
+    QVector<QPointF> ret;
+    ret.reserve(std::distance(first, last));
+    std::copy(first, last, std::back_inserter(ret));
+    return ret;
+  };
+  if (end - begin <= (size_t)max_points || levels_.empty()) {
+    return copy(points.begin() + begin, points.begin() + end);
+  }
+
+  // the finest level with few enough buckets in the range, the partial buckets at its edges included
+  size_t k = 0;
+  while (k + 1 < levels_.size() && 2 * (end - begin) / (BASE_BUCKET_SIZE << k) > (size_t)max_points) ++k;
+  const size_t bucket_size = BASE_BUCKET_SIZE << k;
+  const auto &level = levels_[k];
+  const size_t level_begin = std::min(begin / bucket_size * 2, level.size());
+  const size_t level_end = std::min((end - 1) / bucket_size * 2 + 2, level.size());
+  auto ret = copy(level.begin() + level_begin, level.begin() + level_end);
+  if (!ret.isEmpty() && points[begin].x() < ret.front().x()) ret.prepend(points[begin]);
+  if (!ret.isEmpty() && points[end - 1].x() > ret.back().x()) ret.append(points[end - 1]);
+  return ret;
+}
+
 // MessageBytesDelegate
 
 MessageBytesDelegate::MessageBytesDelegate(QObject *parent, bool multiple_lines) : multiple_lines(multiple_lines), QStyledItemDelegate(parent) {
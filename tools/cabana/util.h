@@ -1,8 +1,10 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cmath>
 #include <deque>
+#include <iterator>
 #include <vector>
 #include <utility>
 
@@ -65,6 +67,22 @@ private:
   int size = 0;
 };
 
+// Min/max levels of detail of a series sorted by x, so a range of any length is drawn with about as
+// many points as pixels. A bucket of a level keeps the points with the min and max y of twice as
+// many points of the series as a bucket of the level below.
+class SeriesLOD {
+public:
+  // rebuild the buckets of the points from index from on, after they were appended or inserted
+  void update(const std::vector<QPointF> &points, size_t from = 0);
+  // the points in [min_x, max_x] and their neighbours on each side, down to at most about max_points
+  QVector<QPointF> sample(const std::vector<QPointF> &points, double min_x, double max_x, int max_points) const;
+
+private:
+  static constexpr size_t BASE_BUCKET_SIZE = 8;
+  // levels_[k] holds two points for each bucket of BASE_BUCKET_SIZE << k points
+  std::vector<std::vector<QPointF>> levels_;
+};
+
 class MessageBytesDelegate : public QStyledItemDelegate {
   Q_OBJECT
 public:
@@ -175,5 +193,150 @@ private:
   static constexpr float growth_factor = 1.5;
 };
 
+// A sequence kept in chunks, so a run of items inserted in the middle (the events of a segment
+// loaded out of order) becomes a chunk of its own instead of shifting all the items after it.
+// Items are read by index or with random access iterators, as if they were in one vector.
+template <class T>
+class ChunkedVector {
+public:
+  class const_iterator {
+  public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T *;
+    using reference = const T &;
+
+    const_iterator() = default;
+    reference operator*() const { return v->chunks_[chunk][offset]; }
+    pointer operator->() const { return &**this; }
+    reference operator[](difference_type n) const { return *(*this + n); }
+    // the index of the item in the sequence
+    size_t index() const { return v->offsets_[chunk] + offset; }
+
+    const_iterator &operator++() {
+      if (++offset == v->chunks_[chunk].size()) {
+        ++chunk;
+        offset = 0;
+      }
+      return *this;
+    }
+    const_iterator &operator--() {
+      if (offset == 0) offset = v->chunks_[--chunk].size();
+      --offset;
+      return *this;
+    }
+    const_iterator operator++(int) { auto it = *this; ++*this; return it; }
+    const_iterator operator--(int) { auto it = *this; --*this; return it; }
+    const_iterator &operator+=(difference_type n) {
+      const size_t i = index() + n;
+      if (chunk < v->chunks_.size() && i >= v->offsets_[chunk] && i < v->offsets_[chunk + 1]) {
+        offset = i - v->offsets_[chunk];
+      } else {
+        *this = v->iteratorAt(i);
+      }
+      return *this;
+    }
+    const_iterator &operator-=(difference_type n) { return *this += -n; }
+    const_iterator operator+(difference_type n) const { auto it = *this; return it += n; }
+    const_iterator operator-(difference_type n) const { auto it = *this; return it -= n; }
+    friend const_iterator operator+(difference_type n, const const_iterator &it) { return it + n; }
+    difference_type operator-(const const_iterator &it) const { return (difference_type)index() - (difference_type)it.index(); }
+
+    bool operator==(const const_iterator &it) const { return chunk == it.chunk && offset == it.offset; }
+    bool operator!=(const const_iterator &it) const { return !(*this == it); }
+    bool operator<(const const_iterator &it) const { return chunk < it.chunk || (chunk == it.chunk && offset < it.offset); }
+    bool operator>(const const_iterator &it) const { return it < *this; }
+    bool operator<=(const const_iterator &it) const { return !(it < *this); }
+    bool operator>=(const const_iterator &it) const { return !(*this < it); }
+
+  private:
+    friend class ChunkedVector;
+    const_iterator(const ChunkedVector *v, size_t chunk, size_t offset) : v(v), chunk(chunk), offset(offset) {}
+    const ChunkedVector *v = nullptr;
+    size_t chunk = 0;
+    size_t offset = 0;
+  };
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+  inline size_t size() const { return offsets_.back(); }
+  inline bool empty() const { return size() == 0; }
+  const T &operator[](size_t i) const {
+    const size_t c = chunkIndex(i);
+    return chunks_[c][i - offsets_[c]];
+  }
+  const T &front() const { return chunks_.front().front(); }
+  const T &back() const { return chunks_.back().back(); }
+
+  const_iterator begin() const { return {this, 0, 0}; }
+  const_iterator end() const { return {this, chunks_.size(), 0}; }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+  const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+  const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+  const_reverse_iterator crbegin() const { return rbegin(); }
+  const_reverse_iterator crend() const { return rend(); }
+
+  // insert [first, last) before the item at pos
+  template <class It>
+  void insert(size_t pos, It first, It last) {
+    const size_t n = std::distance(first, last);
+    if (n == 0) return;
+
+    auto [c, new_chunk] = chunkFor(pos, n);
+    if (new_chunk) {
+      chunks_.emplace(chunks_.begin() + c, first, last);
+    } else {
+      chunks_[c].insert(chunks_[c].begin() + (pos - offsets_[c]), first, last);
+    }
+    updateOffsets(c);
+  }
+  void insert(size_t pos, std::vector<T> &&items) {
+    if (items.empty()) return;
+
+    auto [c, new_chunk] = chunkFor(pos, items.size());
+    if (new_chunk) {
+      chunks_.emplace(chunks_.begin() + c, std::move(items));
+    } else {
+      chunks_[c].insert(chunks_[c].begin() + (pos - offsets_[c]), items.begin(), items.end());
+    }
+    updateOffsets(c);
+  }
+  void clear() {
+    chunks_.clear();
+    offsets_.assign(1, 0);
+  }
+
+private:
+  // small runs are appended to the chunk before them, so items streamed in don't make a chunk each
+  static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+  // the chunk holding item i, chunks_.size() if i is size()
+  inline size_t chunkIndex(size_t i) const {
+    return std::upper_bound(offsets_.begin(), offsets_.end(), i) - offsets_.begin() - 1;
+  }
+  const_iterator iteratorAt(size_t i) const {
+    const size_t c = chunkIndex(i);
+    return {this, c, i - offsets_[c]};
+  }
+  // the chunk n items inserted at pos go to, and whether it is a new one
+  std::pair<size_t, bool> chunkFor(size_t pos, size_t n) const {
+    const size_t c = chunkIndex(pos);
+    if (offsets_[c] != pos) return {c, false};
+    if (c > 0 && chunks_[c - 1].size() + n <= CHUNK_SIZE) return {c - 1, false};
+    return {c, true};
+  }
+  void updateOffsets(size_t from) {
+    offsets_.resize(chunks_.size() + 1);
+    for (size_t c = from; c < chunks_.size(); ++c) {
+      offsets_[c + 1] = offsets_[c] + chunks_[c].size();
+    }
+  }
+
+  // never empty, offsets_[c] is the index of the first item of chunks_[c], offsets_.back() the size
+  std::vector<std::vector<T>> chunks_;
+  std::vector<size_t> offsets_ = {0};
+};
+
 int num_decimals(double num);
 QString signalToolTip(const cabana::Signal *sig);
@@ -0,0 +1,230 @@
+#include <sys/resource.h>
+
+#include <atomic>
+#include <iostream>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTimer>
+
+#include "common/prefix.h"
+#include "common/timing.h"
+#include "tools/replay/replay.h"
+
+// headless benchmark of a local route: segment loading, streaming and video decoding.
+// results are written as JSON to track regressions between versions.
+
+// limit for loading, merging and streaming the benchmarked segments
+const int STREAM_TIMEOUT_MS = 60 * 1000;
+const int STREAM_TIMEOUT_MS_PER_SEGMENT = 30 * 1000;
+
+struct StreamCounter {
+  std::atomic<uint64_t> end_mono_time = 0;
+  std::atomic<uint64_t> events = 0;
+  std::atomic<uint64_t> first_ns = 0;
+  std::atomic<uint64_t> last_ns = 0;
+};
+
+static bool countEvent(const Event *e, void *opaque) {
+  auto counter = (StreamCounter *)opaque;
+  // events after the benchmarked segments are not published
+  if (e->mono_time > counter->end_mono_time) return true;
+
+  uint64_t ts = nanos_since_boot();
+  if (counter->events++ == 0) counter->first_ns = ts;
+  counter->last_ns = ts;
+  return false;
+}
+
+static QJsonObject toJson(const LoadStats &s) {
+  return {{"read_ms", s.read_ms}, {"decompress_ms", s.decompress_ms}, {"parse_ms", s.parse_ms}};
+}
+
+static double peakRssMB() {
+  struct rusage usage = {};
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+  return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+// the first loaded segment is kept for benchDecode, the others are freed once measured
+QJsonObject benchLoad(Route &route, int max_segments, uint32_t flags, std::unique_ptr<Segment> &first, int &loaded) {
+  QJsonArray results;
+  LoadStats log_total, video_total;
+  double total_ms = 0;
+  loaded = 0;
+  for (const auto &[n, files] : route.segments()) {
+    if (loaded >= max_segments) break;
+
+    const double start_ts = millis_since_boot();
+    QEventLoop loop;
+    auto seg = std::make_unique<Segment>(n, files, flags);
+    bool success = false;
+    // queued to this thread, loadFinished may be emitted before the loop runs
+    QObject::connect(seg.get(), &Segment::loadFinished, &loop, [&](bool ret) {
+      success = ret;
+      loop.quit();
+    });
+    loop.exec();
+    const double elapsed_ms = millis_since_boot() - start_ts;
+    if (!success) {
+      rWarning("failed to load segment %d", n);
+      continue;
+    }
+
+    QJsonArray video;
+    for (const auto &fr : seg->frames) {
+      if (!fr) continue;
+      video.append(toJson(fr->stats));
+      video_total.read_ms += fr->stats.read_ms;
+      video_total.parse_ms += fr->stats.parse_ms;
+    }
+    log_total.read_ms += seg->log->stats.read_ms;
+    log_total.decompress_ms += seg->log->stats.decompress_ms;
+    log_total.parse_ms += seg->log->stats.parse_ms;
+    total_ms += elapsed_ms;
+    results.append(QJsonObject{{"segment", n}, {"wall_ms", elapsed_ms}, {"events", (qint64)seg->log->events.size()},
+                               {"log", toJson(seg->log->stats)}, {"video", video}});
+    if (loaded++ == 0) first = std::move(seg);
+  }
+  return {{"wall_ms", total_ms}, {"log", toJson(log_total)}, {"video", toJson(video_total)}, {"segments", results}};
+}
+
+QJsonObject benchDecode(const Segment *seg, int max_frames) {
+  const char *camera_names[] = {"road", "driver", "wide_road"};
+  QJsonObject results;
+  for (auto cam : ALL_CAMERAS) {
+    auto &fr = seg->frames[cam];
+    if (!fr) continue;
+
+    auto [nv12_width, nv12_height, nv12_buffer_size] = get_nv12_info(fr->width, fr->height);
+    VisionBuf buf;
+    buf.allocate(nv12_buffer_size);
+    buf.init_yuv(fr->width, fr->height, nv12_width, nv12_width * nv12_height);
+
+    const int frames = std::min<int>(max_frames, fr->getFrameCount());
+    int decoded = 0;
+    const double start_ts = millis_since_boot();
+    for (int i = 0; i < frames; ++i) {
+      decoded += fr->get(i, &buf);
+    }
+    const double elapsed_ms = millis_since_boot() - start_ts;
+    buf.free();
+    results[camera_names[cam]] = QJsonObject{{"frames", decoded}, {"wall_ms", elapsed_ms},
+                                             {"fps", elapsed_ms > 0 ? decoded * 1000.0 / elapsed_ms : 0}};
+  }
+  return results;
+}
+
+QJsonObject benchStream(const QString &route, const QString &data_dir, int segments, uint32_t flags) {
+  StreamCounter counter;
+  Replay replay(route, {}, {}, nullptr, flags | REPLAY_FLAG_NO_VIPC | REPLAY_FLAG_NO_LOOP | REPLAY_FLAG_FULL_SPEED, data_dir);
+  if (!replay.load()) return {{"error", "failed to load the route"}};
+
+  // load and merge every segment before streaming, so only the stream loop is measured
+  replay.setSegmentCacheLimit(segments);
+  replay.setMemoryBudget(std::numeric_limits<int>::max(), std::numeric_limits<int>::max());
+  replay.installEventFilter(countEvent, &counter);
+  replay.pause(true);
+
+  QEventLoop loop;
+  QObject::connect(&replay, &Replay::segmentsMerged, [&]() {
+    const auto &segs = replay.segments();
+    auto last = std::next(segs.begin(), std::min<int>(segments, segs.size()));
+    bool all_loaded = std::all_of(segs.begin(), last, [](auto &s) { return s.second && s.second->isLoaded(); });
+    if (all_loaded && replay.isPaused()) {
+      counter.end_mono_time = std::prev(last)->second->log->events.back().mono_time;
+      replay.pause(false);
+    }
+  });
+  QTimer timer;
+  QObject::connect(&timer, &QTimer::timeout, [&]() {
+    // the stream is done once it stays idle at the end of the route
+    if (counter.events > 0 && nanos_since_boot() - counter.last_ns > 1e9) loop.quit();
+  });
+  timer.start(100);
+  // segments that never merge, or events that are never published, don't hang the bench
+  bool timed_out = false;
+  QTimer::singleShot(STREAM_TIMEOUT_MS + segments * STREAM_TIMEOUT_MS_PER_SEGMENT, &loop, [&]() {
+    timed_out = true;
+    loop.quit();
+  });
+  replay.start();
+  loop.exec();
+  replay.stop();
+  if (timed_out) {
+    rError("streaming %d segments timed out after %lu events", segments, counter.events.load());
+    return {{"error", "timed out"}, {"events", (qint64)counter.events}};
+  }
+
+  QJsonObject services;
+  for (const auto &[name, stats] : replay.publishStats()) {
+    services[name.c_str()] = QJsonObject{{"sent", (qint64)stats.sent}, {"dropped", (qint64)stats.dropped},
+                                         {"avg_send_us", stats.avg_send_us}, {"max_send_us", stats.max_send_us}};
+  }
+  const double elapsed_ms = (counter.last_ns - counter.first_ns) / 1e6;
+  return {{"events", (qint64)counter.events}, {"wall_ms", elapsed_ms},
+          {"events_per_sec", elapsed_ms > 0 ? counter.events * 1000.0 / elapsed_ms : 0},
+          {"services", services}};
+}
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Benchmark replay on a local route.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("route", "the route to benchmark");
+  parser.addOption({"data_dir", "local directory with routes", "data_dir"});
+  parser.addOption({"segments", "benchmark the first <n> segments. default is all", "n"});
+  parser.addOption({"frames", "decode <n> frames per camera. default is 1200", "n"});
+  parser.addOption({"output", "write JSON results to <file> instead of stdout", "file"});
+  parser.addOption({"no-hw-decoder", "disable HW video decoding"});
+  parser.process(app);
+
+  const QStringList args = parser.positionalArguments();
+  if (args.empty() || parser.value("data_dir").isEmpty()) {
+    parser.showHelp();
+  }
+
+  OpenpilotPrefix op_prefix;
+  uint32_t flags = REPLAY_FLAG_DCAM | REPLAY_FLAG_ECAM;
+  if (parser.isSet("no-hw-decoder")) flags |= REPLAY_FLAG_NO_HW_DECODER;
+
+  Route route(args.first(), parser.value("data_dir"));
+  if (!route.load()) {
+    rError("failed to load route %s from %s", qPrintable(args.first()), qPrintable(parser.value("data_dir")));
+    return 1;
+  }
+  const int max_segments = parser.value("segments").isEmpty() ? route.segments().size() : parser.value("segments").toInt();
+  const int max_frames = parser.value("frames").isEmpty() ? 1200 : parser.value("frames").toInt();
+
+  QJsonObject result;
+  std::unique_ptr<Segment> first;
+  int segment_count = 0;
+  result["load"] = benchLoad(route, max_segments, flags, first, segment_count);
+  if (!first) {
+    rError("no valid segments in route %s", qPrintable(args.first()));
+    return 1;
+  }
+  result["decode"] = benchDecode(first.get(), max_frames);
+  first.reset();
+  result["stream"] = benchStream(args.first(), parser.value("data_dir"), segment_count, flags);
+  result["peak_rss_mb"] = peakRssMB();
+
+  const QByteArray json = QJsonDocument(result).toJson();
+  if (parser.value("output").isEmpty()) {
+    std::cout << json.toStdString();
+  } else if (util::write_file(parser.value("output").toStdString().c_str(), json.data(), json.size(), O_WRONLY | O_CREAT | O_TRUNC) != 0) {
+    rError("failed to write %s", qPrintable(parser.value("output")));
+    return 1;
+  }
+  return result["stream"].toObject().contains("error") ? 1 : 0;
+}
@@ -1,6 +1,8 @@
 #include "tools/replay/camera.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <tuple>
 
 #include "third_party/linux/include/msm_media_info.h"
@@ -15,9 +17,11 @@ std::tuple<size_t, size_t, size_t> get_nv12_info(int width, int height) {
   return {nv12_width, nv12_height, nv12_buffer_size};
 }
 
-CameraServer::CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS]) {
+CameraServer::CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS], int frame_cache_mb, int buffer_count)
+    : buffer_count_(std::max(1, buffer_count)) {
   for (int i = 0; i < MAX_CAMERAS; ++i) {
     std::tie(cameras_[i].width, cameras_[i].height) = camera_size[i];
+    cameras_[i].cache = std::make_shared<FrameCache>((size_t)std::max(0, frame_cache_mb) * 1024 * 1024);
   }
   startVipcServer();
 }
@@ -25,9 +29,16 @@ CameraServer::CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS]) {
 CameraServer::~CameraServer() {
   for (auto &cam : cameras_) {
     if (cam.thread.joinable()) {
-      cam.queue.push({});
+      {
+        std::lock_guard lk(cam.lock);
+        cam.exit = true;
+      }
+      cam.cv.notify_all();
       cam.thread.join();
     }
+    if (cam.dropped > 0) {
+      rInfo("camera[%d] dropped %lu frames", cam.type, cam.dropped.load());
+    }
   }
   vipc_server_.reset(nullptr);
 }
@@ -38,7 +49,7 @@ void CameraServer::startVipcServer() {
     if (cam.width > 0 && cam.height > 0) {
       rInfo("camera[%d] frame size %dx%d", cam.type, cam.width, cam.height);
       auto [nv12_width, nv12_height, nv12_buffer_size] = get_nv12_info(cam.width, cam.height);
-      vipc_server_->create_buffers_with_sizes(cam.stream_type, YUV_BUFFER_COUNT, false, cam.width, cam.height,
+      vipc_server_->create_buffers_with_sizes(cam.stream_type, buffer_count_, false, cam.width, cam.height,
                                               nv12_buffer_size, nv12_width, nv12_width * nv12_height);
       if (!cam.thread.joinable()) {
         cam.thread = std::thread(&CameraServer::cameraThread, this, std::ref(cam));
@@ -49,41 +60,47 @@ void CameraServer::startVipcServer() {
 }
 
 void CameraServer::cameraThread(Camera &cam) {
-  auto read_frame = [&](FrameReader *fr, int frame_id) {
-    VisionBuf *yuv_buf = vipc_server_->get_buffer(cam.stream_type);
-    assert(yuv_buf);
-    bool ret = fr->get(frame_id, yuv_buf);
-    return ret ? yuv_buf : nullptr;
+  auto queue_empty = [&cam]() {
+    std::lock_guard lk(cam.lock);
+    return cam.queue.empty();
   };
 
   while (true) {
-    const auto [fr, eidx] = cam.queue.pop();
-    if (!fr) break;
-
-    const int id = eidx.getSegmentId();
-    bool prefetched = (id == cam.cached_id && eidx.getSegmentNum() == cam.cached_seg);
-    auto yuv = prefetched ? cam.cached_buf : read_frame(fr, id);
-    if (yuv) {
-      VisionIpcBufExtra extra = {
-          .frame_id = eidx.getFrameId(),
-          .timestamp_sof = eidx.getTimestampSof(),
-          .timestamp_eof = eidx.getTimestampEof(),
-      };
-      yuv->set_frame_id(eidx.getFrameId());
-      vipc_server_->send(yuv, &extra);
-    } else {
-      rError("camera[%d] failed to get frame: %lu", cam.type, eidx.getSegmentId());
+    Frame frame;
+    {
+      std::unique_lock lk(cam.lock);
+      cam.cv.wait(lk, [&cam]() { return cam.exit || !cam.queue.empty(); });
+      if (cam.exit) break;
+
+      frame = std::move(cam.queue.front());
+      cam.queue.pop_front();
     }
+    cam.cv.notify_all();  // a slot is free for a waiting pushFrame
 
-    cam.cached_id = id + 1;
-    cam.cached_seg = eidx.getSegmentNum();
-    cam.cached_buf = read_frame(fr, cam.cached_id);
+    auto &fr = frame.fr;
+    fr->setCache(cam.cache);
+    VisionBuf *yuv = vipc_server_->get_buffer(cam.stream_type);
+    assert(yuv);
+    if (fr->get(frame.index, yuv)) {
+      yuv->set_frame_id(frame.extra.frame_id);
+      vipc_server_->send(yuv, &frame.extra);
+    } else {
+      rError("camera[%d] failed to get frame: %d", cam.type, frame.index);
+    }
 
     --publishing_;
+
+    // decode ahead of the playhead until the next frame is requested. fr stays valid after
+    // publishing_ drops to zero, the shared_ptr keeps it alive even if its segment is freed.
+    const int max_frames = std::max<int>(1, cam.cache->maxBytes() / fr->getYUVSize() / 2);
+    const int lookahead = std::min<int>(max_frames, std::ceil(FRAME_LOOKAHEAD * std::max(1.0f, speed_.load())));
+    for (int i = frame.index + 1; i <= frame.index + lookahead && queue_empty();) {
+      i = fr->prefetch(i, frame.index + lookahead);
+    }
   }
 }
 
-void CameraServer::pushFrame(CameraType type, FrameReader *fr, const cereal::EncodeIndex::Reader &eidx) {
+void CameraServer::pushFrame(CameraType type, std::shared_ptr<FrameReader> fr, const Event *event) {
   auto &cam = cameras_[type];
   if (cam.width != fr->width || cam.height != fr->height) {
     cam.width = fr->width;
@@ -92,8 +109,35 @@ void CameraServer::pushFrame(CameraType type, FrameReader *fr, const cereal::Enc
     startVipcServer();
   }
 
-  ++publishing_;
-  cam.queue.push({fr, eidx});
+  capnp::FlatArrayMessageReader reader(event->data);
+  auto evt = reader.getRoot<cereal::Event>();
+  auto eidx = capnp::AnyStruct::Reader(evt).getPointerSection()[0].getAs<cereal::EncodeIndex>();
+  Frame frame = {
+    .fr = fr,
+    .index = (int)eidx.getSegmentId(),
+    .extra = {
+      .frame_id = eidx.getFrameId(),
+      .timestamp_sof = eidx.getTimestampSof(),
+      .timestamp_eof = eidx.getTimestampEof(),
+    },
+  };
+
+  {
+    std::unique_lock lk(cam.lock);
+    if (!drop_frames_ || speed_ <= 1) {
+      // every frame is sent at up to 1x, the decoder only falls behind for a while, e.g. on a seek
+      cam.cv.wait(lk, [&cam]() { return cam.exit || cam.queue.size() < FRAME_QUEUE_DEPTH; });
+      if (cam.exit) return;
+    } else if (cam.queue.size() >= FRAME_QUEUE_DEPTH) {
+      // skip the oldest frame instead of holding up the messages
+      cam.queue.pop_front();
+      ++cam.dropped;
+      --publishing_;
+    }
+    ++publishing_;
+    cam.queue.push_back(std::move(frame));
+  }
+  cam.cv.notify_all();
 }
 
 void CameraServer::waitForSent() {
@@ -2,35 +2,58 @@
 
 #include <unistd.h>
 
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <tuple>
 #include <utility>
 
 #include "cereal/visionipc/visionipc_server.h"
-#include "common/queue.h"
 #include "tools/replay/framereader.h"
 #include "tools/replay/logreader.h"
 
+// per camera budget for decoded frames
+constexpr int DEFAULT_FRAME_CACHE_MB = 256;
+// number of frames decoded ahead of the playhead at 1x speed
+constexpr int FRAME_LOOKAHEAD = 10;
+// frames waiting to be sent per camera. when the decoder falls behind above 1x, the oldest one is dropped
+constexpr int FRAME_QUEUE_DEPTH = 4;
+
 std::tuple<size_t, size_t, size_t> get_nv12_info(int width, int height);
 
 class CameraServer {
 public:
-  CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS] = nullptr);
+  CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS] = nullptr, int frame_cache_mb = DEFAULT_FRAME_CACHE_MB,
+               int buffer_count = YUV_BUFFER_COUNT);
   ~CameraServer();
-  void pushFrame(CameraType type, FrameReader* fr, const cereal::EncodeIndex::Reader& eidx);
+  // blocks while the queue is full at up to 1x or with dropping frames turned off.
+  // the frame does not refer to event after it returns
+  void pushFrame(CameraType type, std::shared_ptr<FrameReader> fr, const Event *event);
   void waitForSent();
+  inline void setSpeed(float speed) { speed_ = speed; }
+  // above 1x, drop the oldest frame when the queue is full. otherwise wait for a free slot and send every frame
+  inline void setDropFrames(bool drop) { drop_frames_ = drop; }
+  inline uint64_t droppedFrames(CameraType type) const { return cameras_[type].dropped; }
 
 protected:
+  struct Frame {
+    std::shared_ptr<FrameReader> fr;
+    int index;  // in the video
+    VisionIpcBufExtra extra;
+  };
   struct Camera {
     CameraType type;
     VisionStreamType stream_type;
     int width;
     int height;
     std::thread thread;
-    SafeQueue<std::pair<FrameReader*, const cereal::EncodeIndex::Reader>> queue;
-    int cached_id = -1;
-    int cached_seg = -1;
-    VisionBuf * cached_buf;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<Frame> queue;
+    bool exit = false;
+    std::atomic<uint64_t> dropped = 0;
+    std::shared_ptr<FrameCache> cache;
   };
   void startVipcServer();
   void cameraThread(Camera &cam);
@@ -41,5 +64,8 @@ protected:
       {.type = WideRoadCam, .stream_type = VISION_STREAM_WIDE_ROAD},
   };
   std::atomic<int> publishing_ = 0;
+  std::atomic<float> speed_ = 1.0;
+  std::atomic<bool> drop_frames_ = true;
+  const int buffer_count_;
   std::unique_ptr<VisionIpcServer> vipc_server_;
 };
@@ -0,0 +1,74 @@
+#include <csignal>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+
+#include "tools/replay/exporter.h"
+#include "tools/replay/replay.h"
+
+// cut a time range, services and cameras out of a route into a new local route, without replaying it.
+
+static std::atomic<bool> do_exit = false;
+
+static void sigHandler(int s) {
+  do_exit = true;
+}
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+
+  const std::tuple<QString, REPLAY_FLAGS, QString> flags[] = {
+      {"dcam", REPLAY_FLAG_DCAM, "export driver camera"},
+      {"ecam", REPLAY_FLAG_ECAM, "export wide road camera"},
+      {"qcam", REPLAY_FLAG_QCAMERA, "export qcamera instead of road camera"},
+      {"no-video", REPLAY_FLAG_NO_VIPC, "do not export videos"},
+      {"no-cache", REPLAY_FLAG_NO_FILE_CACHE, "turn off local cache"},
+  };
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Export a part of a route without replaying it.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("route", "the route to export");
+  parser.addOption({"output", "write the exported route to <dir>. load it with replay --data_dir <dir>", "dir"});
+  parser.addOption({"data_dir", "local directory with routes", "data_dir"});
+  parser.addOption({{"s", "start"}, "export from <seconds>", "seconds"});
+  parser.addOption({{"e", "end"}, "export till <seconds>. default is the end of the route", "seconds"});
+  parser.addOption({"segments", "export the segments in the comma separated <list> only", "list"});
+  parser.addOption({{"a", "allow"}, "whitelist of services to export", "allow"});
+  parser.addOption({{"b", "block"}, "blacklist of services to export", "block"});
+  parser.addOption({{"j", "jobs"}, "export <n> segments in parallel. default is the number of cores", "n"});
+  for (auto &[name, _, desc] : flags) {
+    parser.addOption({name, desc});
+  }
+  parser.process(app);
+
+  const QStringList args = parser.positionalArguments();
+  if (args.empty() || parser.value("output").isEmpty()) {
+    parser.showHelp();
+  }
+
+  ExportOptions options = {.output_dir = parser.value("output").toStdString()};
+  if (parser.isSet("start")) options.start_seconds = parser.value("start").toDouble();
+  if (parser.isSet("end")) options.end_seconds = parser.value("end").toDouble();
+  for (const auto &n : parser.value("segments").split(",", QString::SkipEmptyParts)) {
+    options.segments.push_back(n.toInt());
+  }
+  options.allow = parser.value("allow").isEmpty() ? QStringList{} : parser.value("allow").split(",");
+  options.block = parser.value("block").isEmpty() ? QStringList{} : parser.value("block").split(",");
+  options.jobs = parser.value("jobs").toInt();
+  for (const auto &[name, flag, _] : flags) {
+    if (parser.isSet(name)) options.flags |= flag;
+  }
+
+  Route route(args.first(), parser.value("data_dir"));
+  if (!route.load()) {
+    rError("failed to load route %s", qPrintable(args.first()));
+    return 1;
+  }
+
+  std::signal(SIGINT, sigHandler);
+  std::signal(SIGTERM, sigHandler);
+  const int exported = RouteExporter(route, options).run(&do_exit);
+  rInfo("exported %d segments of %s", exported, qPrintable(route.name()));
+  return exported > 0 ? 0 : 1;
+}
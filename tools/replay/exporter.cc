@@ -0,0 +1,203 @@
+#include "tools/replay/exporter.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <array>
+#include <limits>
+
+#include <QThreadPool>
+#include <QUrl>
+#include <QtConcurrent>
+
+#include <capnp/dynamic.h>
+#include "cereal/services.h"
+#include "common/util.h"
+#include "tools/replay/replay.h"
+
+namespace {
+
+// the encodeIdx service of each camera, indexed by CameraType
+const cereal::Event::Which ENCODE_IDX[] = {
+  cereal::Event::Which::ROAD_ENCODE_IDX,
+  cereal::Event::Which::DRIVER_ENCODE_IDX,
+  cereal::Event::Which::WIDE_ROAD_ENCODE_IDX,
+};
+
+std::string fileName(const QString &file) {
+  QString name = QUrl(file).fileName();
+  const int pos = name.lastIndexOf("--");
+  return (pos != -1 ? name.mid(pos + 2) : name).toStdString();
+}
+
+// compress into independent frames, so the log is decompressed in parallel when it is loaded
+bool compressLog(const std::string &in, std::string &out) {
+  for (size_t pos = 0; pos < in.size(); pos += LOG_BLOCK_SIZE) {
+    const size_t len = std::min(LOG_BLOCK_SIZE, in.size() - pos);
+    const size_t offset = out.size();
+    out.resize(offset + ZSTD_compressBound(len));
+    size_t ret = ZSTD_compress(out.data() + offset, out.size() - offset, in.data() + pos, len, 3);
+    if (ZSTD_isError(ret)) return false;
+
+    out.resize(offset + ret);
+  }
+  return true;
+}
+
+bool writeFile(const std::string &file, const std::string &content) {
+  const std::string tmp_file = file + ".tmp" + std::to_string(getpid());
+  if (util::write_file(tmp_file.c_str(), content.data(), content.size(), O_WRONLY | O_CREAT | O_TRUNC) != 0 ||
+      ::rename(tmp_file.c_str(), file.c_str()) != 0) {
+    rError("failed to write %s", file.c_str());
+    ::unlink(tmp_file.c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+RouteExporter::RouteExporter(const Route &route, const ExportOptions &options) : route_(route), options_(options) {
+  auto event_struct = capnp::Schema::from<cereal::Event>().asStruct();
+  filters_.resize(event_struct.getUnionFields().size(), false);
+  for (const auto &[name, _] : services) {
+    if (!options_.block.contains(name.c_str()) && (options_.allow.empty() || options_.allow.contains(name.c_str()))) {
+      filters_[event_struct.getFieldByName(name).getProto().getDiscriminantValue()] = true;
+    }
+  }
+  // a route can't be replayed without them
+  filters_[cereal::Event::Which::INIT_DATA] = filters_[cereal::Event::Which::CAR_PARAMS] = true;
+  // the frames of the exported videos are found by their encodeIdx
+  if (!(options_.flags & REPLAY_FLAG_NO_VIPC)) {
+    filters_[cereal::Event::Which::ROAD_ENCODE_IDX] = true;
+    if (options_.flags & REPLAY_FLAG_DCAM) filters_[cereal::Event::Which::DRIVER_ENCODE_IDX] = true;
+    if (options_.flags & REPLAY_FLAG_ECAM) filters_[cereal::Event::Which::WIDE_ROAD_ENCODE_IDX] = true;
+  }
+}
+
+std::string RouteExporter::segmentDir(int n) const {
+  return options_.output_dir + "/" + route_.identifier().timestamp.toStdString() + "--" + std::to_string(n);
+}
+
+int RouteExporter::run(std::atomic<bool> *abort) {
+  std::vector<int> segments;
+  for (const auto &[n, _] : route_.segments()) {
+    const bool selected = options_.segments.empty() ||
+                          std::find(options_.segments.begin(), options_.segments.end(), n) != options_.segments.end();
+    // segments are 60 seconds long
+    const bool in_range = (n + 1) * 60 > options_.start_seconds && (options_.end_seconds < 0 || n * 60 < options_.end_seconds);
+    if (selected && in_range) segments.push_back(n);
+  }
+
+  // each job loads a whole segment, the pool bounds the memory used at once
+  QThreadPool pool;
+  if (options_.jobs > 0) pool.setMaxThreadCount(options_.jobs);
+  std::atomic<int> exported = 0;
+  QFutureSynchronizer<void> synchronizer;
+  for (int n : segments) {
+    synchronizer.addFuture(QtConcurrent::run(&pool, [this, n, abort, &exported]() {
+      if (abort && *abort) return;
+
+      if (exportSegment(n, route_.segments().at(n), abort)) {
+        ++exported;
+        rInfo("exported segment %d to %s", n, segmentDir(n).c_str());
+      } else {
+        rWarning("failed to export segment %d", n);
+      }
+    }));
+  }
+  synchronizer.waitForFinished();
+  return exported;
+}
+
+bool RouteExporter::exportSegment(int n, const SegmentFile &files, std::atomic<bool> *abort) const {
+  const bool local_cache = !(options_.flags & REPLAY_FLAG_NO_FILE_CACHE);
+  const QString &log_file = files.rlog.isEmpty() ? files.qlog : files.rlog;
+  if (log_file.isEmpty()) return false;
+
+  LogReader log(filters_);
+  if (!log.load(log_file.toStdString(), abort, local_cache, 0, 3) || log.events.empty()) return false;
+
+  // the range of the segment to export, relative to its first event
+  const uint64_t seg_start = log.events.front().mono_time;
+  const double from = options_.start_seconds - n * 60;
+  const double to = options_.end_seconds - n * 60;
+  const uint64_t begin_ts = from > 0 ? seg_start + from * 1e9 : 0;
+  const uint64_t end_ts = options_.end_seconds >= 0 && to < 60 ? seg_start + to * 1e9 : std::numeric_limits<uint64_t>::max();
+
+  const std::string dir = segmentDir(n);
+  if (!util::create_directories(dir, 0775)) {
+    rError("failed to create %s", dir.c_str());
+    return false;
+  }
+
+  // [RoadCam, DriverCam, WideRoadCam], as loaded by Segment
+  const std::array video_files = {
+    (options_.flags & REPLAY_FLAG_QCAMERA) || files.road_cam.isEmpty() ? files.qcamera : files.road_cam,
+    options_.flags & REPLAY_FLAG_DCAM ? files.driver_cam : "",
+    options_.flags & REPLAY_FLAG_ECAM ? files.wide_road_cam : "",
+  };
+  // the first frame kept in each exported video, -1 if the camera is not exported
+  int key_frames[MAX_CAMERAS] = {-1, -1, -1};
+  for (auto cam : ALL_CAMERAS) {
+    if (video_files[cam].isEmpty() || (options_.flags & REPLAY_FLAG_NO_VIPC)) continue;
+
+    int first = std::numeric_limits<int>::max(), last = -1, before = -1, after = -1;
+    for (const Event &e : log.events) {
+      if (e.which != ENCODE_IDX[cam] || e.frame) continue;
+
+      capnp::FlatArrayMessageReader reader(e.data);
+      auto idx = capnp::AnyStruct::Reader(reader.getRoot<cereal::Event>()).getPointerSection()[0].getAs<cereal::EncodeIndex>();
+      const int frame = idx.getSegmentId();
+      if (e.mono_time < begin_ts) {
+        before = frame;
+      } else if (e.mono_time >= end_ts) {
+        if (after < 0) after = frame;
+      } else {
+        first = std::min(first, frame);
+        last = std::max(last, frame);
+      }
+    }
+    // no frame of the camera is in the range. the segment is invalid without its videos,
+    // so the GOP at the start of the range is kept, none of its frames is published.
+    if (last < 0) first = last = before >= 0 ? before : std::max(after, 0);
+
+    FrameReader fr;
+    if (!fr.load(video_files[cam].toStdString(), true, abort, local_cache, 20 * 1024 * 1024, 3)) return false;
+
+    key_frames[cam] = fr.exportFrames(first, last, dir + "/" + fileName(video_files[cam]));
+    if (key_frames[cam] < 0) return false;
+  }
+
+  std::string content;
+  for (const Event &e : log.events) {
+    if (e.frame) continue;
+    const bool always = e.which == cereal::Event::Which::INIT_DATA || e.which == cereal::Event::Which::CAR_PARAMS;
+    if (!always && (e.mono_time < begin_ts || e.mono_time >= end_ts)) continue;
+
+    auto cam = std::find(std::begin(ENCODE_IDX), std::end(ENCODE_IDX), e.which) - std::begin(ENCODE_IDX);
+    if (cam < MAX_CAMERAS && key_frames[cam] > 0) {
+      // the exported video starts at the key frame, the frames of the segment are indexed from it
+      capnp::FlatArrayMessageReader reader(e.data);
+      capnp::MallocMessageBuilder msg;
+      msg.setRoot(reader.getRoot<cereal::Event>());
+      auto idx = capnp::AnyStruct::Builder(msg.getRoot<cereal::Event>()).getPointerSection()[0].getAs<cereal::EncodeIndex>();
+      idx.setSegmentId(idx.getSegmentId() - key_frames[cam]);
+      auto words = capnp::messageToFlatArray(msg);
+      content.append((const char *)words.asBytes().begin(), words.asBytes().size());
+    } else {
+      content.append((const char *)e.bytes().begin(), e.bytes().size());
+    }
+  }
+
+  // written under the name of its source, a qlog stays a qlog
+  const std::string log_name = files.rlog.isEmpty() ? "qlog.zst" : "rlog.zst";
+  std::string compressed;
+  if (!compressLog(content, compressed)) {
+    rError("failed to compress the log of segment %d", n);
+    return false;
+  }
+  return writeFile(dir + "/" + log_name, compressed);
+}
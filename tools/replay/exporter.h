@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <QStringList>
+
+#include "tools/replay/route.h"
+
+struct ExportOptions {
+  std::string output_dir;  // the route is written as <output_dir>/<timestamp>--<n>/, loadable with --data_dir
+  double start_seconds = 0;  // from the start of the route
+  double end_seconds = -1;   // till the end of the route if negative
+  std::vector<int> segments;  // all of them if empty
+  QStringList allow;
+  QStringList block;
+  uint32_t flags = 0;  // REPLAY_FLAG_DCAM, ECAM, QCAMERA, NO_VIPC and NO_FILE_CACHE are used
+  int jobs = 0;        // segments exported in parallel, the number of cores if 0
+};
+
+// Cuts a time range, a set of services and cameras out of a route without replaying it.
+// Logs are filtered and recompressed, videos are remuxed from the key frame before the range
+// without re-encoding, and the segment ids of the kept encodeIdx events are shifted to match.
+// A segment with no frame of a camera in the range gets the GOP at the start of the range.
+class RouteExporter {
+public:
+  RouteExporter(const Route &route, const ExportOptions &options);
+  // returns the number of exported segments
+  int run(std::atomic<bool> *abort = nullptr);
+
+private:
+  bool exportSegment(int n, const SegmentFile &files, std::atomic<bool> *abort) const;
+  std::string segmentDir(int n) const;
+
+  const Route &route_;
+  const ExportOptions options_;
+  std::vector<bool> filters_;
+};
@@ -0,0 +1,417 @@
+#include "tools/replay/filecache.h"
+
+#include <dirent.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "common/util.h"
+#include "tools/replay/filereader.h"
+#include "tools/replay/util.h"
+
+namespace {
+
+const char *MANIFEST_FILE = "manifest";
+const uint32_t SEEK_TABLE_MAGIC = 0x31534b52;  // "RKS1"
+const int64_t ACCESS_FLUSH_INTERVAL_MS = 60 * 1000;
+const char *SIDECAR_SUFFIXES[] = {FRAME_INDEX_SUFFIX, TIMELINE_SUFFIX};
+// the hash of an entry adopted from a cache without manifest, which was never hashed
+const char *UNKNOWN_HASH = "-";
+// temporary files younger than this may still be written by another process
+const int64_t STALE_TMP_FILE_MS = 60 * 60 * 1000;
+
+// footer of a compressed entry, after the compressed size of each frame
+struct SeekTableFooter {
+  uint32_t frame_count;
+  uint32_t frame_size;
+  uint32_t magic;
+};
+
+int64_t now_ms() {
+  using namespace std::chrono;
+  return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+bool pread_all(int fd, char *buf, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t n = HANDLE_EINTR(pread(fd, buf, size, offset));
+    if (n <= 0) return false;
+    buf += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+// write to a temporary file of a unique name first, so a reader never sees a partial file
+// and writers of the same file in other threads don't interleave their content
+bool writeFileAtomic(const std::string &path, const std::string &content) {
+  std::string tmp_path = path + ".tmpXXXXXX";
+  unique_fd fd(HANDLE_EINTR(mkstemp(tmp_path.data())));
+  if (fd == -1) return false;
+
+  const char *data = content.data();
+  size_t size = content.size();
+  while (size > 0) {
+    ssize_t n = HANDLE_EINTR(write(fd, data, size));
+    if (n <= 0) break;
+    data += n;
+    size -= n;
+  }
+  if (size > 0 || fchmod(fd, 0664) != 0 || ::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    ::unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// compress into independent frames, or return false if it saves less than 5%.
+// each frame carries a checksum of its content, verified whenever it is decompressed.
+bool compressFrames(const std::string &in, std::string &out) {
+  std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+  if (!cctx) return false;
+  ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_compressionLevel, 1);
+  ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_checksumFlag, 1);
+
+  std::vector<uint32_t> frame_sizes;
+  out.reserve(in.size());
+  for (size_t pos = 0; pos < in.size(); pos += CACHE_FRAME_SIZE) {
+    const size_t len = std::min(CACHE_FRAME_SIZE, in.size() - pos);
+    const size_t offset = out.size();
+    out.resize(offset + ZSTD_compressBound(len));
+    size_t ret = ZSTD_compress2(cctx.get(), out.data() + offset, out.size() - offset, in.data() + pos, len);
+    if (ZSTD_isError(ret)) return false;
+
+    out.resize(offset + ret);
+    frame_sizes.push_back(ret);
+    // already compressed files (logs and videos) are detected on the first frame
+    if (pos == 0 && ret > len * 0.95) return false;
+  }
+  SeekTableFooter footer = {.frame_count = (uint32_t)frame_sizes.size(), .frame_size = (uint32_t)CACHE_FRAME_SIZE, .magic = SEEK_TABLE_MAGIC};
+  out.append((const char *)frame_sizes.data(), frame_sizes.size() * sizeof(uint32_t));
+  out.append((const char *)&footer, sizeof(footer));
+  return out.size() < in.size() * 0.95;
+}
+
+}  // namespace
+
+FileCache &FileCache::instance() {
+  static FileCache cache([] {
+    std::string path = cacheFilePath("");
+    return path.substr(0, path.rfind('/') + 1);
+  }());
+  return cache;
+}
+
+FileCache::FileCache(const std::string &cache_dir) {
+  cache_dir_ = cache_dir.empty() || cache_dir.back() == '/' ? cache_dir : cache_dir + "/";
+  util::create_directories(cache_dir_, 0755);
+  last_flush_ms_ = now_ms();
+}
+
+// read the manifest, locked against writers in other threads and processes
+template <class F>
+auto FileCache::readManifest(F &&f) {
+  std::lock_guard lk(lock_);
+  unique_fd lock_fd(HANDLE_EINTR(open((cache_dir_ + MANIFEST_FILE + ".lock").c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0664)));
+  if (lock_fd != -1) HANDLE_EINTR(flock(lock_fd, LOCK_SH));
+
+  auto result = f(loadManifest());
+  if (lock_fd != -1) flock(lock_fd, LOCK_UN);
+  return result;
+}
+
+// read-modify-write the manifest, locked against other threads and processes.
+// the pending access times are written with it.
+template <class F>
+auto FileCache::updateManifest(F &&f) {
+  std::lock_guard lk(lock_);
+  unique_fd lock_fd(HANDLE_EINTR(open((cache_dir_ + MANIFEST_FILE + ".lock").c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0664)));
+  if (lock_fd != -1) HANDLE_EINTR(flock(lock_fd, LOCK_EX));
+
+  Manifest &manifest = loadManifest();
+  // the manifest is created, the files of a cache without one are counted from now on
+  bool accessed = manifest_stat_.st_ino == 0 && adoptFiles(manifest);
+  for (const auto &[key, ts] : accessed_) {
+    if (auto it = manifest.find(key); it != manifest.end() && it->second.last_access < ts) {
+      it->second.last_access = ts;
+      accessed = true;
+    }
+  }
+  accessed_.clear();
+  last_flush_ms_ = now_ms();
+
+  auto [result, changed] = f(manifest);
+  if (changed || accessed) {
+    saveManifest(manifest);
+  }
+  if (lock_fd != -1) flock(lock_fd, LOCK_UN);
+  return result;
+}
+
+FileCache::~FileCache() {
+  if (!accessed_.empty()) {
+    updateManifest([](Manifest &) { return std::pair{true, false}; });
+  }
+}
+
+FileCache::Manifest &FileCache::loadManifest() {
+  struct stat st = {};
+  if (stat((cache_dir_ + MANIFEST_FILE).c_str(), &st) != 0) {
+    manifest_.clear();
+    manifest_stat_ = {};
+    return manifest_;
+  }
+  // the manifest is replaced by a rename on each write
+  if (st.st_ino == manifest_stat_.st_ino && st.st_size == manifest_stat_.st_size &&
+      st.st_mtim.tv_sec == manifest_stat_.st_mtim.tv_sec && st.st_mtim.tv_nsec == manifest_stat_.st_mtim.tv_nsec) {
+    return manifest_;
+  }
+
+  Manifest manifest;
+  std::istringstream stream(util::read_file(cache_dir_ + MANIFEST_FILE));
+  std::string line;
+  while (std::getline(stream, line)) {
+    std::istringstream fields(line);
+    std::string key;
+    Entry e;
+    if (fields >> key >> e.size >> e.stored_size >> e.compressed >> e.hash >> e.last_access) {
+      manifest[key] = e;
+    }
+  }
+  manifest_ = std::move(manifest);
+  manifest_stat_ = st;
+  return manifest_;
+}
+
+void FileCache::saveManifest(const Manifest &manifest) {
+  std::ostringstream stream;
+  for (const auto &[key, e] : manifest) {
+    stream << key << " " << e.size << " " << e.stored_size << " " << e.compressed << " " << e.hash << " " << e.last_access << "\n";
+  }
+  const std::string content = stream.str();
+  const std::string path = cache_dir_ + MANIFEST_FILE;
+  if (!writeFileAtomic(path, content)) {
+    rWarning("failed to write cache manifest %s", path.c_str());
+    // parsed again on next use
+    manifest_stat_ = {};
+    return;
+  }
+  if (&manifest != &manifest_) manifest_ = manifest;
+  if (stat(path.c_str(), &manifest_stat_) != 0) manifest_stat_ = {};
+}
+
+bool FileCache::adoptFiles(Manifest &manifest) {
+  DIR *dir = opendir(cache_dir_.c_str());
+  if (!dir) return false;
+
+  auto is_key = [](const std::string &name) {
+    return name.size() == 64 && std::all_of(name.begin(), name.end(), [](char c) { return isxdigit(c) && !isupper(c); });
+  };
+  bool adopted = false;
+  const int64_t now = now_ms();
+  while (struct dirent *ent = readdir(dir)) {
+    const std::string name = ent->d_name;
+    struct stat st = {};
+    if (name.rfind(MANIFEST_FILE, 0) == 0 || lstat((cache_dir_ + name).c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+    const int64_t mtime = st.st_mtim.tv_sec * 1000 + st.st_mtim.tv_nsec / 1000000;
+    if (is_key(name)) {
+      // a file downloaded as is, the least recently used ones are evicted first
+      manifest[name] = {.size = (size_t)st.st_size, .stored_size = (size_t)st.st_size, .hash = UNKNOWN_HASH, .last_access = mtime};
+      adopted = true;
+    } else if (name.find(".tmp") == std::string::npos || now - mtime > STALE_TMP_FILE_MS) {
+      // files derived from unknown entries and leftovers of interrupted writes
+      ::unlink((cache_dir_ + name).c_str());
+    }
+  }
+  closedir(dir);
+  return adopted;
+}
+
+bool FileCache::lookup(const std::string &key, Entry &entry) {
+  const bool found = readManifest([&](const Manifest &manifest) {
+    auto it = manifest.find(key);
+    if (it == manifest.end()) return false;
+
+    entry = it->second;
+    return true;
+  });
+  if (!found) return false;
+
+  // reads don't rewrite the manifest, the access time is kept until the next write
+  bool flush = false;
+  {
+    std::lock_guard lk(lock_);
+    entry.last_access = accessed_[key] = now_ms();
+    flush = entry.last_access - last_flush_ms_ >= ACCESS_FLUSH_INTERVAL_MS;
+  }
+  if (flush) {
+    updateManifest([](Manifest &) { return std::pair{true, false}; });
+  }
+  return true;
+}
+
+std::string FileCache::filePath(const std::string &url) const {
+  return cache_dir_ + sha256(getUrlWithoutQuery(url));
+}
+
+bool FileCache::sidecar(const std::string &url, const char *suffix, std::string &path, std::string &hash) {
+  const std::string key = sha256(getUrlWithoutQuery(url));
+  return readManifest([&](const Manifest &manifest) {
+    auto it = manifest.find(key);
+    if (it == manifest.end()) return false;
+
+    path = cache_dir_ + key + suffix;
+    hash = it->second.hash;
+    return true;
+  });
+}
+
+bool FileCache::get(const std::string &url, std::string &content) {
+  const std::string key = sha256(getUrlWithoutQuery(url));
+  Entry entry;
+  if (!lookup(key, entry)) return false;
+
+  // the content is hashed once, when it is stored. a read checks the size on disk and
+  // the checksums of compressed frames, uncompressed files are checked by their decoders.
+  if (!readEntry(key, entry, 0, entry.size, content)) {
+    rWarning("removing corrupt cache entry for %s", getUrlWithoutQuery(url).c_str());
+    remove(url);
+    content.clear();
+    return false;
+  }
+  return true;
+}
+
+bool FileCache::get(const std::string &url, size_t offset, size_t size, std::string &content) {
+  const std::string key = sha256(getUrlWithoutQuery(url));
+  Entry entry;
+  if (!lookup(key, entry) || offset > entry.size) return false;
+
+  return readEntry(key, entry, offset, std::min(size, entry.size - offset), content);
+}
+
+std::string FileCache::rawFile(const std::string &url) {
+  const std::string key = sha256(getUrlWithoutQuery(url));
+  Entry entry;
+  if (!lookup(key, entry) || entry.compressed) return {};
+
+  // the size is checked here, like for any read of an uncompressed entry
+  struct stat st = {};
+  const std::string path = cache_dir_ + key;
+  return (stat(path.c_str(), &st) == 0 && (size_t)st.st_size == entry.stored_size) ? path : "";
+}
+
+bool FileCache::readEntry(const std::string &key, const Entry &entry, size_t offset, size_t size, std::string &content) {
+  unique_fd fd(HANDLE_EINTR(open((cache_dir_ + key).c_str(), O_RDONLY | O_CLOEXEC)));
+  struct stat st = {};
+  if (fd == -1 || fstat(fd, &st) != 0 || (size_t)st.st_size != entry.stored_size) return false;
+
+  content.resize(size);
+  if (!entry.compressed) {
+    return pread_all(fd, content.data(), size, offset);
+  }
+
+  SeekTableFooter footer = {};
+  if (entry.stored_size < sizeof(footer) || !pread_all(fd, (char *)&footer, sizeof(footer), entry.stored_size - sizeof(footer)) ||
+      footer.magic != SEEK_TABLE_MAGIC || footer.frame_size == 0 ||
+      footer.frame_count != (entry.size + footer.frame_size - 1) / footer.frame_size) {
+    return false;
+  }
+  std::vector<uint32_t> frame_sizes(footer.frame_count);
+  const size_t table_size = frame_sizes.size() * sizeof(uint32_t);
+  if (entry.stored_size < sizeof(footer) + table_size ||
+      !pread_all(fd, (char *)frame_sizes.data(), table_size, entry.stored_size - sizeof(footer) - table_size)) {
+    return false;
+  }
+
+  // decompress only the frames overlapping [offset, offset + size)
+  std::string compressed, frame(footer.frame_size, '\0');
+  size_t frame_offset = 0;
+  for (size_t i = 0; i < frame_sizes.size() && size > 0; frame_offset += frame_sizes[i++]) {
+    const size_t begin = i * footer.frame_size;
+    const size_t end = std::min<size_t>(begin + footer.frame_size, entry.size);
+    if (end <= offset) continue;
+
+    compressed.resize(frame_sizes[i]);
+    if (!pread_all(fd, compressed.data(), compressed.size(), frame_offset)) return false;
+    size_t ret = ZSTD_decompress(frame.data(), frame.size(), compressed.data(), compressed.size());
+    if (ZSTD_isError(ret) || ret != end - begin) return false;
+
+    const size_t len = std::min(size, end - offset);
+    memcpy(content.data() + content.size() - size, frame.data() + (offset - begin), len);
+    offset += len;
+    size -= len;
+  }
+  return size == 0;
+}
+
+bool FileCache::put(const std::string &url, const std::string &content) {
+  const std::string key = sha256(getUrlWithoutQuery(url));
+  std::string compressed;
+  const bool is_compressed = compressFrames(content, compressed);
+  const std::string &data = is_compressed ? compressed : content;
+
+  const std::string path = cache_dir_ + key;
+  if (!writeFileAtomic(path, data)) {
+    rWarning("failed to write cache file %s", path.c_str());
+    return false;
+  }
+
+  Entry entry = {
+    .size = content.size(),
+    .stored_size = data.size(),
+    .compressed = is_compressed,
+    .hash = sha256(content),
+    .last_access = now_ms(),
+  };
+  updateManifest([&](Manifest &manifest) {
+    manifest[key] = entry;
+    evict(manifest, key);
+    return std::pair{true, true};
+  });
+  return true;
+}
+
+void FileCache::remove(const std::string &url) {
+  const std::string key = sha256(getUrlWithoutQuery(url));
+  updateManifest([&](Manifest &manifest) {
+    removeFiles(key);
+    return std::pair{true, manifest.erase(key) > 0};
+  });
+}
+
+void FileCache::evict(Manifest &manifest, const std::string &keep) {
+  size_t total = 0;
+  for (const auto &[_, e] : manifest) total += e.stored_size;
+  if (total <= budget_) return;
+
+  std::vector<Manifest::iterator> entries;
+  for (auto it = manifest.begin(); it != manifest.end(); ++it) {
+    if (it->first != keep) entries.push_back(it);
+  }
+  std::sort(entries.begin(), entries.end(), [](auto &l, auto &r) { return l->second.last_access < r->second.last_access; });
+  for (auto it : entries) {
+    if (total <= budget_) break;
+
+    rDebug("evicting cache entry %s (%s)", it->first.c_str(), formattedDataSize(it->second.stored_size).c_str());
+    total -= it->second.stored_size;
+    removeFiles(it->first);
+    manifest.erase(it);
+  }
+}
+
+void FileCache::removeFiles(const std::string &key) {
+  ::unlink((cache_dir_ + key).c_str());
+  for (const char *suffix : SIDECAR_SUFFIXES) {
+    ::unlink((cache_dir_ + key + suffix).c_str());
+  }
+}
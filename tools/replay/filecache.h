@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <sys/stat.h>
+
+// uncompressed size of each independently compressed frame of a cache entry
+const size_t CACHE_FRAME_SIZE = 1024 * 1024;
+constexpr int DEFAULT_CACHE_BUDGET_MB = 20 * 1024;
+// files derived from an entry, stored as <entry><suffix> and removed with it
+constexpr const char *FRAME_INDEX_SUFFIX = ".idx";
+constexpr const char *TIMELINE_SUFFIX = ".timeline";
+
+// Download cache under Path::download_cache_root(), shared by every process on the host.
+// Entries are written atomically and tracked in a manifest with their size, hash and
+// last access time. Entries that compress well are stored as a sequence of zstd frames
+// followed by a seek table, so ranges can be read without decompressing the whole file.
+// The least recently used entries are evicted when the cache exceeds its budget.
+class FileCache {
+public:
+  // the cache of the download cache root
+  static FileCache &instance();
+  explicit FileCache(const std::string &cache_dir);
+  ~FileCache();
+  bool get(const std::string &url, std::string &content);
+  bool get(const std::string &url, size_t offset, size_t size, std::string &content);
+  bool put(const std::string &url, const std::string &content);
+  // path of an entry stored uncompressed, which can be mapped directly. empty otherwise.
+  std::string rawFile(const std::string &url);
+  void remove(const std::string &url);
+  // path of the file of an entry
+  std::string filePath(const std::string &url) const;
+  // path of a file derived from the entry of url and the hash of the entry's content.
+  // false if url has no entry, a file derived from it would never be evicted.
+  bool sidecar(const std::string &url, const char *suffix, std::string &path, std::string &hash);
+  void setBudget(size_t bytes) { budget_ = bytes; }
+
+private:
+  struct Entry {
+    size_t size = 0;         // original size
+    size_t stored_size = 0;  // size on disk
+    bool compressed = false;
+    std::string hash;
+    int64_t last_access = 0;
+  };
+  typedef std::map<std::string, Entry> Manifest;
+
+  template <class F> auto readManifest(F &&f);
+  template <class F> auto updateManifest(F &&f);
+  Manifest &loadManifest();
+  // add the files of a cache without manifest to it, and remove the files that are no entries
+  bool adoptFiles(Manifest &manifest);
+  void saveManifest(const Manifest &manifest);
+  bool lookup(const std::string &key, Entry &entry);
+  bool readEntry(const std::string &key, const Entry &entry, size_t offset, size_t size, std::string &content);
+  void removeFiles(const std::string &key);
+  void evict(Manifest &manifest, const std::string &keep);
+
+  std::string cache_dir_;
+  std::mutex lock_;
+  // the parsed manifest, reloaded when the file changes
+  Manifest manifest_;
+  struct stat manifest_stat_ = {};
+  // access times of lookups, written to the manifest with its next change or once a minute
+  std::map<std::string, int64_t> accessed_;
+  int64_t last_flush_ms_ = 0;
+  size_t budget_ = (size_t)DEFAULT_CACHE_BUDGET_MB * 1024 * 1024;
+};
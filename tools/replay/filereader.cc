@@ -4,6 +4,7 @@
 
 #include "common/util.h"
 #include "system/hardware/hw.h"
+#include "tools/replay/filecache.h"
 #include "tools/replay/util.h"
 
 std::string cacheFilePath(const std::string &url) {
@@ -18,29 +19,78 @@ std::string cacheFilePath(const std::string &url) {
 
 std::string FileReader::read(const std::string &file, std::atomic<bool> *abort) {
   const bool is_remote = file.find("https://") == 0;
-  const std::string local_file = is_remote ? cacheFilePath(file) : file;
   std::string result;
-
-  if ((!is_remote || cache_to_local_) && util::file_exists(local_file)) {
-    result = util::read_file(local_file);
-  } else if (is_remote) {
-    result = download(file, abort);
-    if (cache_to_local_ && !result.empty()) {
-      std::ofstream fs(local_file, std::ios::binary | std::ios::out);
-      fs.write(result.data(), result.size());
+  if (!is_remote) {
+    if (util::file_exists(file)) {
+      result = util::read_file(file);
+    }
+  } else if (!cache_to_local_ || !FileCache::instance().get(file, result)) {
+    bool ret = download(file, [&result](const char *data, size_t size) {
+      result.append(data, size);
+      return true;
+    }, abort);
+    if (!ret) {
+      result.clear();
+    } else if (cache_to_local_ && !result.empty()) {
+      FileCache::instance().put(file, result);
     }
   }
   return result;
 }
 
-std::string FileReader::download(const std::string &url, std::atomic<bool> *abort) {
-  for (int i = 0; i <= max_retries_ && !(abort && *abort); ++i) {
+bool FileReader::read(const std::string &file, const DownloadChunkHandler &handler, std::atomic<bool> *abort) {
+  const bool is_remote = file.find("https://") == 0;
+  std::string result;
+  if (!is_remote || (cache_to_local_ && FileCache::instance().get(file, result))) {
+    if (!is_remote) result = read(file, abort);
+    return !result.empty() && handler(result.data(), result.size());
+  }
+
+  bool ret = download(file, [&](const char *data, size_t size) {
+    if (cache_to_local_) result.append(data, size);
+    return handler(data, size);
+  }, abort);
+  if (ret && cache_to_local_ && !result.empty()) {
+    FileCache::instance().put(file, result);
+  }
+  return ret;
+}
+
+std::string FileReader::read(const std::string &file, size_t offset, size_t size, std::atomic<bool> *abort) {
+  std::string result;
+  if (file.find("https://") != 0) {
+    std::ifstream fs(file, std::ios::binary);
+    fs.seekg(offset);
+    result.resize(size);
+    fs.read(result.data(), size);
+    result.resize(fs.gcount());
+  } else if (!cache_to_local_ || !FileCache::instance().get(file, offset, size, result)) {
+    result = read(file, abort);
+    result = offset < result.size() ? result.substr(offset, size) : "";
+  }
+  return result;
+}
+
+std::string FileReader::localFile(const std::string &file) {
+  if (file.find("https://") != 0) return file;
+  return cache_to_local_ ? FileCache::instance().rawFile(file) : "";
+}
+
+bool FileReader::download(const std::string &url, const DownloadChunkHandler &handler, std::atomic<bool> *abort) {
+  // a retry resumes after the bytes the handler already got
+  size_t offset = 0;
+  bool stopped = false;
+  auto chunk_handler = [&](const char *data, size_t size) {
+    stopped = !handler(data, size);
+    offset += size;
+    return !stopped;
+  };
+  for (int i = 0; i <= max_retries_ && !stopped && !(abort && *abort); ++i) {
     if (i > 0) rWarning("download failed, retrying %d", i);
 
-    std::string result = httpGet(url, chunk_size_, abort);
-    if (!result.empty()) {
-      return result;
+    if (httpStream(url, chunk_handler, chunk_size_, offset, abort)) {
+      return true;
     }
   }
-  return {};
+  return false;
 }
@@ -3,15 +3,24 @@
 #include <atomic>
 #include <string>
 
+#include "tools/replay/util.h"
+
 class FileReader {
 public:
   FileReader(bool cache_to_local, size_t chunk_size = 0, int retries = 3)
       : cache_to_local_(cache_to_local), chunk_size_(chunk_size), max_retries_(retries) {}
   virtual ~FileReader() {}
   std::string read(const std::string &file, std::atomic<bool> *abort = nullptr);
+  // pass the file to the handler in order as it arrives, so it can be processed while downloading
+  bool read(const std::string &file, const DownloadChunkHandler &handler, std::atomic<bool> *abort = nullptr);
+  // read [offset, offset + size) of a file. cached files are read without decompressing all of it
+  std::string read(const std::string &file, size_t offset, size_t size, std::atomic<bool> *abort = nullptr);
+  // a local path that can be mapped: the file itself or its uncompressed cache entry
+  // empty if the file is not cached or is cached compressed
+  std::string localFile(const std::string &file);
 
 private:
-  std::string download(const std::string &url, std::atomic<bool> *abort);
+  bool download(const std::string &url, const DownloadChunkHandler &handler, std::atomic<bool> *abort);
   size_t chunk_size_;
   int max_retries_;
   bool cache_to_local_;
@@ -3,6 +3,18 @@
 
 #include <cassert>
 #include <algorithm>
+#include <limits>
+#include <thread>
+#include <unistd.h>
+
+#include <QFutureSynchronizer>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+#include "common/timing.h"
+#include "common/util.h"
+#include "tools/replay/filecache.h"
+#include "tools/replay/logreader.h"
 #include "third_party/libyuv/include/libyuv.h"
 
 #ifdef __APPLE__
@@ -43,6 +55,18 @@ enum AVPixelFormat get_hw_format(AVCodecContext *ctx, const enum AVPixelFormat *
   return AV_PIX_FMT_YUV420P;
 }
 
+// decodes the GOPs prefetched next to the one of the calling thread. its threads are
+// kept alive, the camera threads prefetch ahead of every frame they send.
+QThreadPool &gopDecodePool() {
+  static struct Pool : public QThreadPool {
+    Pool() {
+      setMaxThreadCount(std::max(1, MAX_CAMERAS * (MAX_GOP_DECODERS - 1)));
+      setExpiryTimeout(-1);
+    }
+  } pool;
+  return pool;
+}
+
 }  // namespace
 
 FrameReader::FrameReader() {
@@ -50,50 +74,153 @@ FrameReader::FrameReader() {
 }
 
 FrameReader::~FrameReader() {
-  for (AVPacket *pkt : packets) {
-    av_packet_free(&pkt);
-  }
+  if (cache_) cache_->erase(this);
 
-  if (decoder_ctx) avcodec_free_context(&decoder_ctx);
-  if (input_ctx) avformat_close_input(&input_ctx);
+  decoders_.clear();
+  if (codec_par_) avcodec_parameters_free(&codec_par_);
   if (hw_device_ctx) av_buffer_unref(&hw_device_ctx);
+}
 
-  if (avio_ctx_) {
-    av_freep(&avio_ctx_->buffer);
-    avio_context_free(&avio_ctx_);
-  }
+size_t FrameReader::memoryUsage() const {
+  size_t bytes = raw_.capacity() + index_.capacity() * sizeof(FrameIndexEntry);
+  if (mapped_file_) bytes += mapped_file_->size();
+  if (mapped_index_) bytes += mapped_index_->size();
+  return bytes;
 }
 
 bool FrameReader::load(const std::string &url, bool no_hw_decoder, std::atomic<bool> *abort, bool local_cache, int chunk_size, int retries) {
-  FileReader f(local_cache, chunk_size, retries);
-  std::string data = f.read(url, abort);
-  if (data.empty()) {
+  const double start_ts = millis_since_boot();
+  // local files and uncompressed cache entries are mapped instead of read into memory
+  FileReader reader(local_cache, chunk_size, retries);
+  std::string local_file = reader.localFile(url);
+  if (local_file.empty()) {
+    raw_ = reader.read(url, abort);
+    local_file = reader.localFile(url);
+  }
+  if (!local_file.empty()) {
+    mapped_file_ = std::make_unique<MappedFile>(local_file);
+    if (mapped_file_->valid()) {
+      std::string().swap(raw_);
+    }
+  }
+  if (mapped_file_ && mapped_file_->valid()) {
+    data_ = mapped_file_->data();
+    size_ = mapped_file_->size();
+  } else {
+    data_ = (const std::byte *)raw_.data();
+    size_ = raw_.size();
+  }
+  stats.read_ms = millis_since_boot() - start_ts;
+  if (size_ == 0) {
     rWarning("URL %s returned no data", url.c_str());
     return false;
   }
 
-  return load((std::byte *)data.data(), data.size(), no_hw_decoder, abort);
+  // only videos in the download cache get an index, it is evicted with them
+  std::string index_file;
+  if (!local_cache || !FileCache::instance().sidecar(url, FRAME_INDEX_SUFFIX, index_file, content_hash_) ||
+      content_hash_.size() != sizeof(FrameIndexHeader::content_hash)) {
+    index_file.clear();
+  }
+  return open(index_file, no_hw_decoder, abort);
 }
 
 bool FrameReader::load(const std::byte *data, size_t size, bool no_hw_decoder, std::atomic<bool> *abort) {
-  input_ctx = avformat_alloc_context();
-  if (!input_ctx) {
+  raw_.assign((const char *)data, size);
+  data_ = (const std::byte *)raw_.data();
+  size_ = raw_.size();
+  return open("", no_hw_decoder, abort);
+}
+
+bool FrameReader::open(const std::string &index_file, bool no_hw_decoder, std::atomic<bool> *abort) {
+  const double start_ts = millis_since_boot();
+  if (index_file.empty() || !loadIndex(index_file, no_hw_decoder)) {
+    if (!buildIndex(index_file, no_hw_decoder, abort)) {
+      return false;
+    }
+  }
+
+  for (size_t i = 0; i < frame_count_; ++i) {
+    // some stream seems to contain no keyframes
+    key_frames_count_ += frames_[i].flags & AV_PKT_FLAG_KEY;
+  }
+  valid_ = frame_count_ > 0;
+  stats.parse_ms = millis_since_boot() - start_ts;
+  return valid_;
+}
+
+bool FrameReader::loadIndex(const std::string &index_file, bool no_hw_decoder) {
+  auto file = std::make_unique<MappedFile>(index_file);
+  if (!file->valid() || file->size() < sizeof(FrameIndexHeader)) return false;
+
+  const auto header = (const FrameIndexHeader *)file->data();
+  if (header->count > file->size() / sizeof(FrameIndexEntry)) return false;
+
+  const size_t expected_size = sizeof(FrameIndexHeader) + header->count * sizeof(FrameIndexEntry) + header->extradata_size;
+  if (memcmp(header->magic, "FIDX", 4) != 0 || header->version != FRAME_INDEX_VERSION ||
+      header->file_size != size_ || memcmp(header->content_hash, content_hash_.data(), sizeof(header->content_hash)) != 0 ||
+      header->count == 0 || file->size() != expected_size) {
+    rWarning("ignoring outdated frame index %s", index_file.c_str());
+    return false;
+  }
+
+  const auto entries = (const FrameIndexEntry *)(file->data() + sizeof(FrameIndexHeader));
+  for (size_t i = 0; i < header->count; ++i) {
+    if (entries[i].pos < 0 || entries[i].size <= 0 || (size_t)(entries[i].pos + entries[i].size) > size_) {
+      rWarning("ignoring corrupt frame index %s", index_file.c_str());
+      return false;
+    }
+  }
+
+  AVCodecParameters *par = avcodec_parameters_alloc();
+  par->codec_type = AVMEDIA_TYPE_VIDEO;
+  par->codec_id = (AVCodecID)header->codec_id;
+  par->width = header->width;
+  par->height = header->height;
+  if (header->extradata_size > 0) {
+    par->extradata = (uint8_t *)av_mallocz(header->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+    par->extradata_size = header->extradata_size;
+    memcpy(par->extradata, (const uint8_t *)(entries + header->count), header->extradata_size);
+  }
+  bool ret = openDecoder(par, no_hw_decoder);
+  avcodec_parameters_free(&par);
+  if (!ret) return false;
+
+  frames_ = entries;
+  frame_count_ = header->count;
+  mapped_index_ = std::move(file);
+  return true;
+}
+
+bool FrameReader::buildIndex(const std::string &index_file, bool no_hw_decoder, std::atomic<bool> *abort) {
+  struct Input {
+    AVFormatContext *ctx = avformat_alloc_context();
+    AVIOContext *avio = nullptr;
+    ~Input() {
+      if (ctx) avformat_close_input(&ctx);
+      if (avio) {
+        av_freep(&avio->buffer);
+        avio_context_free(&avio);
+      }
+    }
+  } input;
+  if (!input.ctx) {
     rError("Error calling avformat_alloc_context");
     return false;
   }
 
   struct buffer_data bd = {
-    .data = (const uint8_t*)data,
+    .data = (const uint8_t*)data_,
     .offset = 0,
-    .size = size,
+    .size = size_,
   };
   const int avio_ctx_buffer_size = 64 * 1024;
   unsigned char *avio_ctx_buffer = (unsigned char *)av_malloc(avio_ctx_buffer_size);
-  avio_ctx_ = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size, 0, &bd, readPacket, nullptr, nullptr);
-  input_ctx->pb = avio_ctx_;
+  input.avio = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size, 0, &bd, readPacket, nullptr, nullptr);
+  input.ctx->pb = input.avio;
 
-  input_ctx->probesize = 10 * 1024 * 1024;  // 10MB
-  int ret = avformat_open_input(&input_ctx, nullptr, nullptr, nullptr);
+  input.ctx->probesize = 10 * 1024 * 1024;  // 10MB
+  int ret = avformat_open_input(&input.ctx, nullptr, nullptr, nullptr);
   if (ret != 0) {
     char err_str[1024] = {0};
     av_strerror(ret, err_str, std::size(err_str));
@@ -101,57 +228,146 @@ bool FrameReader::load(const std::byte *data, size_t size, bool no_hw_decoder, s
     return false;
   }
 
-  ret = avformat_find_stream_info(input_ctx, nullptr);
+  ret = avformat_find_stream_info(input.ctx, nullptr);
   if (ret < 0) {
     rError("cannot find a video stream in the input file");
     return false;
   }
 
-  AVStream *video = input_ctx->streams[0];
-  const AVCodec *decoder = avcodec_find_decoder(video->codecpar->codec_id);
-  if (!decoder) return false;
+  const AVCodecParameters *par = input.ctx->streams[0]->codecpar;
+  if (!openDecoder(par, no_hw_decoder)) return false;
+
+  // packets of raw streams are stored back to back, so they are decoded straight from the file.
+  // otherwise their data is copied to a separate buffer and the index is not persisted.
+  std::string packet_data;
+  bool contiguous = true;
+  int64_t pos = 0;
+  bool eof = false;
+  index_.reserve(60 * 20);  // 20fps, one minute
+  AVPacket *pkt = av_packet_alloc();
+  while (!(abort && *abort)) {
+    ret = av_read_frame(input.ctx, pkt);
+    if (ret < 0) {
+      eof = (ret == AVERROR_EOF);
+      break;
+    }
+    if (contiguous && ((size_t)(pos + pkt->size) > size_ || memcmp(data_ + pos, pkt->data, pkt->size) != 0)) {
+      contiguous = false;
+      packet_data.assign((const char *)data_, pos);
+    }
+    if (!contiguous) {
+      packet_data.append((const char *)pkt->data, pkt->size);
+    }
+    index_.push_back({.pos = pos, .pts = pkt->pts, .size = pkt->size, .flags = pkt->flags});
+    pos += pkt->size;
+    av_packet_unref(pkt);
+  }
+  av_packet_free(&pkt);
+  if (!eof) return false;
+
+  if (!contiguous) {
+    raw_ = std::move(packet_data);
+    mapped_file_.reset();
+    data_ = (const std::byte *)raw_.data();
+    size_ = raw_.size();
+  } else if (!index_file.empty() && !index_.empty()) {
+    saveIndex(index_file, par);
+  }
+  frames_ = index_.data();
+  frame_count_ = index_.size();
+  return true;
+}
+
+void FrameReader::saveIndex(const std::string &index_file, const AVCodecParameters *par) {
+  FrameIndexHeader header = {
+    .version = FRAME_INDEX_VERSION,
+    .file_size = (uint64_t)size_,
+    .codec_id = (int32_t)par->codec_id,
+    .width = par->width,
+    .height = par->height,
+    .extradata_size = (uint32_t)par->extradata_size,
+    .count = (uint64_t)index_.size(),
+  };
+  memcpy(header.magic, "FIDX", 4);
+  memcpy(header.content_hash, content_hash_.data(), sizeof(header.content_hash));
+
+  std::string content((const char *)&header, sizeof(header));
+  content.append((const char *)index_.data(), index_.size() * sizeof(FrameIndexEntry));
+  content.append((const char *)par->extradata, par->extradata_size);
+
+  // write to a temporary file first, a reader never sees a partial index
+  const std::string tmp_file = index_file + ".tmp" + std::to_string(getpid());
+  if (util::write_file(tmp_file.c_str(), content.data(), content.size(), O_WRONLY | O_CREAT | O_TRUNC) != 0 ||
+      ::rename(tmp_file.c_str(), index_file.c_str()) != 0) {
+    rWarning("failed to write frame index %s", index_file.c_str());
+    ::unlink(tmp_file.c_str());
+  }
+}
 
-  decoder_ctx = avcodec_alloc_context3(decoder);
-  ret = avcodec_parameters_to_context(decoder_ctx, video->codecpar);
-  if (ret != 0) return false;
+bool FrameReader::openDecoder(const AVCodecParameters *par, bool no_hw_decoder) {
+  // a failed attempt with the mapped index leaves a decoder behind
+  decoders_.clear();
+  if (hw_device_ctx) av_buffer_unref(&hw_device_ctx);
+  hw_pix_fmt = AV_PIX_FMT_NONE;
+
+  codec_ = avcodec_find_decoder(par->codec_id);
+  if (!codec_) return false;
+
+  if (!codec_par_) codec_par_ = avcodec_parameters_alloc();
+  if (avcodec_parameters_copy(codec_par_, par) < 0) return false;
 
-  width = (decoder_ctx->width + 3) & ~3;
-  height = decoder_ctx->height;
+  width = (par->width + 3) & ~3;
+  height = par->height;
 
   if (has_hw_decoder && !no_hw_decoder) {
     if (!initHardwareDecoder(HW_DEVICE_TYPE)) {
       rWarning("No device with hardware decoder found. fallback to CPU decoding.");
     }
   }
+  // open the first decoder now, more are created when GOPs are decoded in parallel
+  auto decoder = createDecoder();
+  if (!decoder) return false;
+
+  decoders_.push_back(std::move(decoder));
+  return true;
+}
+
+std::unique_ptr<FrameReader::Decoder> FrameReader::createDecoder() {
+  auto decoder = std::make_unique<Decoder>();
+  AVCodecContext *ctx = decoder->ctx = avcodec_alloc_context3(codec_);
+  int ret = avcodec_parameters_to_context(ctx, codec_par_);
+  if (ret != 0) return nullptr;
+
+  if (hw_device_ctx) {
+    ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
+    ctx->opaque = &hw_pix_fmt;
+    ctx->get_format = get_hw_format;
+  } else {
+    // software decoding pipelines consecutive frames and splits each frame into slices
+    const int threads = decode_threads_ > 0 ? decode_threads_.load() : (int)std::thread::hardware_concurrency() / MAX_CAMERAS;
+    ctx->thread_count = std::max(1, threads);
+    ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  }
 
-  ret = avcodec_open2(decoder_ctx, decoder, nullptr);
+  ret = avcodec_open2(ctx, codec_, nullptr);
   if (ret < 0) {
     rError("avcodec_open2 failed %d", ret);
-    return false;
+    return nullptr;
   }
-
-  packets.reserve(60 * 20);  // 20fps, one minute
-  while (!(abort && *abort)) {
-    AVPacket *pkt = av_packet_alloc();
-    ret = av_read_frame(input_ctx, pkt);
-    if (ret < 0) {
-      av_packet_free(&pkt);
-      valid_ = (ret == AVERROR_EOF);
-      break;
-    }
-    packets.push_back(pkt);
-    // some stream seems to contain no keyframes
-    key_frames_count_ += pkt->flags & AV_PKT_FLAG_KEY;
+  // frames are matched to packets by pts, which only holds if they come out in decoding order
+  if (ctx->has_b_frames > 0 || codec_par_->video_delay > 0) {
+    rError("videos with reordered frames are not supported");
+    return nullptr;
   }
-  valid_ = valid_ && !packets.empty();
-  return valid_;
+  decoder->frame.reset(av_frame_alloc());
+  return decoder;
 }
 
 bool FrameReader::initHardwareDecoder(AVHWDeviceType hw_device_type) {
   for (int i = 0;; i++) {
-    const AVCodecHWConfig *config = avcodec_get_hw_config(decoder_ctx->codec, i);
+    const AVCodecHWConfig *config = avcodec_get_hw_config(codec_, i);
     if (!config) {
-      rWarning("decoder %s does not support hw device type %s.", decoder_ctx->codec->name,
+      rWarning("decoder %s does not support hw device type %s.", codec_->name,
                av_hwdevice_get_type_name(hw_device_type));
       return false;
     }
@@ -168,84 +384,299 @@ bool FrameReader::initHardwareDecoder(AVHWDeviceType hw_device_type) {
     rWarning("Failed to create specified HW device %d.", ret);
     return false;
   }
-
-  decoder_ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
-  decoder_ctx->opaque = &hw_pix_fmt;
-  decoder_ctx->get_format = get_hw_format;
   return true;
 }
 
 bool FrameReader::get(int idx, VisionBuf *buf) {
   assert(buf != nullptr);
-  if (!valid_ || idx < 0 || idx >= packets.size()) {
+  if (!valid_ || idx < 0 || idx >= frame_count_) {
     return false;
   }
+  if (cache_ && cache_->get(this, idx, buf)) {
+    return true;
+  }
   return decode(idx, buf);
 }
 
-bool FrameReader::decode(int idx, VisionBuf *buf) {
-  int from_idx = idx;
-  if (idx != prev_idx + 1 && key_frames_count_ > 1) {
-    // seeking to the nearest key frame
+int FrameReader::prefetch(int from, int to) {
+  // past the last frame there is nothing left to decode, the range is done
+  const int last = std::min<int>(to, frame_count_ - 1);
+  if (!valid_ || !cache_ || from < 0) {
+    return to + 1;
+  }
+  while (from <= last && cache_->contains(this, from)) {
+    ++from;
+  }
+  if (from > last) return std::max(from, to + 1);
+
+  if (MAX_GOP_DECODERS <= 1 || key_frames_count_ <= 1) {
+    decode(from, nullptr);
+    return from + 1;
+  }
+
+  // the GOPs in [from, to] are independent, decode up to MAX_GOP_DECODERS of them at the same time
+  std::vector<std::pair<int, int>> gops;
+  while (from <= last && gops.size() < (size_t)MAX_GOP_DECODERS) {
+    int end = from + 1;
+    while (end <= last && !(frames_[end].flags & AV_PKT_FLAG_KEY)) {
+      ++end;
+    }
+    gops.push_back({from, end - 1});
+    from = end;
+  }
+  QFutureSynchronizer<bool> synchronizer;
+  for (int i = 1; i < gops.size(); ++i) {
+    synchronizer.addFuture(QtConcurrent::run(&gopDecodePool(), [this, gop_last = gops[i].second]() { return decode(gop_last, nullptr); }));
+  }
+  decode(gops[0].second, nullptr);
+  synchronizer.waitForFinished();
+  return from > last ? std::max(from, to + 1) : from;
+}
+
+int FrameReader::exportFrames(int from, int to, const std::string &file) const {
+  to = std::min<int>(to, frame_count_ - 1);
+  if (!valid_ || from < 0 || from > to) return -1;
+
+  // the decoder needs everything from the key frame on, with a single key frame that is the first one
+  while (from > 0 && !(frames_[from].flags & AV_PKT_FLAG_KEY)) --from;
+
+  AVFormatContext *ctx = nullptr;
+  if (avformat_alloc_output_context2(&ctx, nullptr, nullptr, file.c_str()) < 0) {
+    rError("failed to create %s", file.c_str());
+    return -1;
+  }
+  std::unique_ptr<AVFormatContext, void (*)(AVFormatContext *)> output(ctx, [](AVFormatContext *c) {
+    if (!(c->oformat->flags & AVFMT_NOFILE)) avio_closep(&c->pb);
+    avformat_free_context(c);
+  });
+  AVStream *stream = avformat_new_stream(ctx, nullptr);
+  if (!stream || avcodec_parameters_copy(stream->codecpar, codec_par_) < 0) return -1;
+  stream->codecpar->codec_tag = 0;
+  stream->time_base = {1, 20};  // the cameras record at 20 fps
+  if ((!(ctx->oformat->flags & AVFMT_NOFILE) && avio_open(&ctx->pb, file.c_str(), AVIO_FLAG_WRITE) < 0) ||
+      avformat_write_header(ctx, nullptr) < 0) {
+    rError("failed to write %s", file.c_str());
+    return -1;
+  }
+
+  // a stream cut at a later key frame starts with the parameter sets of the first one
+  std::string first_packet;
+  const uint8_t *extradata = codec_par_->extradata;
+  const bool annexb = codec_par_->extradata_size > 3 && extradata[0] == 0 && extradata[1] == 0 &&
+                      (extradata[2] == 1 || (extradata[2] == 0 && extradata[3] == 1));
+  if (from > 0 && annexb) {
+    first_packet.assign((const char *)extradata, codec_par_->extradata_size);
+    first_packet.append((const char *)(data_ + frames_[from].pos), frames_[from].size);
+  }
+
+  bool ret = true;
+  AVPacket *pkt = av_packet_alloc();
+  for (int i = from; i <= to && ret; ++i) {
+    const bool prepend = i == from && !first_packet.empty();
+    pkt->data = prepend ? (uint8_t *)first_packet.data() : (uint8_t *)(data_ + frames_[i].pos);
+    pkt->size = prepend ? first_packet.size() : frames_[i].size;
+    pkt->flags = frames_[i].flags;
+    pkt->pts = pkt->dts = av_rescale_q(i - from, {1, 20}, stream->time_base);
+    pkt->duration = av_rescale_q(1, {1, 20}, stream->time_base);
+    pkt->stream_index = stream->index;
+    // the packet data is not owned by pkt, the muxer copies what it keeps
+    ret = av_write_frame(ctx, pkt) >= 0;
+  }
+  av_packet_free(&pkt);
+  ret = av_write_trailer(ctx) == 0 && ret;
+  if (!ret) rError("failed to write %s", file.c_str());
+  return ret ? from : -1;
+}
+
+int FrameReader::keyFrame(int idx) const {
+  if (key_frames_count_ > 1) {
     for (int i = idx; i >= 0; --i) {
-      if (packets[i]->flags & AV_PKT_FLAG_KEY) {
-        from_idx = i;
+      if (frames_[i].flags & AV_PKT_FLAG_KEY) return i;
+    }
+  }
+  return idx;
+}
+
+FrameReader::Decoder *FrameReader::acquireDecoder(int idx) {
+  const int key_frame = keyFrame(idx);
+  std::unique_lock lk(decoders_lock_);
+  while (true) {
+    // prefer a decoder that reaches idx without seeking, then any idle one
+    Decoder *idle = nullptr;
+    for (auto &d : decoders_) {
+      if (d->busy) continue;
+      if (d->next_frame <= idx && d->next_frame >= key_frame) {
+        idle = d.get();
         break;
       }
+      if (!idle) idle = d.get();
+    }
+    if (!idle && decoders_.size() < (size_t)MAX_GOP_DECODERS) {
+      auto decoder = createDecoder();
+      if (decoder) {
+        decoders_.push_back(std::move(decoder));
+        idle = decoders_.back().get();
+      }
     }
+    if (idle) {
+      idle->busy = true;
+      return idle;
+    }
+    decoders_cv_.wait(lk);
   }
-  prev_idx = idx;
+}
 
-  for (int i = from_idx; i <= idx; ++i) {
-    AVFrame *f = decodeFrame(packets[i]);
-    if (f && i == idx) {
-      return copyBuffers(f, buf);
-    }
+void FrameReader::releaseDecoder(Decoder *decoder) {
+  {
+    std::lock_guard lk(decoders_lock_);
+    decoder->busy = false;
   }
-  return false;
+  decoders_cv_.notify_one();
 }
 
-AVFrame *FrameReader::decodeFrame(AVPacket *pkt) {
-  int ret = avcodec_send_packet(decoder_ctx, pkt);
-  if (ret < 0) {
-    rError("Error sending a packet for decoding: %d", ret);
-    return nullptr;
+bool FrameReader::decode(int idx, VisionBuf *buf) {
+  Decoder *d = acquireDecoder(idx);
+  const int key_frame = keyFrame(idx);
+  if (idx < d->next_frame || key_frame > d->next_frame) {
+    // seeking to the nearest key frame
+    avcodec_flush_buffers(d->ctx);
+    d->next_packet = d->next_frame = key_frame;
   }
 
-  av_frame_.reset(av_frame_alloc());
-  ret = avcodec_receive_frame(decoder_ctx, av_frame_.get());
-  if (ret != 0) {
-    rError("avcodec_receive_frame error: %d", ret);
-    return nullptr;
+  // frames decoded on the way from the key frame are cached too,
+  // so stepping backwards through a GOP decodes it only once.
+  bool ret = false;
+  while (AVFrame *f = receiveFrame(d)) {
+    // pts is the packet index, frames the decoder dropped are skipped. there are no B-frames, see createDecoder
+    const int i = d->frame->pts != AV_NOPTS_VALUE ? d->frame->pts : d->next_frame;
+    d->next_frame = i + 1;
+    if (cache_ && !cache_->contains(this, i)) {
+      const size_t size = getYUVSize();
+      std::unique_ptr<uint8_t[]> nv12(new uint8_t[size]);
+      copyBuffers(f, nv12.get(), nv12.get() + width * height, width);
+      cache_->put(this, i, std::move(nv12), size);
+    }
+    if (i >= idx) {
+      ret = (i == idx);
+      if (ret && buf) copyBuffers(f, buf->y, buf->uv, buf->stride);
+      break;
+    }
+  }
+  if (!ret) {
+    // start over from a key frame on the next request
+    d->next_frame = std::numeric_limits<int>::max();
+  }
+  releaseDecoder(d);
+  return ret;
+}
+
+AVFrame *FrameReader::receiveFrame(Decoder *d) {
+  while (true) {
+    int ret = avcodec_receive_frame(d->ctx, d->frame.get());
+    if (ret == 0) {
+      // the reordering of a stream is known once its headers are decoded
+      if (d->ctx->has_b_frames > 0) {
+        rError("videos with reordered frames are not supported");
+        return nullptr;
+      }
+      break;
+    }
+    if (ret != AVERROR(EAGAIN)) {
+      if (ret != AVERROR_EOF) rError("avcodec_receive_frame error: %d", ret);
+      return nullptr;
+    }
+
+    // the decoder needs more input, with frame threading several packets are in flight.
+    // packet data is copied by the decoder, only the pages of this packet are touched.
+    AVPacket *pkt = nullptr;
+    if (d->next_packet < frame_count_) {
+      const FrameIndexEntry &entry = frames_[d->next_packet];
+      pkt = av_packet_alloc();
+      pkt->data = (uint8_t *)(data_ + entry.pos);
+      pkt->size = entry.size;
+      pkt->pts = d->next_packet++;
+      pkt->flags = entry.flags;
+    }
+    ret = avcodec_send_packet(d->ctx, pkt);  // nullptr drains the decoder at the end of the file
+    av_packet_free(&pkt);
+    if (ret < 0) {
+      rError("Error sending a packet for decoding: %d", ret);
+      return nullptr;
+    }
   }
 
-  if (av_frame_->format == hw_pix_fmt) {
-    hw_frame.reset(av_frame_alloc());
-    if ((ret = av_hwframe_transfer_data(hw_frame.get(), av_frame_.get(), 0)) < 0) {
+  if (d->frame->format == hw_pix_fmt) {
+    if (!d->hw_frame) d->hw_frame.reset(av_frame_alloc());
+    av_frame_unref(d->hw_frame.get());
+    if (av_hwframe_transfer_data(d->hw_frame.get(), d->frame.get(), 0) < 0) {
       rError("error transferring the data from GPU to CPU");
       return nullptr;
     }
-    return hw_frame.get();
-  } else {
-    return av_frame_.get();
+    return d->hw_frame.get();
   }
+  return d->frame.get();
 }
 
-bool FrameReader::copyBuffers(AVFrame *f, VisionBuf *buf) {
-  assert(f != nullptr && buf != nullptr);
+void FrameReader::copyBuffers(AVFrame *f, uint8_t *y, uint8_t *uv, int stride) {
+  assert(f != nullptr && y != nullptr && uv != nullptr);
   if (hw_pix_fmt == HW_PIX_FMT) {
     for (int i = 0; i < height/2; i++) {
-      memcpy(buf->y + (i*2 + 0)*buf->stride, f->data[0] + (i*2 + 0)*f->linesize[0], width);
-      memcpy(buf->y + (i*2 + 1)*buf->stride, f->data[0] + (i*2 + 1)*f->linesize[0], width);
-      memcpy(buf->uv + i*buf->stride, f->data[1] + i*f->linesize[1], width);
+      memcpy(y + (i*2 + 0)*stride, f->data[0] + (i*2 + 0)*f->linesize[0], width);
+      memcpy(y + (i*2 + 1)*stride, f->data[0] + (i*2 + 1)*f->linesize[0], width);
+      memcpy(uv + i*stride, f->data[1] + i*f->linesize[1], width);
     }
   } else {
     libyuv::I420ToNV12(f->data[0], f->linesize[0],
                        f->data[1], f->linesize[1],
                        f->data[2], f->linesize[2],
-                       buf->y, buf->stride,
-                       buf->uv, buf->stride,
+                       y, stride,
+                       uv, stride,
                        width, height);
   }
+}
+
+// class FrameCache
+
+bool FrameCache::get(const FrameReader *fr, int idx, VisionBuf *buf) {
+  std::lock_guard lk(lock_);
+  auto it = frames_.find({fr, idx});
+  if (it == frames_.end()) return false;
+
+  lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+  const uint8_t *y = it->second.nv12.get();
+  libyuv::CopyPlane(y, fr->width, buf->y, buf->stride, fr->width, fr->height);
+  libyuv::CopyPlane(y + fr->width * fr->height, fr->width, buf->uv, buf->stride, fr->width, fr->height / 2);
   return true;
 }
+
+bool FrameCache::contains(const FrameReader *fr, int idx) {
+  std::lock_guard lk(lock_);
+  return frames_.count({fr, idx}) > 0;
+}
+
+void FrameCache::put(const FrameReader *fr, int idx, std::unique_ptr<uint8_t[]> nv12, size_t size) {
+  std::lock_guard lk(lock_);
+  Key key = {fr, idx};
+  if (frames_.count(key)) return;
+
+  lru_.push_front(key);
+  frames_.emplace(key, Entry{std::move(nv12), size, lru_.begin()});
+  used_bytes_ += size;
+  // the newest frame is always kept, so a lookahead of one frame works without a budget
+  while (used_bytes_ > max_bytes_ && lru_.size() > 1) {
+    auto last = frames_.find(lru_.back());
+    used_bytes_ -= last->second.size;
+    frames_.erase(last);
+    lru_.pop_back();
+  }
+}
+
+void FrameCache::erase(const FrameReader *fr) {
+  std::lock_guard lk(lock_);
+  auto it = frames_.lower_bound({fr, std::numeric_limits<int>::min()});
+  while (it != frames_.end() && it->first.first == fr) {
+    used_bytes_ -= it->second.size;
+    lru_.erase(it->second.lru_it);
+    it = frames_.erase(it);
+  }
+}
@@ -1,11 +1,17 @@
 #pragma once
 
+#include <condition_variable>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "cereal/visionipc/visionbuf.h"
 #include "tools/replay/filereader.h"
+#include "tools/replay/util.h"
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -16,6 +22,59 @@ struct AVFrameDeleter {
   void operator()(AVFrame* frame) const { av_frame_free(&frame); }
 };
 
+// number of GOPs of a video decoded at the same time on separate decoders
+constexpr int MAX_GOP_DECODERS = 2;
+
+// packet index of a video file, stored next to its cache entry so later loads
+// can open the file without probing or demuxing it.
+constexpr uint32_t FRAME_INDEX_VERSION = 2;
+
+struct FrameIndexHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t file_size;
+  char content_hash[64];  // sha256 of the video, as in the cache manifest
+  int32_t codec_id;
+  int32_t width;
+  int32_t height;
+  uint32_t extradata_size;
+  uint64_t count;
+  // followed by count FrameIndexEntry and extradata_size bytes of codec extradata
+};
+
+struct FrameIndexEntry {
+  int64_t pos;
+  int64_t pts;
+  int32_t size;
+  int32_t flags;
+};
+
+class FrameReader;
+
+// LRU cache of decoded frames in NV12, shared by the FrameReaders of one camera.
+class FrameCache {
+public:
+  FrameCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+  bool get(const FrameReader *fr, int idx, VisionBuf *buf);
+  bool contains(const FrameReader *fr, int idx);
+  void put(const FrameReader *fr, int idx, std::unique_ptr<uint8_t[]> nv12, size_t size);
+  void erase(const FrameReader *fr);
+  inline size_t maxBytes() const { return max_bytes_; }
+
+private:
+  typedef std::pair<const FrameReader *, int> Key;
+  struct Entry {
+    std::unique_ptr<uint8_t[]> nv12;
+    size_t size;
+    std::list<Key>::iterator lru_it;
+  };
+  std::mutex lock_;
+  std::list<Key> lru_;
+  std::map<Key, Entry> frames_;
+  size_t used_bytes_ = 0;
+  const size_t max_bytes_;
+};
+
 class FrameReader {
 public:
   FrameReader();
@@ -24,28 +83,70 @@ public:
             int chunk_size = -1, int retries = 0);
   bool load(const std::byte *data, size_t size, bool no_hw_decoder = false, std::atomic<bool> *abort = nullptr);
   bool get(int idx, VisionBuf *buf);
+  // decode frames in [from, to] into the cache without copying them out.
+  // returns the index following the last decoded frame, greater than to once [from, to] is done.
+  int prefetch(int from, int to);
+  // remux the frames [from, to] into file without re-encoding, in the container picked by its extension.
+  // starts at the key frame before from. returns that key frame, or -1 on failure.
+  int exportFrames(int from, int to, const std::string &file) const;
+  inline void setCache(std::shared_ptr<FrameCache> cache) { cache_ = cache; }
   int getYUVSize() const { return width * height * 3 / 2; }
-  size_t getFrameCount() const { return packets.size(); }
+  size_t getFrameCount() const { return frame_count_; }
+  // bytes of the packets, mapped or in memory, and of the packet index. decoded frames are in the cache
+  size_t memoryUsage() const;
   bool valid() const { return valid_; }
+  // threads of each software decoder, 0 picks a share of the cores per camera
+  static void setDecodeThreads(int threads) { decode_threads_ = threads; }
 
   int width = 0, height = 0;
+  LoadStats stats;
 
 private:
+  bool open(const std::string &index_file, bool no_hw_decoder, std::atomic<bool> *abort);
+  bool loadIndex(const std::string &index_file, bool no_hw_decoder);
+  bool buildIndex(const std::string &index_file, bool no_hw_decoder, std::atomic<bool> *abort);
+  void saveIndex(const std::string &index_file, const AVCodecParameters *par);
+  struct Decoder {
+    ~Decoder() { if (ctx) avcodec_free_context(&ctx); }
+    AVCodecContext *ctx = nullptr;
+    std::unique_ptr<AVFrame, AVFrameDeleter> frame, hw_frame;
+    int next_packet = 0;  // next packet to send
+    int next_frame = 0;   // index following the last received frame
+    bool busy = false;
+  };
+  bool openDecoder(const AVCodecParameters *par, bool no_hw_decoder);
+  std::unique_ptr<Decoder> createDecoder();
   bool initHardwareDecoder(AVHWDeviceType hw_device_type);
+  Decoder *acquireDecoder(int idx);
+  void releaseDecoder(Decoder *decoder);
+  int keyFrame(int idx) const;
   bool decode(int idx, VisionBuf *buf);
-  AVFrame * decodeFrame(AVPacket *pkt);
-  bool copyBuffers(AVFrame *f, VisionBuf *buf);
+  AVFrame *receiveFrame(Decoder *d);
+  void copyBuffers(AVFrame *f, uint8_t *y, uint8_t *uv, int stride);
+
+  // the video file, either mapped or in raw_
+  const std::byte *data_ = nullptr;
+  size_t size_ = 0;
+  std::string raw_;
+  std::unique_ptr<MappedFile> mapped_file_;
+  // packet index, either mapped from the sidecar or built in index_
+  const FrameIndexEntry *frames_ = nullptr;
+  size_t frame_count_ = 0;
+  std::vector<FrameIndexEntry> index_;
+  std::unique_ptr<MappedFile> mapped_index_;
+  std::string content_hash_;  // of the cache entry the index is stored next to
 
-  std::vector<AVPacket*> packets;
-  std::unique_ptr<AVFrame, AVFrameDeleter>av_frame_, hw_frame;
-  AVFormatContext *input_ctx = nullptr;
-  AVCodecContext *decoder_ctx = nullptr;
+  const AVCodec *codec_ = nullptr;
+  AVCodecParameters *codec_par_ = nullptr;
+  std::mutex decoders_lock_;
+  std::condition_variable decoders_cv_;
+  std::vector<std::unique_ptr<Decoder>> decoders_;
   int key_frames_count_ = 0;
   bool valid_ = false;
-  AVIOContext *avio_ctx_ = nullptr;
 
   AVPixelFormat hw_pix_fmt = AV_PIX_FMT_NONE;
   AVBufferRef *hw_device_ctx = nullptr;
-  int prev_idx = -1;
+  std::shared_ptr<FrameCache> cache_;
   inline static std::atomic<bool> has_hw_decoder = true;
+  inline static std::atomic<int> decode_threads_ = 0;
 };
@@ -1,98 +1,255 @@
 #include "tools/replay/logreader.h"
 
 #include <algorithm>
+#include "common/timing.h"
+#include "common/util.h"
 #include "tools/replay/filereader.h"
 #include "tools/replay/util.h"
 
-Event::Event(const kj::ArrayPtr<const capnp::word> &amsg, bool frame) : reader(amsg), frame(frame) {
-  words = kj::ArrayPtr<const capnp::word>(amsg.begin(), reader.getEnd());
-  event = reader.getRoot<cereal::Event>();
-  which = event.which();
-  mono_time = event.getLogMonoTime();
-
-  // 1) Send video data at t=timestampEof/timestampSof
-  // 2) Send encodeIndex packet at t=logMonoTime
-  if (frame) {
-    auto idx = capnp::AnyStruct::Reader(event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
-    // C2 only has eof set, and some older routes have neither
-    uint64_t sof = idx.getTimestampSof();
-    uint64_t eof = idx.getTimestampEof();
-    if (sof > 0) {
-      mono_time = sof;
-    } else if (eof > 0) {
-      mono_time = eof;
+bool LogReader::load(const std::string &url, std::atomic<bool> *abort, bool local_cache, int chunk_size, int retries) {
+  const double start_ts = millis_since_boot();
+  const std::string file = getUrlWithoutQuery(url);
+  const bool is_remote = url.find("https://") == 0;
+  if (is_remote && (util::ends_with(file, ".bz2") || util::ends_with(file, ".zst"))) {
+    // decompress and parse the log chunk by chunk while it downloads
+    return streamAndParse(file, [&](const DownloadChunkHandler &handler) {
+      return FileReader(local_cache, chunk_size, retries).read(url, handler, abort);
+    }, abort);
+  }
+
+  const std::byte *data = nullptr;
+  size_t size = 0;
+  if (!is_remote) {
+    // map local logs instead of reading them into memory
+    mapped_file_ = std::make_unique<MappedFile>(url);
+    if (mapped_file_->valid()) {
+      data = mapped_file_->data();
+      size = mapped_file_->size();
     }
   }
-}
+  if (!data) {
+    raw_ = FileReader(local_cache, chunk_size, retries).read(url, abort);
+    data = (const std::byte *)raw_.data();
+    size = raw_.size();
+  }
+  stats.read_ms = millis_since_boot() - start_ts;
+  if (size == 0) return false;
 
-// class LogReader
+  return decompressAndParse(data, size, file, abort);
+}
 
-LogReader::LogReader(size_t memory_pool_block_size) {
-#ifdef HAS_MEMORY_RESOURCE
-  const size_t buf_size = sizeof(Event) * memory_pool_block_size;
-  mbr_ = std::make_unique<std::pmr::monotonic_buffer_resource>(buf_size);
-#endif
-  events.reserve(memory_pool_block_size);
+bool LogReader::load(const std::byte *data, size_t size, std::atomic<bool> *abort) {
+  raw_.assign((const char *)data, size);
+  return decompressAndParse((const std::byte *)raw_.data(), raw_.size(), "", abort);
 }
 
-LogReader::~LogReader() {
-  for (Event *e : events) {
-    delete e;
+size_t LogReader::memoryUsage() const {
+  size_t bytes = raw_.capacity() + events.capacity() * sizeof(Event);
+  if (mapped_file_) bytes += mapped_file_->size();
+  for (const auto &block : blocks_) {
+    bytes += block.capacity();
   }
+  return bytes;
 }
 
-bool LogReader::load(const std::string &url, std::atomic<bool> *abort, bool local_cache, int chunk_size, int retries) {
-  raw_ = FileReader(local_cache, chunk_size, retries).read(url, abort);
-  if (raw_.empty()) return false;
+bool LogReader::decompressAndParse(const std::byte *data, size_t size, const std::string &file, std::atomic<bool> *abort) {
+  if (!util::ends_with(file, ".bz2") && !util::ends_with(file, ".zst")) {
+    // parse in place, events point directly into the mapped file or raw_
+    try {
+      size_t parsed = parse((const char *)data, size, abort);
+      if (parsed < size && !(abort && *abort)) {
+        rWarning("failed to parse log : incomplete message at offset %zu", parsed);
+      }
+    } catch (const kj::Exception &e) {
+      rWarning("failed to parse log : %s", e.getDescription().cStr());
+    }
+    return finishParse(abort);
+  }
 
-  if (url.find(".bz2") != std::string::npos) {
-    raw_ = decompressBZ2(raw_, abort);
-    if (raw_.empty()) return false;
+  // the whole log is here, its blocks are decompressed in parallel and parsed in order
+  const double start_ts = millis_since_boot();
+  size_t parsed = 0;
+  auto block_handler = [&](const char *block, size_t block_size) { return parseBlock(block, block_size, parsed, abort); };
+  bool ret = util::ends_with(file, ".bz2") ? decompressBZ2(data, size, block_handler, abort)
+                                           : decompressZST(data, size, block_handler, abort);
+  stats.decompress_ms = millis_since_boot() - start_ts - stats.parse_ms;
+  if (ret && !blocks_.empty() && parsed < blocks_.back().size()) {
+    rWarning("failed to parse log : incomplete message at the end of the log");
   }
-  return parse(abort);
+  return finishParse(abort);
 }
 
-bool LogReader::load(const std::byte *data, size_t size, std::atomic<bool> *abort) {
-  raw_.assign((const char *)data, size);
-  return parse(abort);
-}
+bool LogReader::parseBlock(const char *block, size_t block_size, size_t &parsed, std::atomic<bool> *abort) {
+  if (blocks_.empty() || blocks_.back().size() + block_size > blocks_.back().capacity()) {
+    // move the incomplete message at the end of the current block to a new one
+    const size_t remaining = blocks_.empty() ? 0 : blocks_.back().size() - parsed;
+    std::string next;
+    next.reserve(std::max(LOG_BLOCK_SIZE, (remaining + block_size) * 2));
+    if (remaining > 0) {
+      next.append(blocks_.back().data() + parsed, remaining);
+    }
+    if (!blocks_.empty() && parsed == 0) {
+      blocks_.pop_back();  // no event points into it
+    }
+    blocks_.push_back(std::move(next));
+    parsed = 0;
+  }
 
-bool LogReader::parse(std::atomic<bool> *abort) {
+  auto &buf = blocks_.back();
+  buf.append(block, block_size);
   try {
-    kj::ArrayPtr<const capnp::word> words((const capnp::word *)raw_.data(), raw_.size() / sizeof(capnp::word));
-    while (words.size() > 0 && !(abort && *abort)) {
-#ifdef HAS_MEMORY_RESOURCE
-      Event *evt = new (mbr_.get()) Event(words);
-#else
-      Event *evt = new Event(words);
-#endif
-      // Add encodeIdx packet again as a frame packet for the video stream
-      if (evt->which == cereal::Event::ROAD_ENCODE_IDX ||
-          evt->which == cereal::Event::DRIVER_ENCODE_IDX ||
-          evt->which == cereal::Event::WIDE_ROAD_ENCODE_IDX) {
-
-#ifdef HAS_MEMORY_RESOURCE
-        Event *frame_evt = new (mbr_.get()) Event(words, true);
-#else
-        Event *frame_evt = new Event(words, true);
-#endif
-
-        events.push_back(frame_evt);
-      }
-
-      words = kj::arrayPtr(evt->reader.getEnd(), words.end());
-      events.push_back(evt);
-    }
+    parsed += parse(buf.data() + parsed, buf.size() - parsed, abort);
   } catch (const kj::Exception &e) {
     rWarning("failed to parse log : %s", e.getDescription().cStr());
-    if (!events.empty()) {
-      rWarning("read %zu events from corrupt log", events.size());
+    return false;
+  }
+  return !(abort && *abort);
+}
+
+bool LogReader::streamAndParse(const std::string &file, const std::function<bool(const DownloadChunkHandler &)> &read,
+                               std::atomic<bool> *abort) {
+  // parse each decompressed block as it arrives instead of waiting for the whole log
+  size_t parsed = 0;  // parsed bytes of blocks_.back()
+  auto block_handler = [&](const char *block, size_t block_size) { return parseBlock(block, block_size, parsed, abort); };
+
+  const double start_ts = millis_since_boot();
+  double process_ms = 0;  // time spent decompressing and parsing, the rest is spent reading
+  bool stopped = false;
+  StreamDecompressor decompressor(util::ends_with(file, ".bz2") ? StreamDecompressor::BZ2 : StreamDecompressor::ZST, block_handler, abort);
+  bool ret = read([&](const char *data, size_t size) {
+    const double ts = millis_since_boot();
+    stopped = !decompressor.push(data, size);
+    process_ms += millis_since_boot() - ts;
+    return !stopped;
+  });
+  stats.read_ms += millis_since_boot() - start_ts - process_ms;
+  stats.decompress_ms = process_ms - stats.parse_ms;
+  // a failed read is an error, a corrupt log keeps the events before the corruption
+  if (!ret && !stopped) return false;
+
+  if (decompressor.finish() && !blocks_.empty() && parsed < blocks_.back().size()) {
+    rWarning("failed to parse log : incomplete message at the end of the log");
+  }
+  return finishParse(abort);
+}
+
+size_t LogReader::parse(const char *data, size_t size, std::atomic<bool> *abort) {
+  const double start_ts = millis_since_boot();
+  kj::ArrayPtr<const capnp::word> words((const capnp::word *)data, size / sizeof(capnp::word));
+  while (words.size() > 0 && !(abort && *abort)) {
+    // stop at an incomplete message, the rest of it is in the next block
+    if (capnp::expectedSizeInWordsFromPrefix(words) > words.size()) break;
+
+    capnp::FlatArrayMessageReader reader(words);
+    auto event = reader.getRoot<cereal::Event>();
+    auto which = event.which();
+    auto event_data = kj::arrayPtr(words.begin(), reader.getEnd());
+    words = kj::arrayPtr(reader.getEnd(), words.end());
+    if (!filters_.empty() && (which >= filters_.size() || !filters_[which])) continue;
+
+    events.emplace_back(which, event.getLogMonoTime(), event_data);
+
+    // Add encodeIdx packet again as a frame packet for the video stream
+    if (which == cereal::Event::ROAD_ENCODE_IDX ||
+        which == cereal::Event::DRIVER_ENCODE_IDX ||
+        which == cereal::Event::WIDE_ROAD_ENCODE_IDX) {
+      // 1) Send video data at t=timestampEof/timestampSof
+      // 2) Send encodeIndex packet at t=logMonoTime
+      auto idx = capnp::AnyStruct::Reader(event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
+      // C2 only has eof set, and some older routes have neither
+      uint64_t sof = idx.getTimestampSof();
+      uint64_t eof = idx.getTimestampEof();
+      uint64_t mono_time = sof > 0 ? sof : (eof > 0 ? eof : event.getLogMonoTime());
+      events.emplace_back(which, mono_time, event_data, true);
     }
   }
+  stats.parse_ms += millis_since_boot() - start_ts;
+  return (const char *)words.begin() - data;
+}
 
+bool LogReader::finishParse(std::atomic<bool> *abort) {
   if (!events.empty() && !(abort && *abort)) {
-    std::sort(events.begin(), events.end(), Event::lessThan());
+    const double start_ts = millis_since_boot();
+    std::sort(events.begin(), events.end());
+    stats.parse_ms += millis_since_boot() - start_ts;
     return true;
   }
   return false;
 }
+
+// class MergedEvents
+
+void MergedEvents::insert(int seg, std::shared_ptr<const std::vector<Event>> events) {
+  erase(seg);
+  size_ += events->size();
+  chunks_[seg] = std::move(events);
+}
+
+void MergedEvents::erase(int seg) {
+  if (auto it = chunks_.find(seg); it != chunks_.end()) {
+    size_ -= it->second->size();
+    chunks_.erase(it);
+  }
+}
+
+MergedEvents::Cursor MergedEvents::begin() const {
+  Cursor cursor;
+  for (const auto &[_, events] : chunks_) {
+    if (!events->empty()) {
+      cursor.ranges_.push_back({events->data(), events->data() + events->size()});
+    }
+  }
+  cursor.select();
+  return cursor;
+}
+
+MergedEvents::Cursor MergedEvents::upperBound(const Event &e) const {
+  Cursor cursor;
+  for (const auto &[_, events] : chunks_) {
+    auto it = std::upper_bound(events->begin(), events->end(), e);
+    if (it != events->end()) {
+      cursor.ranges_.push_back({&(*it), events->data() + events->size()});
+    }
+  }
+  cursor.select();
+  return cursor;
+}
+
+const Event *MergedEvents::back() const {
+  const Event *last = nullptr;
+  for (const auto &[_, events] : chunks_) {
+    if (!events->empty() && (!last || *last < events->back())) {
+      last = &events->back();
+    }
+  }
+  return last;
+}
+
+void MergedEvents::Cursor::select() {
+  cur_ = bound_ = nullptr;
+  for (size_t i = 0; i < ranges_.size(); ++i) {
+    if (!cur_ || *ranges_[i].first < *cur_) {
+      cur_ = ranges_[i].first;
+      cur_range_ = i;
+    }
+  }
+  for (size_t i = 0; i < ranges_.size(); ++i) {
+    if (i != cur_range_ && (!bound_ || *ranges_[i].first < *bound_)) {
+      bound_ = ranges_[i].first;
+    }
+  }
+}
+
+MergedEvents::Cursor &MergedEvents::Cursor::operator++() {
+  auto &range = ranges_[cur_range_];
+  if (++range.first == range.second) {
+    ranges_.erase(ranges_.begin() + cur_range_);
+    select();
+  } else if (bound_ && *bound_ < *range.first) {
+    // segments only overlap at their boundaries, most steps stay in the current range
+    select();
+  } else {
+    cur_ = range.first;
+  }
+  return *this;
+}
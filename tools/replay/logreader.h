@@ -1,67 +1,104 @@
 #pragma once
 
-#if __has_include(<memory_resource>)
-#define HAS_MEMORY_RESOURCE 1
-#include <memory_resource>
-#endif
-
+#include <functional>
+#include <map>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include <capnp/serialize.h>
 #include "cereal/gen/cpp/log.capnp.h"
 #include "system/camerad/cameras/camera_common.h"
+#include "tools/replay/util.h"
 
 const CameraType ALL_CAMERAS[] = {RoadCam, DriverCam, WideRoadCam};
 const int MAX_CAMERAS = std::size(ALL_CAMERAS);
-const int DEFAULT_EVENT_MEMORY_POOL_BLOCK_SIZE = 65000;
+const size_t LOG_BLOCK_SIZE = 16 * 1024 * 1024;
 
+// A compact index entry of a logged message. The message itself is only read on demand:
+//   capnp::FlatArrayMessageReader reader(e.data);
+//   auto event = reader.getRoot<cereal::Event>();
 class Event {
 public:
-  Event(cereal::Event::Which which, uint64_t mono_time) : reader(kj::ArrayPtr<capnp::word>{}) {
-    // construct a dummy Event for binary search, e.g std::upper_bound
-    this->which = which;
-    this->mono_time = mono_time;
+  Event(cereal::Event::Which which = cereal::Event::Which::INIT_DATA, uint64_t mono_time = 0,
+        const kj::ArrayPtr<const capnp::word> &data = {}, bool frame = false)
+      : mono_time(mono_time), which(which), frame(frame), data(data) {}
+  inline kj::ArrayPtr<const capnp::byte> bytes() const { return data.asBytes(); }
+  inline bool operator<(const Event &other) const {
+    return mono_time < other.mono_time || (mono_time == other.mono_time && which < other.which);
   }
-  Event(const kj::ArrayPtr<const capnp::word> &amsg, bool frame = false);
-  inline kj::ArrayPtr<const capnp::byte> bytes() const { return words.asBytes(); }
-
-  struct lessThan {
-    inline bool operator()(const Event *l, const Event *r) {
-      return l->mono_time < r->mono_time || (l->mono_time == r->mono_time && l->which < r->which);
-    }
-  };
-
-#if HAS_MEMORY_RESOURCE
-  void *operator new(size_t size, std::pmr::monotonic_buffer_resource *mbr) {
-    return mbr->allocate(size);
-  }
-  void operator delete(void *ptr) {
-    // No-op. memory used by EventMemoryPool increases monotonically until the logReader is destroyed.
-  }
-#endif
 
   uint64_t mono_time;
   cereal::Event::Which which;
-  cereal::Event::Reader event;
-  capnp::FlatArrayMessageReader reader;
-  kj::ArrayPtr<const capnp::word> words;
   bool frame;
+  kj::ArrayPtr<const capnp::word> data;
 };
 
 class LogReader {
 public:
-  LogReader(size_t memory_pool_block_size = DEFAULT_EVENT_MEMORY_POOL_BLOCK_SIZE);
-  ~LogReader();
+  // only the events of the services set in filters (indexed by which) are kept, all of them if it is empty.
+  // the other messages are skipped over without building their events.
+  LogReader(const std::vector<bool> &filters = {}) : filters_(filters) {}
   bool load(const std::string &url, std::atomic<bool> *abort = nullptr,
             bool local_cache = false, int chunk_size = -1, int retries = 0);
   bool load(const std::byte *data, size_t size, std::atomic<bool> *abort = nullptr);
-  std::vector<Event*> events;
+  // bytes of the log words, mapped or in memory, and of the event index
+  size_t memoryUsage() const;
+  std::vector<Event> events;
+  LoadStats stats;
 
 private:
-  bool parse(std::atomic<bool> *abort);
+  bool decompressAndParse(const std::byte *data, size_t size, const std::string &file, std::atomic<bool> *abort);
+  // decompress and parse a compressed log while read() passes it in, at once or chunk by chunk
+  bool streamAndParse(const std::string &file, const std::function<bool(const DownloadChunkHandler &)> &read, std::atomic<bool> *abort);
+  // append a decompressed block to blocks_ and parse the messages it completes. parsed is the parsed size of blocks_.back()
+  bool parseBlock(const char *block, size_t block_size, size_t &parsed, std::atomic<bool> *abort);
+  size_t parse(const char *data, size_t size, std::atomic<bool> *abort);
+  bool finishParse(std::atomic<bool> *abort);
+
+  const std::vector<bool> filters_;
   std::string raw_;
-#ifdef HAS_MEMORY_RESOURCE
-  std::unique_ptr<std::pmr::monotonic_buffer_resource> mbr_;
-#endif
+  std::unique_ptr<MappedFile> mapped_file_;
+  // decompressed logs are parsed block by block. events point into the blocks, so they never grow past their capacity.
+  std::vector<std::string> blocks_;
+};
+
+// Sorted events of several segments. Each segment keeps its own sorted chunk, so adding or
+// removing a segment never touches the others. Chunks are immutable and shared between copies.
+class MergedEvents {
+public:
+  typedef std::map<int, std::shared_ptr<const std::vector<Event>>> ChunkMap;
+
+  // iterates the chunks in merged order
+  class Cursor {
+  public:
+    inline bool end() const { return cur_ == nullptr; }
+    inline const Event &operator*() const { return *cur_; }
+    inline const Event *operator->() const { return cur_; }
+    Cursor &operator++();
+
+  private:
+    friend class MergedEvents;
+    void select();
+
+    std::vector<std::pair<const Event *, const Event *>> ranges_;
+    size_t cur_range_ = 0;
+    const Event *cur_ = nullptr;
+    const Event *bound_ = nullptr;  // smallest head of the other ranges
+  };
+
+  void insert(int seg, std::shared_ptr<const std::vector<Event>> events);
+  void erase(int seg);
+  Cursor begin() const;
+  Cursor upperBound(const Event &e) const;
+  const Event *back() const;
+  inline bool contains(int seg) const { return chunks_.count(seg) > 0; }
+  inline bool empty() const { return size_ == 0; }
+  inline size_t size() const { return size_; }
+  inline const ChunkMap &chunks() const { return chunks_; }
+
+private:
+  ChunkMap chunks_;
+  size_t size_ = 0;
 };
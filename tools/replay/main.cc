@@ -3,6 +3,7 @@
 
 #include "common/prefix.h"
 #include "tools/replay/consoleui.h"
+#include "tools/replay/filecache.h"
 #include "tools/replay/replay.h"
 
 int main(int argc, char *argv[]) {
@@ -21,6 +22,8 @@ int main(int argc, char *argv[]) {
       {"qcam", REPLAY_FLAG_QCAMERA, "load qcamera"},
       {"no-hw-decoder", REPLAY_FLAG_NO_HW_DECODER, "disable HW video decoding"},
       {"no-vipc", REPLAY_FLAG_NO_VIPC, "do not output video"},
+      {"full-speed", REPLAY_FLAG_FULL_SPEED, "publish as fast as subscribers consume, ignoring playback speed"},
+      {"timerfd", REPLAY_FLAG_TIMERFD, "pace the stream with a timerfd instead of clock_nanosleep"},
       {"all", REPLAY_FLAG_ALL_SERVICES, "do output all messages including uiDebug, userFlag"
                                         ". this may causes issues when used along with UI"}
   };
@@ -31,8 +34,16 @@ int main(int argc, char *argv[]) {
   parser.addPositionalArgument("route", "the drive to replay. find your drives at connect.comma.ai");
   parser.addOption({{"a", "allow"}, "whitelist of services to send", "allow"});
   parser.addOption({{"b", "block"}, "blacklist of services to send", "block"});
-  parser.addOption({{"c", "cache"}, "cache <n> segments in memory. default is 5", "n"});
+  parser.addOption({"lockstep", "wait for <services> to respond at each of their logged messages instead of sending them", "services"});
+  parser.addOption({{"c", "cache"}, "cache at most <n> segments in memory", "n"});
+  parser.addOption({"log-memory", QString("cache the segments whose logs fit in <mb>. default is %1").arg(DEFAULT_LOG_MEMORY_MB), "mb"});
+  parser.addOption({"video-memory", QString("cache the segments whose videos fit in <mb>. default is %1").arg(DEFAULT_VIDEO_MEMORY_MB), "mb"});
   parser.addOption({{"s", "start"}, "start from <seconds>", "seconds"});
+  parser.addOption({"frame-cache", QString("cache <mb> of decoded frames per camera. default is %1").arg(DEFAULT_FRAME_CACHE_MB), "mb"});
+  parser.addOption({"vipc-buffers", QString("create <n> VisionIPC buffers per camera. default is %1").arg(YUV_BUFFER_COUNT), "n"});
+  parser.addOption({"cache-budget", QString("limit the download cache to <mb>. default is %1").arg(DEFAULT_CACHE_BUDGET_MB), "mb"});
+  parser.addOption({"stream-core", "pin the stream thread to <core>", "core"});
+  parser.addOption({"decode-threads", "use <n> threads per software video decoder. default is 0 (auto)", "n"});
   parser.addOption({"x", QString("playback <speed>. between %1 - %2")
                         .arg(ConsoleUI::speed_array.front()).arg(ConsoleUI::speed_array.back()), "speed"});
   parser.addOption({"demo", "use a demo route instead of providing your own"});
@@ -69,6 +80,28 @@ int main(int argc, char *argv[]) {
   if (!parser.value("c").isEmpty()) {
     replay->setSegmentCacheLimit(parser.value("c").toInt());
   }
+  if (!parser.value("log-memory").isEmpty() || !parser.value("video-memory").isEmpty()) {
+    replay->setMemoryBudget(parser.value("log-memory").isEmpty() ? DEFAULT_LOG_MEMORY_MB : parser.value("log-memory").toInt(),
+                            parser.value("video-memory").isEmpty() ? DEFAULT_VIDEO_MEMORY_MB : parser.value("video-memory").toInt());
+  }
+  if (!parser.value("frame-cache").isEmpty()) {
+    replay->setFrameCacheSize(parser.value("frame-cache").toInt());
+  }
+  if (!parser.value("lockstep").isEmpty()) {
+    replay->setLockstepServices(parser.value("lockstep").split(","));
+  }
+  if (!parser.value("cache-budget").isEmpty()) {
+    FileCache::instance().setBudget((size_t)parser.value("cache-budget").toInt() * 1024 * 1024);
+  }
+  if (!parser.value("vipc-buffers").isEmpty()) {
+    replay->setVipcBufferCount(parser.value("vipc-buffers").toInt());
+  }
+  if (!parser.value("stream-core").isEmpty()) {
+    replay->setStreamCore(parser.value("stream-core").toInt());
+  }
+  if (!parser.value("decode-threads").isEmpty()) {
+    FrameReader::setDecodeThreads(parser.value("decode-threads").toInt());
+  }
   if (!parser.value("x").isEmpty()) {
     replay->setSpeed(std::clamp(parser.value("x").toFloat(),
                                 ConsoleUI::speed_array.front(), ConsoleUI::speed_array.back()));
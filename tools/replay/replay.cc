@@ -1,12 +1,18 @@
 #include "tools/replay/replay.h"
 
+#include <chrono>
+#include <numeric>
+#include <thread>
+
 #include <QDebug>
+#include <QMetaMethod>
 #include <QtConcurrent>
 
 #include <capnp/dynamic.h>
 #include "cereal/services.h"
 #include "common/params.h"
 #include "common/timing.h"
+#include "common/util.h"
 #include "tools/replay/util.h"
 
 Replay::Replay(QString route, QStringList allow, QStringList block, SubMaster *sm_,
@@ -29,12 +35,14 @@ Replay::Replay(QString route, QStringList allow, QStringList block, SubMaster *s
   qDebug() << "services " << s;
   qDebug() << "loading route " << route;
 
-  if (sm == nullptr) {
-    pm = std::make_unique<PubMaster>(s);
-  }
+  pub_sockets_.resize(sockets_.size());
+  lockstep_sockets_.resize(sockets_.size());
+  lockstep_.resize(sockets_.size(), false);
+  backpressure_.resize(sockets_.size(), true);
+  publish_counters_ = std::make_unique<PublishCounters[]>(sockets_.size());
+  segment_pool_.setMaxThreadCount(MAX_PARALLEL_SEGMENT_LOADS * (MAX_CAMERAS + 1));
   route_ = std::make_unique<Route>(route, data_dir);
-  events_ = std::make_unique<std::vector<Event *>>();
-  new_events_ = std::make_unique<std::vector<Event *>>();
+  snapshot_ = std::make_shared<StreamSnapshot>();
 }
 
 Replay::~Replay() {
@@ -46,7 +54,7 @@ void Replay::stop() {
 
   rInfo("shutdown: in progress...");
   if (stream_thread_ != nullptr) {
-    exit_ = updating_events_ = true;
+    exit_ = true;
     stream_cv_.notify_one();
     stream_thread_->quit();
     stream_thread_->wait();
@@ -55,6 +63,16 @@ void Replay::stop() {
   camera_server_.reset(nullptr);
   timeline_future.waitForFinished();
   segments_.clear();
+
+  const auto jitter = publishJitter();
+  if (std::accumulate(jitter.begin(), jitter.end(), uint64_t(0)) > 0) {
+    std::string s;
+    for (int i = 0; i < jitter.size(); ++i) {
+      s += (i < std::size(PUBLISH_JITTER_BUCKETS_US) ? "<" + std::to_string(PUBLISH_JITTER_BUCKETS_US[i]) : ">=" + std::to_string(PUBLISH_JITTER_BUCKETS_US[i - 1]));
+      s += "us: " + std::to_string(jitter[i]) + (i + 1 < jitter.size() ? ", " : "");
+    }
+    rInfo("publish jitter %s", s.c_str());
+  }
   rInfo("shutdown: done");
 }
 
@@ -84,13 +102,26 @@ void Replay::start(int seconds) {
   seekTo(route_->identifier().segment_id * 60 + seconds, false);
 }
 
+void Replay::setLockstepServices(const QStringList &names) {
+  auto event_struct = capnp::Schema::from<cereal::Event>().asStruct();
+  for (const auto &name : names) {
+    auto it = services.find(name.toStdString());
+    if (it == services.end()) {
+      rWarning("lockstep: unknown service %s", qPrintable(name));
+      continue;
+    }
+    uint16_t which = event_struct.getFieldByName(it->first).getProto().getDiscriminantValue();
+    // keep the logged messages as barriers even if the service is not in the allow list
+    sockets_[which] = it->first.c_str();
+    lockstep_[which] = true;
+  }
+}
+
 void Replay::updateEvents(const std::function<bool()> &lambda) {
-  // set updating_events to true to force stream thread release the lock and wait for events_updated.
-  updating_events_ = true;
+  // the stream thread only holds the lock between two runs of its publishing loop, this never waits for it.
   {
     std::unique_lock lk(stream_lock_);
     events_updated_ = lambda();
-    updating_events_ = false;
   }
   stream_cv_.notify_one();
 }
@@ -107,7 +138,8 @@ void Replay::seekTo(double seconds, bool relative) {
 
     rInfo("seeking to %d s, segment %d", (int)seconds, seg);
     current_segment_ = seg;
-    cur_mono_time_ = route_start_ts_ + seconds * 1e9;
+    cur_mono_time_ = seek_mono_time_ = route_start_ts_ + seconds * 1e9;
+    ++seek_seq_;
     emit seekedTo(seconds);
     return isSegmentMerged(seg);
   });
@@ -120,76 +152,67 @@ void Replay::seekToFlag(FindFlag flag) {
   }
 }
 
-void Replay::buildTimeline() {
-  uint64_t engaged_begin = 0;
-  bool engaged = false;
-
-  auto alert_status = cereal::ControlsState::AlertStatus::NORMAL;
-  auto alert_size = cereal::ControlsState::AlertSize::NONE;
-  uint64_t alert_begin = 0;
-  std::string alert_type;
-
-  const TimelineType timeline_types[] = {
-    [(int)cereal::ControlsState::AlertStatus::NORMAL] = TimelineType::AlertInfo,
-    [(int)cereal::ControlsState::AlertStatus::USER_PROMPT] = TimelineType::AlertWarning,
-    [(int)cereal::ControlsState::AlertStatus::CRITICAL] = TimelineType::AlertCritical,
-  };
+void Replay::seekToEvent(cereal::Event::Which which) {
+  if (auto next = timeline_.nextEvent(which, cur_mono_time_)) {
+    seekTo(toSeconds(*next) - 2, false);  // seek to 2 seconds before next
+  }
+}
 
+const std::vector<std::tuple<double, double, TimelineType>> Replay::getTimeline() const {
+  std::vector<std::tuple<double, double, TimelineType>> timeline;
+  for (const auto &e : timeline_.entries()) {
+    timeline.push_back({toSeconds(e.begin), toSeconds(e.end), e.type});
+  }
+  return timeline;
+}
+
+void Replay::buildTimeline() {
+  // loaded segments add their timelines as they are parsed. the others are read from the
+  // timelines in the download cache, and only built from their qlogs the first time.
+  const bool local_cache = !hasFlag(REPLAY_FLAG_NO_FILE_CACHE);
+  const bool emit_qlogs = isSignalConnected(QMetaMethod::fromSignal(&Replay::qLogLoaded));
   const auto &route_segments = route_->segments();
   for (auto it = route_segments.cbegin(); it != route_segments.cend() && !exit_; ++it) {
-    std::shared_ptr<LogReader> log(new LogReader());
-    if (!log->load(it->second.qlog.toStdString(), &exit_, !hasFlag(REPLAY_FLAG_NO_FILE_CACHE), 0, 3)) continue;
-
-    for (const Event *e : log->events) {
-      if (e->which == cereal::Event::Which::CONTROLS_STATE) {
-        auto cs = e->event.getControlsState();
-
-        if (engaged != cs.getEnabled()) {
-          if (engaged) {
-            std::lock_guard lk(timeline_lock);
-            timeline.push_back({toSeconds(engaged_begin), toSeconds(e->mono_time), TimelineType::Engaged});
-          }
-          engaged_begin = e->mono_time;
-          engaged = cs.getEnabled();
-        }
-
-        if (alert_type != cs.getAlertType().cStr() || alert_status != cs.getAlertStatus()) {
-          if (!alert_type.empty() && alert_size != cereal::ControlsState::AlertSize::NONE) {
-            std::lock_guard lk(timeline_lock);
-            timeline.push_back({toSeconds(alert_begin), toSeconds(e->mono_time), timeline_types[(int)alert_status]});
-          }
-          alert_begin = e->mono_time;
-          alert_type = cs.getAlertType().cStr();
-          alert_size = cs.getAlertSize();
-          alert_status = cs.getAlertStatus();
-        }
-      } else if (e->which == cereal::Event::Which::USER_FLAG) {
-        std::lock_guard lk(timeline_lock);
-        timeline.push_back({toSeconds(e->mono_time), toSeconds(e->mono_time), TimelineType::UserFlag});
+    bool has_timeline = timeline_.contains(it->first);
+    for (const auto &file : {it->second.rlog, it->second.qlog}) {
+      if (has_timeline || !local_cache || file.isEmpty()) continue;
+
+      auto timeline = std::make_shared<SegmentTimeline>();
+      if (timeline->loadCached(file.toStdString())) {
+        timeline_.insert(it->first, timeline, false);
+        has_timeline = true;
       }
     }
-    std::sort(timeline.begin(), timeline.end(), [](auto &l, auto &r) { return std::get<2>(l) < std::get<2>(r); });
+    // the qlogs are still loaded for the thumbnails of cabana
+    if (has_timeline && !emit_qlogs) continue;
+
+    std::shared_ptr<LogReader> log(new LogReader());
+    const std::string qlog = it->second.qlog.toStdString();
+    if (!log->load(qlog, &exit_, local_cache, 0, 3)) continue;
+
+    if (!has_timeline) {
+      auto timeline = std::make_shared<SegmentTimeline>();
+      timeline->build(log->events);
+      if (local_cache) timeline->saveCached(qlog);
+      timeline_.insert(it->first, timeline, false);
+    }
     emit qLogLoaded(it->first, log);
   }
 }
 
 std::optional<uint64_t> Replay::find(FindFlag flag) {
-  int cur_ts = currentSeconds();
-  for (auto [start_ts, end_ts, type] : getTimeline()) {
-    if (type == TimelineType::Engaged) {
-      if (flag == FindFlag::nextEngagement && start_ts > cur_ts) {
-        return start_ts;
-      } else if (flag == FindFlag::nextDisEngagement && end_ts > cur_ts) {
-        return end_ts;
-      }
-    } else if (start_ts > cur_ts) {
-      if ((flag == FindFlag::nextUserFlag && type == TimelineType::UserFlag) ||
-          (flag == FindFlag::nextInfo && type == TimelineType::AlertInfo) ||
-          (flag == FindFlag::nextWarning && type == TimelineType::AlertWarning) ||
-          (flag == FindFlag::nextCritical && type == TimelineType::AlertCritical)) {
-        return start_ts;
-      }
-    }
+  const uint64_t cur_mono_time = cur_mono_time_;
+  const std::map<FindFlag, TimelineType> types = {
+    {FindFlag::nextEngagement, TimelineType::Engaged},
+    {FindFlag::nextDisEngagement, TimelineType::Engaged},
+    {FindFlag::nextUserFlag, TimelineType::UserFlag},
+    {FindFlag::nextInfo, TimelineType::AlertInfo},
+    {FindFlag::nextWarning, TimelineType::AlertWarning},
+    {FindFlag::nextCritical, TimelineType::AlertCritical},
+  };
+  const bool by_end = flag == FindFlag::nextDisEngagement;
+  if (auto entry = timeline_.next(types.at(flag), cur_mono_time, by_end)) {
+    return toSeconds(by_end ? entry->end : entry->begin);
   }
   return std::nullopt;
 }
@@ -202,20 +225,40 @@ void Replay::pause(bool pause) {
   });
 }
 
+// called by the stream thread as it publishes events. the segment of a seek is set by seekTo under
+// stream_lock_, it is only replaced under the lock too and not once a newer seek is pending.
 void Replay::setCurrentSegment(int n) {
-  if (current_segment_.exchange(n) != n) {
-    QMetaObject::invokeMethod(this, &Replay::queueSegment, Qt::QueuedConnection);
+  if (current_segment_ == n) return;
+
+  {
+    std::unique_lock lk(stream_lock_);
+    if (seek_seq_ != stream_seek_seq_ || current_segment_.exchange(n) == n) return;
   }
+  QMetaObject::invokeMethod(this, &Replay::queueSegment, Qt::QueuedConnection);
 }
 
 void Replay::segmentLoadFinished(bool success) {
+  Segment *seg = qobject_cast<Segment *>(sender());
   if (!success) {
-    Segment *seg = qobject_cast<Segment *>(sender());
     rWarning("failed to load segment %d, removing it from current replay list", seg->seg_num);
     updateEvents([&]() {
       segments_.erase(seg->seg_num);
       return true;
     });
+  } else {
+    auto add_stats = [](LoadStats &total, const LoadStats &s) {
+      total.read_ms += s.read_ms;
+      total.decompress_ms += s.decompress_ms;
+      total.parse_ms += s.parse_ms;
+    };
+    add_stats(load_stats_.log, seg->log->stats);
+    for (const auto &fr : seg->frames) {
+      if (fr) add_stats(load_stats_.video, fr->stats);
+    }
+    timeline_.insert(seg->seg_num, seg->timeline);
+    ++load_stats_.loaded;
+    rDebug("segment %d loaded: read %.1f ms, decompress %.1f ms, parse %.1f ms", seg->seg_num,
+           seg->log->stats.read_ms, seg->log->stats.decompress_ms, seg->log->stats.parse_ms);
   }
   queueSegment();
 }
@@ -224,15 +267,35 @@ void Replay::queueSegment() {
   auto cur = segments_.lower_bound(current_segment_.load());
   if (cur == segments_.end()) return;
 
-  auto begin = std::prev(cur, std::min<int>(segment_cache_limit / 2, std::distance(segments_.begin(), cur)));
-  auto end = std::next(begin, std::min<int>(segment_cache_limit, segments_.size()));
-  // load one segment at a time
-  auto it = std::find_if(cur, end, [](auto &it) { return !it.second || !it.second->isLoaded(); });
-  if (it != end && !it->second) {
-    rDebug("loading segment %d...", it->first);
-    it->second = std::make_unique<Segment>(it->first, route_->at(it->first), flags_);
-    QObject::connect(it->second.get(), &Segment::loadFinished, this, &Replay::segmentLoadFinished);
+  auto [begin, end] = cacheWindow(cur);
+
+  // load segments in parallel, nearest to the playhead first. segments after the playhead win ties.
+  std::vector<SegmentMap::iterator> pending;
+  int loading = 0;
+  for (auto it = begin; it != end; ++it) {
+    if (!it->second) {
+      pending.push_back(it);
+    } else if (!it->second->isLoaded()) {
+      ++loading;
+    }
   }
+  const int cur_seg = cur->first;
+  std::sort(pending.begin(), pending.end(), [cur_seg](auto &l, auto &r) {
+    return std::make_pair(std::abs(l->first - cur_seg), l->first < cur_seg) <
+           std::make_pair(std::abs(r->first - cur_seg), r->first < cur_seg);
+  });
+  auto pending_it = pending.begin();
+  for (; pending_it != pending.end(); ++pending_it, ++loading) {
+    // the current segment never waits for a free slot
+    if (loading >= MAX_PARALLEL_SEGMENT_LOADS && (*pending_it)->first != cur_seg) break;
+
+    auto &[n, seg] = **pending_it;
+    rDebug("loading segment %d...", n);
+    seg = std::make_unique<Segment>(n, route_->at(n), flags_, &segment_pool_, logFilters());
+    QObject::connect(seg.get(), &Segment::loadFinished, this, &Replay::segmentLoadFinished);
+  }
+  load_stats_.queued = std::distance(pending_it, pending.end());
+  load_stats_.loading = loading;
 
   mergeSegments(begin, end);
 
@@ -242,19 +305,87 @@ void Replay::queueSegment() {
 
   // start stream thread
   const auto &cur_segment = cur->second;
-  if (stream_thread_ == nullptr && cur_segment->isLoaded()) {
+  if (stream_thread_ == nullptr && cur_segment && cur_segment->isLoaded()) {
     startStream(cur_segment.get());
     emit streamStarted();
   }
 }
 
+std::vector<bool> Replay::logFilters() const {
+  // besides the replayed services, keep what startStream and the timeline read from the log
+  std::vector<bool> filters(sockets_.size(), false);
+  for (size_t which = 0; which < sockets_.size(); ++which) {
+    filters[which] = sockets_[which] != nullptr;
+  }
+  for (auto which : {cereal::Event::Which::INIT_DATA, cereal::Event::Which::CAR_PARAMS, cereal::Event::Which::CONTROLS_STATE}) {
+    filters[which] = true;
+  }
+  for (auto which : TIMELINE_INDEXED_SERVICES) {
+    filters[which] = true;
+  }
+  return filters;
+}
+
+std::pair<Replay::SegmentMap::iterator, Replay::SegmentMap::iterator> Replay::cacheWindow(SegmentMap::iterator cur) {
+  // segments that are not loaded yet are expected to use as much as the loaded ones on average
+  SegmentMemory loaded_total;
+  int loaded = 0;
+  for (const auto &[n, seg] : segments_) {
+    if (seg && seg->isLoaded()) {
+      SegmentMemory memory = seg->memoryUsage();
+      loaded_total.log += memory.log;
+      for (int i = 0; i < MAX_CAMERAS; ++i) loaded_total.video[i] += memory.video[i];
+      ++loaded;
+    }
+  }
+  auto usage = [&](const SegmentMap::iterator &it) -> std::pair<size_t, size_t> {
+    if (it->second && it->second->isLoaded()) {
+      SegmentMemory memory = it->second->memoryUsage();
+      return {memory.log, memory.videoTotal()};
+    } else if (loaded > 0) {
+      return {loaded_total.log / loaded, loaded_total.videoTotal() / loaded};
+    }
+    return {INITIAL_SEGMENT_LOG_MB * 1024 * 1024, hasFlag(REPLAY_FLAG_NO_VIPC) ? 0 : INITIAL_SEGMENT_VIDEO_MB * 1024 * 1024};
+  };
+
+  size_t log_bytes = 0, video_bytes = 0;
+  int count = 0;
+  auto fits = [&](const SegmentMap::iterator &it) {
+    auto [log, video] = usage(it);
+    if (count >= MIN_SEGMENTS_CACHE && (count >= segment_cache_limit || log_bytes + log > log_memory_budget_ ||
+                                        video_bytes + video > video_memory_budget_)) {
+      return false;
+    }
+    log_bytes += log;
+    video_bytes += video;
+    ++count;
+    return true;
+  };
+
+  // grow the window by one segment on each side in turn, the side after the playhead first
+  fits(cur);
+  auto begin = cur, end = std::next(cur);
+  for (bool grown = true; grown;) {
+    grown = false;
+    if (end != segments_.end() && fits(end)) {
+      ++end;
+      grown = true;
+    }
+    if (begin != segments_.begin() && fits(std::prev(begin))) {
+      --begin;
+      grown = true;
+    }
+  }
+  load_stats_.log_bytes = log_bytes;
+  load_stats_.video_bytes = video_bytes;
+  return {begin, end};
+}
+
 void Replay::mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::iterator &end) {
   std::vector<int> segments_need_merge;
-  size_t new_events_size = 0;
   for (auto it = begin; it != end; ++it) {
     if (it->second && it->second->isLoaded()) {
       segments_need_merge.push_back(it->first);
-      new_events_size += it->second->log->events.size();
     }
   }
 
@@ -265,21 +396,38 @@ void Replay::mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::
       if (i != segments_need_merge.size() - 1) s += ", ";
     }
     rDebug("merge segments %s", s.c_str());
-    new_events_->clear();
-    new_events_->reserve(new_events_size);
+
+    // only the added and evicted segments are touched, the other chunks are shared with the current snapshot.
+    auto snapshot = std::make_shared<StreamSnapshot>();
+    snapshot->events = std::atomic_load(&snapshot_)->events;
+    for (int n : segments_merged_) {
+      if (!std::binary_search(segments_need_merge.begin(), segments_need_merge.end(), n)) {
+        snapshot->events.erase(n);
+      }
+    }
     for (int n : segments_need_merge) {
-      size_t size = new_events_->size();
-      const auto &events = segments_[n]->log->events;
-      std::copy_if(events.begin(), events.end(), std::back_inserter(*new_events_),
-                   [this](auto e) { return e->which < sockets_.size() && sockets_[e->which] != nullptr; });
-      std::inplace_merge(new_events_->begin(), new_events_->begin() + size, new_events_->end(), Event::lessThan());
+      const auto &seg = segments_[n];
+      if (!snapshot->events.contains(n)) {
+        const auto &events = seg->log->events;
+        auto chunk = std::make_shared<std::vector<Event>>();
+        chunk->reserve(events.size());
+        std::copy_if(events.begin(), events.end(), std::back_inserter(*chunk),
+                     [this](auto &e) { return e.which < sockets_.size() && sockets_[e.which] != nullptr; });
+        snapshot->events.insert(n, chunk);
+      }
+      auto &data = snapshot->segments[n];
+      data.log = seg->log;
+      std::copy(std::begin(seg->frames), std::end(seg->frames), data.frames.begin());
     }
+    snapshot->last_segment = segments_.empty() ? 0 : segments_.rbegin()->first;
 
     if (stream_thread_) {
       emit segmentsMerged();
     }
     updateEvents([&]() {
-      events_.swap(new_events_);
+      // a running stream thread switches to the new snapshot after the event it is publishing
+      std::atomic_store(&snapshot_, std::shared_ptr<const StreamSnapshot>(snapshot));
+      ++snapshot_seq_;
       segments_merged_ = segments_need_merge;
       // Do not wake up the stream thread if the current segment has not been merged.
       return isSegmentMerged(current_segment_) || (segments_.count(current_segment_) == 0);
@@ -291,15 +439,18 @@ void Replay::startStream(const Segment *cur_segment) {
   const auto &events = cur_segment->log->events;
 
   // each segment has an INIT_DATA
-  route_start_ts_ = events.front()->mono_time;
+  route_start_ts_ = events.front().mono_time;
   cur_mono_time_ += route_start_ts_ - 1;
+  seek_mono_time_ = cur_mono_time_;
 
   // write CarParams
-  auto it = std::find_if(events.begin(), events.end(), [](auto e) { return e->which == cereal::Event::Which::CAR_PARAMS; });
+  auto it = std::find_if(events.begin(), events.end(), [](auto &e) { return e.which == cereal::Event::Which::CAR_PARAMS; });
   if (it != events.end()) {
-    car_fingerprint_ = (*it)->event.getCarParams().getCarFingerprint();
+    capnp::FlatArrayMessageReader reader(it->data);
+    auto car_params = reader.getRoot<cereal::Event>().getCarParams();
+    car_fingerprint_ = car_params.getCarFingerprint();
     capnp::MallocMessageBuilder builder;
-    builder.setRoot((*it)->event.getCarParams());
+    builder.setRoot(car_params);
     auto words = capnp::messageToFlatArray(builder);
     auto bytes = words.asBytes();
     Params().put("CarParams", (const char *)bytes.begin(), bytes.size());
@@ -308,6 +459,28 @@ void Replay::startStream(const Segment *cur_segment) {
     rWarning("failed to read CarParams from current segment");
   }
 
+  // create publishers, unless the messages go to the SubMaster. lockstep services are published
+  // by the process under test, they are subscribed to in either case.
+  context_.reset(Context::create());
+  for (int which = 0; which < sockets_.size(); ++which) {
+    if (!sockets_[which]) continue;
+
+    if (lockstep_[which]) {
+      lockstep_sockets_[which].reset(SubSocket::create(context_.get(), sockets_[which]));
+      if (lockstep_sockets_[which]) {
+        lockstep_sockets_[which]->setTimeout(LOCKSTEP_TIMEOUT_MS);
+      } else {
+        rWarning("lockstep: failed to subscribe to %s", sockets_[which]);
+      }
+    } else if (sm == nullptr) {
+      pub_sockets_[which].reset(PubSocket::create(context_.get(), sockets_[which]));
+      if (!pub_sockets_[which]) {
+        rWarning("failed to create publisher for %s", sockets_[which]);
+        sockets_[which] = nullptr;
+      }
+    }
+  }
+
   // start camera server
   if (!hasFlag(REPLAY_FLAG_NO_VIPC)) {
     std::pair<int, int> camera_size[MAX_CAMERAS] = {};
@@ -316,7 +489,10 @@ void Replay::startStream(const Segment *cur_segment) {
         camera_size[type] = {fr->width, fr->height};
       }
     }
-    camera_server_ = std::make_unique<CameraServer>(camera_size);
+    camera_server_ = std::make_unique<CameraServer>(camera_size, frame_cache_mb_, vipc_buffer_count_);
+    camera_server_->setSpeed(speed_);
+    // in full speed mode every frame is sent, the messages wait for a free slot in the frame queue
+    camera_server_->setDropFrames(!hasFlag(REPLAY_FLAG_FULL_SPEED));
   }
 
   emit segmentsMerged();
@@ -332,19 +508,93 @@ void Replay::startStream(const Segment *cur_segment) {
 void Replay::publishMessage(const Event *e) {
   if (event_filter && event_filter(e, filter_opaque)) return;
 
+  auto &counters = publish_counters_[e->which];
   if (sm == nullptr) {
+    if (hasFlag(REPLAY_FLAG_FULL_SPEED)) {
+      waitForReaders(e);
+    }
     auto bytes = e->bytes();
-    int ret = pm->send(sockets_[e->which], (capnp::byte *)bytes.begin(), bytes.size());
+    const uint64_t send_start_ns = nanos_since_boot();
+    int ret = pub_sockets_[e->which]->send((char *)bytes.begin(), bytes.size());
     if (ret == -1) {
+      ++counters.dropped;
       rWarning("stop publishing %s due to multiple publishers error", sockets_[e->which]);
       sockets_[e->which] = nullptr;
+      return;
     }
+    updatePublishCounters(counters, nanos_since_boot() - send_start_ns);
   } else {
-    sm->update_msgs(nanos_since_boot(), {{sockets_[e->which], e->event}});
+    capnp::FlatArrayMessageReader reader(e->data);
+    const uint64_t send_start_ns = nanos_since_boot();
+    sm->update_msgs(send_start_ns, {{sockets_[e->which], reader.getRoot<cereal::Event>()}});
+    updatePublishCounters(counters, nanos_since_boot() - send_start_ns);
+  }
+}
+
+void Replay::updatePublishCounters(PublishCounters &counters, uint64_t send_ns) {
+  // only the stream thread writes the counters
+  counters.sent.store(counters.sent.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  counters.send_ns.store(counters.send_ns.load(std::memory_order_relaxed) + send_ns, std::memory_order_relaxed);
+  if (send_ns > counters.max_send_ns.load(std::memory_order_relaxed)) {
+    counters.max_send_ns.store(send_ns, std::memory_order_relaxed);
   }
 }
 
-void Replay::publishFrame(const Event *e) {
+void Replay::updatePublishJitter(int64_t jitter_ns) {
+  const int64_t jitter_us = std::abs(jitter_ns) / 1000;
+  auto it = std::upper_bound(std::begin(PUBLISH_JITTER_BUCKETS_US), std::end(PUBLISH_JITTER_BUCKETS_US), jitter_us);
+  auto &count = jitter_counts_[std::distance(std::begin(PUBLISH_JITTER_BUCKETS_US), it)];
+  count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+std::vector<uint64_t> Replay::publishJitter() const {
+  return std::vector<uint64_t>(jitter_counts_.begin(), jitter_counts_.end());
+}
+
+std::map<std::string, PublishStats> Replay::publishStats() const {
+  std::map<std::string, PublishStats> stats;
+  for (auto field : capnp::Schema::from<cereal::Event>().asStruct().getUnionFields()) {
+    const auto &counters = publish_counters_[field.getProto().getDiscriminantValue()];
+    const uint64_t sent = counters.sent, dropped = counters.dropped;
+    if (sent == 0 && dropped == 0) continue;
+
+    stats[field.getProto().getName().cStr()] = {
+      .sent = sent,
+      .dropped = dropped,
+      .avg_send_us = sent > 0 ? counters.send_ns / 1e3 / sent : 0,
+      .max_send_us = counters.max_send_ns / 1e3,
+    };
+  }
+  return stats;
+}
+
+void Replay::waitForReaders(const Event *e) {
+  // backpressure: send once every reader has consumed the previous message of this service
+  if (!backpressure_[e->which]) return;
+
+  const uint64_t deadline = nanos_since_boot() + BACKPRESSURE_TIMEOUT_MS * 1e6;
+  while (!pub_sockets_[e->which]->all_readers_updated() && !interrupted()) {
+    if (nanos_since_boot() > deadline) {
+      rWarning("readers of %s are not keeping up, stop waiting for them", sockets_[e->which]);
+      backpressure_[e->which] = false;
+      break;
+    }
+    // sleep rather than spin, the readers being waited for need the core
+    std::this_thread::sleep_for(std::chrono::microseconds(BACKPRESSURE_POLL_US));
+  }
+}
+
+void Replay::waitForLockstep(const Event *e) {
+  // the service under test published this message in the original drive. wait until it does so again.
+  if (auto &sock = lockstep_sockets_[e->which]) {
+    std::unique_ptr<Message> msg(sock->receive());
+    if (!msg) {
+      rWarning("lockstep: no response from %s within %d ms", sockets_[e->which], LOCKSTEP_TIMEOUT_MS);
+    }
+  }
+}
+
+void Replay::publishFrame(const Event *e, const StreamSnapshot &snapshot) {
   static const std::map<cereal::Event::Which, CameraType> cam_types{
       {cereal::Event::ROAD_ENCODE_IDX, RoadCam},
       {cereal::Event::DRIVER_ENCODE_IDX, DriverCam},
@@ -354,72 +604,100 @@ void Replay::publishFrame(const Event *e) {
       (e->which == cereal::Event::WIDE_ROAD_ENCODE_IDX && !hasFlag(REPLAY_FLAG_ECAM))) {
     return;
   }
-  auto eidx = capnp::AnyStruct::Reader(e->event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
-  if (eidx.getType() == cereal::EncodeIndex::Type::FULL_H_E_V_C && isSegmentMerged(eidx.getSegmentNum())) {
+  capnp::FlatArrayMessageReader reader(e->data);
+  auto event = reader.getRoot<cereal::Event>();
+  auto eidx = capnp::AnyStruct::Reader(event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
+  if (eidx.getType() == cereal::EncodeIndex::Type::FULL_H_E_V_C && snapshot.isMerged(eidx.getSegmentNum())) {
     CameraType cam = cam_types.at(e->which);
-    camera_server_->pushFrame(cam, segments_[eidx.getSegmentNum()]->frames[cam].get(), eidx);
+    camera_server_->pushFrame(cam, snapshot.segments.at(eidx.getSegmentNum()).frames[cam], e);
   }
 }
 
 void Replay::stream() {
   cereal::Event::Which cur_which = cereal::Event::Which::INIT_DATA;
   double prev_replay_speed = speed_;
-  std::unique_lock lk(stream_lock_);
+  if (stream_core_ >= 0 && util::set_core_affinity({stream_core_}) != 0) {
+    rWarning("failed to pin the stream thread to core %d", stream_core_);
+  }
+  PrecisePacer pacer(hasFlag(REPLAY_FLAG_TIMERFD));
+  pacer.calibrate();
 
   while (true) {
-    stream_cv_.wait(lk, [=]() { return exit_ || (events_updated_ && !paused_); });
-    events_updated_ = false;
-    if (exit_) break;
+    {
+      std::unique_lock lk(stream_lock_);
+      stream_cv_.wait(lk, [=]() { return exit_ || (events_updated_ && !paused_); });
+      events_updated_ = false;
+      if (exit_) break;
+
+      if (stream_seek_seq_ != seek_seq_) {
+        // current_segment_ was set to the segment of seek_mono_time_ by seekTo under the lock
+        stream_seek_seq_ = seek_seq_;
+        cur_mono_time_ = seek_mono_time_;
+        cur_which = cereal::Event::Which::INIT_DATA;
+      }
+    }
 
-    Event cur_event(cur_which, cur_mono_time_);
-    auto eit = std::upper_bound(events_->begin(), events_->end(), &cur_event, Event::lessThan());
-    if (eit == events_->end()) {
+    uint64_t snapshot_seq = snapshot_seq_;
+    auto snapshot = std::atomic_load(&snapshot_);
+    auto eit = snapshot->events.upperBound(Event(cur_which, cur_mono_time_));
+    if (eit.end()) {
       rInfo("waiting for events...");
       continue;
     }
 
     uint64_t evt_start_ts = cur_mono_time_;
-    uint64_t loop_start_ts = nanos_since_boot();
+    uint64_t loop_start_ts = PrecisePacer::now();
+    uint64_t bucket_end_ts = 0;
 
-    for (auto end = events_->end(); !updating_events_ && eit != end; ++eit) {
-      const Event *evt = (*eit);
+    while (!eit.end() && !interrupted()) {
+      const Event *evt = &(*eit);
       cur_which = evt->which;
       cur_mono_time_ = evt->mono_time;
       setCurrentSegment(toSeconds(cur_mono_time_) / 60);
 
       if (sockets_[cur_which] != nullptr) {
-        // keep time
-        long etime = (cur_mono_time_ - evt_start_ts) / speed_;
-        long rtime = nanos_since_boot() - loop_start_ts;
-        long behind_ns = etime - rtime;
-        // if behind_ns is greater than 1 second, it means that an invalid segment is skipped by seeking/replaying
-        if (behind_ns >= 1 * 1e9 || speed_ != prev_replay_speed) {
-          // reset event start times
-          evt_start_ts = cur_mono_time_;
-          loop_start_ts = nanos_since_boot();
-          prev_replay_speed = speed_;
-        } else if (behind_ns > 0) {
-          precise_nano_sleep(behind_ns);
+        // keep time. in full speed mode events are paced by the readers instead.
+        // the rest of the bucket is published right after the first event of it.
+        if (!hasFlag(REPLAY_FLAG_FULL_SPEED) && cur_mono_time_ >= bucket_end_ts) {
+          bucket_end_ts = cur_mono_time_ + PUBLISH_BUCKET_US * 1000;
+          long etime = (cur_mono_time_ - evt_start_ts) / speed_;
+          long rtime = PrecisePacer::now() - loop_start_ts;
+          long behind_ns = etime - rtime;
+          // if behind_ns is greater than 1 second, it means that an invalid segment is skipped by seeking/replaying
+          if (behind_ns >= 1 * 1e9 || speed_ != prev_replay_speed) {
+            // reset event start times
+            evt_start_ts = cur_mono_time_;
+            loop_start_ts = PrecisePacer::now();
+            prev_replay_speed = speed_;
+          } else if (behind_ns > 0) {
+            pacer.sleepUntil(loop_start_ts + etime);
+          }
         }
 
         if (!evt->frame) {
-          publishMessage(evt);
-        } else if (camera_server_) {
-          if (speed_ > 1.0) {
-            camera_server_->waitForSent();
+          if (lockstep_[cur_which]) {
+            waitForLockstep(evt);
+          } else {
+            publishMessage(evt);
+            if (!hasFlag(REPLAY_FLAG_FULL_SPEED)) {
+              updatePublishJitter(PrecisePacer::now() - (loop_start_ts + (long)((cur_mono_time_ - evt_start_ts) / speed_)));
+            }
           }
-          publishFrame(evt);
+        } else if (camera_server_) {
+          publishFrame(evt, *snapshot);
         }
       }
-    }
-    // wait for frame to be sent before unlock.(frameReader may be deleted after unlock)
-    if (camera_server_) {
-      camera_server_->waitForSent();
-    }
 
-    if (eit == events_->end() && !hasFlag(REPLAY_FLAG_NO_LOOP)) {
-      int last_segment = segments_.empty() ? 0 : segments_.rbegin()->first;
-      if (current_segment_ >= last_segment && isSegmentMerged(last_segment)) {
+      ++eit;
+      if (snapshot_seq != snapshot_seq_) {
+        // segments were merged, continue after the last published event in the new snapshot
+        snapshot_seq = snapshot_seq_;
+        snapshot = std::atomic_load(&snapshot_);
+        eit = snapshot->events.upperBound(Event(cur_which, cur_mono_time_));
+      }
+    }
+    if (eit.end() && !hasFlag(REPLAY_FLAG_NO_LOOP)) {
+      if (current_segment_ >= snapshot->last_segment && snapshot->isMerged(snapshot->last_segment)) {
         rInfo("reaches the end of route, restart from beginning");
         QMetaObject::invokeMethod(this, std::bind(&Replay::seekTo, this, 0, false), Qt::QueuedConnection);
       }
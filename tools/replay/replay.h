@@ -1,6 +1,8 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <limits>
 #include <map>
 #include <memory>
 #include <optional>
@@ -10,14 +12,34 @@
 #include <utility>
 
 #include <QThread>
+#include <QThreadPool>
 
+#include "cereal/messaging/messaging.h"
 #include "tools/replay/camera.h"
 #include "tools/replay/route.h"
 
 const QString DEMO_ROUTE = "a2a0ccea32023010|2023-07-27--13-01-19";
 
-// one segment uses about 100M of memory
-constexpr int MIN_SEGMENTS_CACHE = 5;
+// the segments cached around the playhead are limited by the memory they use, with separate budgets for logs and videos
+constexpr int DEFAULT_LOG_MEMORY_MB = 1024;
+constexpr int DEFAULT_VIDEO_MEMORY_MB = 1024;
+// what a segment is expected to use until the first one is loaded
+constexpr size_t INITIAL_SEGMENT_LOG_MB = 100;
+constexpr size_t INITIAL_SEGMENT_VIDEO_MB = 100;
+// the current segment and the next one are cached whatever the budget
+constexpr int MIN_SEGMENTS_CACHE = 2;
+// segments are downloaded, decompressed and parsed in parallel, each on one worker per file
+constexpr int MAX_PARALLEL_SEGMENT_LOADS = 3;
+// in full speed mode, a service whose readers fall this far behind is no longer waited for
+constexpr int BACKPRESSURE_TIMEOUT_MS = 1000;
+// interval at which the readers are polled meanwhile
+constexpr int BACKPRESSURE_POLL_US = 50;
+// how long a lockstep barrier waits for the service under test to respond
+constexpr int LOCKSTEP_TIMEOUT_MS = 1000;
+// events logged within this window of each other are published in one burst after a single wakeup
+constexpr int PUBLISH_BUCKET_US = 1000;
+// upper bounds of the buckets of the publish jitter histogram, the last bucket has no bound
+constexpr int PUBLISH_JITTER_BUCKETS_US[] = {50, 100, 250, 500, 1000, 2000, 5000, 10000};
 
 enum REPLAY_FLAGS {
   REPLAY_FLAG_NONE = 0x0000,
@@ -29,6 +51,8 @@ enum REPLAY_FLAGS {
   REPLAY_FLAG_NO_HW_DECODER = 0x0100,
   REPLAY_FLAG_NO_VIPC = 0x0400,
   REPLAY_FLAG_ALL_SERVICES = 0x0800,
+  REPLAY_FLAG_FULL_SPEED = 0x1000,
+  REPLAY_FLAG_TIMERFD = 0x2000,
 };
 
 enum class FindFlag {
@@ -40,7 +64,38 @@ enum class FindFlag {
   nextCritical
 };
 
-enum class TimelineType { None, Engaged, AlertInfo, AlertWarning, AlertCritical, UserFlag };
+struct SegmentLoadStats {
+  int queued = 0;   // segments in the cache window waiting to be loaded
+  int loading = 0;
+  int loaded = 0;   // number of segments the stage times are accumulated over
+  LoadStats log;
+  LoadStats video;
+  // memory of the segments in the cache window, estimated for the ones not loaded yet
+  size_t log_bytes = 0;
+  size_t video_bytes = 0;
+};
+
+struct PublishStats {
+  uint64_t sent = 0;
+  uint64_t dropped = 0;  // sends that failed
+  double avg_send_us = 0;
+  double max_send_us = 0;
+};
+
+// what the stream thread publishes. it is immutable once shared and replaced as a whole
+// when segments are merged, so the stream thread never has to stop for a merge.
+struct StreamSnapshot {
+  struct SegmentData {
+    // the events point into the log. both outlive the segment while the snapshot is in use
+    std::shared_ptr<const LogReader> log;
+    std::array<std::shared_ptr<FrameReader>, MAX_CAMERAS> frames;
+  };
+  MergedEvents events;
+  std::map<int, SegmentData> segments;
+  int last_segment = 0;  // the last valid segment of the route
+  inline bool isMerged(int n) const { return events.contains(n); }
+};
+
 typedef bool (*replayEventFilter)(const Event *, void *);
 Q_DECLARE_METATYPE(std::shared_ptr<LogReader>);
 
@@ -56,6 +111,8 @@ public:
   void stop();
   void pause(bool pause);
   void seekToFlag(FindFlag flag);
+  // seek to the next event of a service in TIMELINE_INDEXED_SERVICES
+  void seekToEvent(cereal::Event::Which which);
   void seekTo(double seconds, bool relative);
   inline bool isPaused() const { return paused_; }
   // the filter is called in streaming thread.try to return quickly from it to avoid blocking streaming.
@@ -65,8 +122,13 @@ public:
     filter_opaque = opaque;
     event_filter = filter;
   }
+  // an upper bound on the number of cached segments, on top of the memory budget
   inline int segmentCacheLimit() const { return segment_cache_limit; }
   inline void setSegmentCacheLimit(int n) { segment_cache_limit = std::max(MIN_SEGMENTS_CACHE, n); }
+  inline void setMemoryBudget(int log_mb, int video_mb) {
+    log_memory_budget_ = (size_t)std::max(0, log_mb) * 1024 * 1024;
+    video_memory_budget_ = (size_t)std::max(0, video_mb) * 1024 * 1024;
+  }
   inline bool hasFlag(REPLAY_FLAGS flag) const { return flags_ & flag; }
   inline void addFlag(REPLAY_FLAGS flag) { flags_ |= flag; }
   inline void removeFlag(REPLAY_FLAGS flag) { flags_ &= ~flag; }
@@ -76,15 +138,32 @@ public:
   inline uint64_t routeStartTime() const { return route_start_ts_; }
   inline double toSeconds(uint64_t mono_time) const { return (mono_time - route_start_ts_) / 1e9; }
   inline int totalSeconds() const { return (!segments_.empty()) ? (segments_.rbegin()->first + 1) * 60 : 0; }
-  inline void setSpeed(float speed) { speed_ = speed; }
+  inline void setSpeed(float speed) {
+    speed_ = speed;
+    if (camera_server_) camera_server_->setSpeed(speed);
+  }
+  inline void setFrameCacheSize(int mb) { frame_cache_mb_ = mb; }
+  // number of VisionIPC buffers per camera. call before start()
+  inline void setVipcBufferCount(int n) { vipc_buffer_count_ = n; }
+  // pin the stream thread to a core. call before start()
+  inline void setStreamCore(int core) { stream_core_ = core; }
+  // the services are not published. each of their logged messages becomes a barrier
+  // that waits for the live service to publish a response. call before start().
+  void setLockstepServices(const QStringList &names);
   inline float getSpeed() const { return speed_; }
-  inline const std::vector<Event *> *events() const { return events_.get(); }
+  inline std::shared_ptr<const MergedEvents> events() const {
+    auto snapshot = std::atomic_load(&snapshot_);
+    return std::shared_ptr<const MergedEvents>(snapshot, &snapshot->events);
+  }
   inline const std::map<int, std::unique_ptr<Segment>> &segments() const { return segments_; }
+  inline const SegmentLoadStats &loadStats() const { return load_stats_; }
   inline const std::string &carFingerprint() const { return car_fingerprint_; }
-  inline const std::vector<std::tuple<double, double, TimelineType>> getTimeline() {
-    std::lock_guard lk(timeline_lock);
-    return timeline;
-  }
+  // per service, only the services that have published or dropped a message
+  std::map<std::string, PublishStats> publishStats() const;
+  // counts of messages by how far they were published from their time on the log timeline,
+  // one per bucket of PUBLISH_JITTER_BUCKETS_US. messages are not paced in full speed mode.
+  std::vector<uint64_t> publishJitter() const;
+  const std::vector<std::tuple<double, double, TimelineType>> getTimeline() const;
 
 signals:
   void streamStarted();
@@ -97,50 +176,82 @@ protected slots:
 
 protected:
   typedef std::map<int, std::unique_ptr<Segment>> SegmentMap;
+  struct PublishCounters {
+    std::atomic<uint64_t> sent = 0;
+    std::atomic<uint64_t> dropped = 0;
+    std::atomic<uint64_t> send_ns = 0;
+    std::atomic<uint64_t> max_send_ns = 0;
+  };
   std::optional<uint64_t> find(FindFlag flag);
   void startStream(const Segment *cur_segment);
   void stream();
   void setCurrentSegment(int n);
   void queueSegment();
+  std::vector<bool> logFilters() const;
+  std::pair<SegmentMap::iterator, SegmentMap::iterator> cacheWindow(SegmentMap::iterator cur);
   void mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::iterator &end);
   void updateEvents(const std::function<bool()>& lambda);
   void publishMessage(const Event *e);
-  void publishFrame(const Event *e);
+  void updatePublishCounters(PublishCounters &counters, uint64_t send_ns);
+  void updatePublishJitter(int64_t jitter_ns);
+  void waitForReaders(const Event *e);
+  void waitForLockstep(const Event *e);
+  void publishFrame(const Event *e, const StreamSnapshot &snapshot);
   void buildTimeline();
   inline bool isSegmentMerged(int n) {
     return std::find(segments_merged_.begin(), segments_merged_.end(), n) != segments_merged_.end();
   }
+  // a seek, pause or stop needs the stream thread to leave its publishing loop
+  inline bool interrupted() const { return exit_ || paused_ || seek_seq_ != stream_seek_seq_; }
 
   QThread *stream_thread_ = nullptr;
   std::mutex stream_lock_;
   std::condition_variable stream_cv_;
-  std::atomic<bool> updating_events_ = false;
   std::atomic<int> current_segment_ = 0;
+  QThreadPool segment_pool_;
   SegmentMap segments_;
-  // the following variables must be protected with stream_lock_
+  SegmentLoadStats load_stats_;
+  // stream_lock_ is only held to change the following and for the stream thread to pick the
+  // changes up. it is never held while publishing.
   std::atomic<bool> exit_ = false;
-  bool paused_ = false;
+  std::atomic<bool> paused_ = false;
   bool events_updated_ = false;
   uint64_t route_start_ts_ = 0;
   std::atomic<uint64_t> cur_mono_time_ = 0;
-  std::unique_ptr<std::vector<Event *>> events_;
-  std::unique_ptr<std::vector<Event *>> new_events_;
+  uint64_t seek_mono_time_ = 0;
+  std::atomic<uint64_t> seek_seq_ = 0;
+  uint64_t stream_seek_seq_ = 0;  // the last seek the stream thread has picked up
+  // swapped with std::atomic_store, the stream thread picks up a new one between two events
+  std::shared_ptr<const StreamSnapshot> snapshot_;
+  std::atomic<uint64_t> snapshot_seq_ = 0;
+  // only used by the main thread
   std::vector<int> segments_merged_;
 
   // messaging
   SubMaster *sm = nullptr;
-  std::unique_ptr<PubMaster> pm;
+  std::unique_ptr<Context> context_;
+  std::vector<std::unique_ptr<PubSocket>> pub_sockets_;
+  std::vector<std::unique_ptr<SubSocket>> lockstep_sockets_;
+  std::vector<bool> lockstep_;
+  std::vector<bool> backpressure_;
+  // updated by the stream thread, indexed by which
+  std::unique_ptr<PublishCounters[]> publish_counters_;
+  std::array<std::atomic<uint64_t>, std::size(PUBLISH_JITTER_BUCKETS_US) + 1> jitter_counts_ = {};
   std::vector<const char*> sockets_;
   std::unique_ptr<Route> route_;
   std::unique_ptr<CameraServer> camera_server_;
   std::atomic<uint32_t> flags_ = REPLAY_FLAG_NONE;
 
-  std::mutex timeline_lock;
   QFuture<void> timeline_future;
-  std::vector<std::tuple<double, double, TimelineType>> timeline;
+  Timeline timeline_;
   std::string car_fingerprint_;
   std::atomic<float> speed_ = 1.0;
   replayEventFilter event_filter = nullptr;
   void *filter_opaque = nullptr;
-  int segment_cache_limit = MIN_SEGMENTS_CACHE;
+  int segment_cache_limit = std::numeric_limits<int>::max();
+  size_t log_memory_budget_ = (size_t)DEFAULT_LOG_MEMORY_MB * 1024 * 1024;
+  size_t video_memory_budget_ = (size_t)DEFAULT_VIDEO_MEMORY_MB * 1024 * 1024;
+  int frame_cache_mb_ = DEFAULT_FRAME_CACHE_MB;
+  int vipc_buffer_count_ = YUV_BUFFER_COUNT;
+  int stream_core_ = -1;
 };
@@ -82,9 +82,9 @@ void Route::addFileToSegment(int n, const QString &file) {
   const int pos = name.lastIndexOf("--");
   name = pos != -1 ? name.mid(pos + 2) : name;
 
-  if (name == "rlog.bz2" || name == "rlog") {
+  if (name == "rlog.bz2" || name == "rlog.zst" || name == "rlog") {
     segments_[n].rlog = file;
-  } else if (name == "qlog.bz2" || name == "qlog") {
+  } else if (name == "qlog.bz2" || name == "qlog.zst" || name == "qlog") {
     segments_[n].qlog = file;
   } else if (name == "fcamera.hevc") {
     segments_[n].road_cam = file;
@@ -99,7 +99,8 @@ void Route::addFileToSegment(int n, const QString &file) {
 
 // class Segment
 
-Segment::Segment(int n, const SegmentFile &files, uint32_t flags) : seg_num(n), flags(flags) {
+Segment::Segment(int n, const SegmentFile &files, uint32_t flags, QThreadPool *pool, const std::vector<bool> &filters)
+    : seg_num(n), flags(flags), filters_(filters) {
   // [RoadCam, DriverCam, WideRoadCam, log]. fallback to qcamera/qlog
   const std::array file_list = {
       (flags & REPLAY_FLAG_QCAMERA) || files.road_cam.isEmpty() ? files.qcamera : files.road_cam,
@@ -110,7 +111,7 @@ Segment::Segment(int n, const SegmentFile &files, uint32_t flags) : seg_num(n),
   for (int i = 0; i < file_list.size(); ++i) {
     if (!file_list[i].isEmpty() && (!(flags & REPLAY_FLAG_NO_VIPC) || i >= MAX_CAMERAS)) {
       ++loading_;
-      synchronizer_.addFuture(QtConcurrent::run(this, &Segment::loadFile, i, file_list[i].toStdString()));
+      synchronizer_.addFuture(QtConcurrent::run(pool, [this, i, file = file_list[i].toStdString()]() { loadFile(i, file); }));
     }
   }
 }
@@ -122,15 +123,32 @@ Segment::~Segment() {
   synchronizer_.waitForFinished();
 }
 
+SegmentMemory Segment::memoryUsage() const {
+  SegmentMemory memory;
+  if (log) memory.log = log->memoryUsage();
+  for (int i = 0; i < MAX_CAMERAS; ++i) {
+    if (frames[i]) memory.video[i] = frames[i]->memoryUsage();
+  }
+  return memory;
+}
+
 void Segment::loadFile(int id, const std::string file) {
   const bool local_cache = !(flags & REPLAY_FLAG_NO_FILE_CACHE);
   bool success = false;
-  if (id < MAX_CAMERAS) {
-    frames[id] = std::make_unique<FrameReader>();
+  if (abort_) {
+    // the segment was dropped from the cache window before a worker picked up this file
+  } else if (id < MAX_CAMERAS) {
+    frames[id] = std::make_shared<FrameReader>();
     success = frames[id]->load(file, flags & REPLAY_FLAG_NO_HW_DECODER, &abort_, local_cache, 20 * 1024 * 1024, 3);
   } else {
-    log = std::make_unique<LogReader>();
+    log = std::make_shared<LogReader>(filters_);
     success = log->load(file, &abort_, local_cache, 0, 3);
+    if (success) {
+      // built from the parsed events, the log is not read again for the timeline
+      timeline = std::make_shared<SegmentTimeline>();
+      timeline->build(log->events);
+      if (local_cache) timeline->saveCached(file);
+    }
   }
 
   if (!success) {
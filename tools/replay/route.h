@@ -2,13 +2,16 @@
 
 #include <map>
 #include <memory>
+#include <numeric>
 #include <string>
 
 #include <QDateTime>
 #include <QFutureSynchronizer>
+#include <QThreadPool>
 
 #include "tools/replay/framereader.h"
 #include "tools/replay/logreader.h"
+#include "tools/replay/timeline.h"
 #include "tools/replay/util.h"
 
 struct RouteIdentifier {
@@ -50,17 +53,28 @@ protected:
   QDateTime date_time_;
 };
 
+struct SegmentMemory {
+  size_t log = 0;
+  size_t video[MAX_CAMERAS] = {};
+  inline size_t videoTotal() const { return std::accumulate(std::begin(video), std::end(video), size_t(0)); }
+};
+
 class Segment : public QObject {
   Q_OBJECT
 
 public:
-  Segment(int n, const SegmentFile &files, uint32_t flags);
+  // filters are passed to the LogReader, see LogReader::LogReader()
+  Segment(int n, const SegmentFile &files, uint32_t flags, QThreadPool *pool = QThreadPool::globalInstance(),
+          const std::vector<bool> &filters = {});
   ~Segment();
   inline bool isLoaded() const { return !loading_ && !abort_; }
+  // only valid once the segment is loaded
+  SegmentMemory memoryUsage() const;
 
   const int seg_num = 0;
-  std::unique_ptr<LogReader> log;
-  std::unique_ptr<FrameReader> frames[MAX_CAMERAS] = {};
+  std::shared_ptr<LogReader> log;
+  std::shared_ptr<SegmentTimeline> timeline;
+  std::shared_ptr<FrameReader> frames[MAX_CAMERAS] = {};
 
 signals:
   void loadFinished(bool success);
@@ -70,6 +84,7 @@ protected:
 
   std::atomic<bool> abort_ = false;
   std::atomic<int> loading_ = 0;
+  const std::vector<bool> filters_;
   QFutureSynchronizer<void> synchronizer_;
   uint32_t flags;
 };
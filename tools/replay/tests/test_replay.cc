@@ -1,11 +1,22 @@
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+
 #include <chrono>
+#include <cstdio>
+#include <limits>
+#include <map>
 #include <thread>
 
+#include <zstd.h>
+
 #include <QDebug>
 #include <QEventLoop>
 
 #include "catch2/catch.hpp"
 #include "common/util.h"
+#include "tools/replay/exporter.h"
+#include "tools/replay/filecache.h"
 #include "tools/replay/replay.h"
 #include "tools/replay/util.h"
 
@@ -43,6 +54,131 @@ TEST_CASE("httpMultiPartDownload") {
   REQUIRE(sha256(content) == TEST_RLOG_CHECKSUM);
 }
 
+// HTTP/1.1 stand-in server on localhost, with keep-alive and optional range support
+class TestHttpServer {
+public:
+  TestHttpServer(const std::string &content) : content_(content) {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    bind(listen_fd_, (struct sockaddr *)&addr, len);
+    listen(listen_fd_, 16);
+    getsockname(listen_fd_, (struct sockaddr *)&addr, &len);
+    url = "http://127.0.0.1:" + std::to_string(ntohs(addr.sin_port)) + "/file";
+    thread_ = std::thread(&TestHttpServer::run, this);
+  }
+
+  ~TestHttpServer() {
+    exit_ = true;
+    thread_.join();
+    close(listen_fd_);
+  }
+
+  std::string url;
+  std::atomic<bool> ranges = true;
+  std::atomic<int> connections = 0;
+  std::atomic<int> requests = 0;
+
+private:
+  bool readable(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    return poll(&pfd, 1, 100) > 0;
+  }
+
+  void run() {
+    std::vector<std::thread> threads;
+    while (!exit_) {
+      if (!readable(listen_fd_)) continue;
+
+      int fd = accept(listen_fd_, nullptr, nullptr);
+      if (fd == -1) continue;
+      ++connections;
+      threads.emplace_back(&TestHttpServer::serve, this, fd);
+    }
+    for (auto &t : threads) t.join();
+  }
+
+  void serve(int fd) {
+    std::string request;
+    char buf[4096];
+    while (!exit_) {
+      size_t end = request.find("\r\n\r\n");
+      if (end == std::string::npos) {
+        if (!readable(fd)) continue;
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) break;
+        request.append(buf, n);
+        continue;
+      }
+
+      const std::string headers = request.substr(0, end);
+      request.erase(0, end + 4);
+      ++requests;
+      size_t begin = 0, last = content_.size() - 1;
+      std::string response = "HTTP/1.1 200 OK\r\n";
+      if (size_t pos = headers.find("Range: bytes="); pos != std::string::npos && ranges) {
+        sscanf(headers.c_str() + pos, "Range: bytes=%zu-%zu", &begin, &last);
+        last = std::min(last, content_.size() - 1);
+        response = util::string_format("HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %zu-%zu/%zu\r\n", begin, last, content_.size());
+      }
+      response += "Content-Length: " + std::to_string(last - begin + 1) + "\r\n\r\n" + content_.substr(begin, last - begin + 1);
+      for (size_t sent = 0; sent < response.size();) {
+        ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        sent += n;
+      }
+    }
+    close(fd);
+  }
+
+  const std::string content_;
+  int listen_fd_ = -1;
+  std::atomic<bool> exit_ = false;
+  std::thread thread_;
+};
+
+TEST_CASE("httpStream") {
+  std::string content(5 * 1024 * 1024 + 123, '\0');
+  for (size_t i = 0; i < content.size(); ++i) {
+    content[i] = i * 7 % 251;
+  }
+  TestHttpServer server(content);
+  const size_t chunk_size = 256 * 1024;
+  std::string result;
+  int chunks = 0;
+  auto handler = [&](const char *data, size_t size) {
+    result.append(data, size);
+    ++chunks;
+    return true;
+  };
+
+  SECTION("ranges") {
+    REQUIRE(httpStream(server.url, handler, chunk_size));
+    REQUIRE(result == content);
+    // the handler gets the content while it downloads
+    REQUIRE(chunks > 1);
+    // later ranges and downloads reuse the connections
+    REQUIRE(server.connections < server.requests);
+    const int connections = server.connections, requests = server.requests;
+    REQUIRE(httpGet(server.url, chunk_size) == content);
+    REQUIRE(server.connections - connections < server.requests - requests);
+  }
+  SECTION("resume at an offset") {
+    REQUIRE(httpStream(server.url, handler, chunk_size, 1000));
+    REQUIRE(result == content.substr(1000));
+  }
+  SECTION("server without range support") {
+    server.ranges = false;
+    REQUIRE(httpStream(server.url, handler, chunk_size, 1000));
+    REQUIRE(result == content.substr(1000));
+    REQUIRE(server.requests == 1);
+  }
+  SECTION("handler stops the download") {
+    REQUIRE(httpStream(server.url, [](const char *, size_t) { return false; }, chunk_size) == false);
+  }
+}
+
 TEST_CASE("FileReader") {
   auto enable_local_cache = GENERATE(true, false);
   std::string cache_file = cacheFilePath(TEST_RLOG_URL);
@@ -58,6 +194,72 @@ TEST_CASE("FileReader") {
   }
 }
 
+TEST_CASE("FileCache") {
+  // a cache of its own, the shared one is the download cache of the machine
+  char tmp_path[] = "/tmp/test_file_cache_XXXXXX";
+  const std::string cache_dir = mkdtemp(tmp_path);
+  FileCache cache(cache_dir);
+  const std::string url = "https://example.com/test_file_cache";
+  std::string content;
+  for (int i = 0; content.size() < 3 * CACHE_FRAME_SIZE + 100; ++i) {
+    content += "line " + std::to_string(i) + "\n";
+  }
+
+  REQUIRE(cache.put(url, content));
+  // compressible content is stored compressed and can't be mapped
+  REQUIRE(cache.rawFile(url).empty());
+  REQUIRE(util::read_file(cache.filePath(url)).size() < content.size());
+
+  std::string result;
+  REQUIRE(cache.get(url, result));
+  REQUIRE(result == content);
+  for (auto [offset, size] : {std::pair{0ul, 10ul}, {CACHE_FRAME_SIZE - 5, 10ul}, {CACHE_FRAME_SIZE * 2 + 7, CACHE_FRAME_SIZE + 50}}) {
+    REQUIRE(cache.get(url, offset, size, result));
+    REQUIRE(result == content.substr(offset, size));
+  }
+
+  SECTION("corrupt entry") {
+    std::string data = util::read_file(cache.filePath(url));
+    data[data.size() / 2] ^= 0xff;
+    REQUIRE(util::write_file(cache.filePath(url).c_str(), data.data(), data.size(), O_WRONLY | O_TRUNC) == 0);
+    REQUIRE(cache.get(url, result) == false);
+    REQUIRE(util::file_exists(cache.filePath(url)) == false);
+  }
+  SECTION("eviction") {
+    const std::string url2 = url + "2";
+    cache.setBudget(util::read_file(cache.filePath(url)).size() + 1);
+    REQUIRE(cache.put(url2, content));
+    REQUIRE(util::file_exists(cache.filePath(url)) == false);
+    REQUIRE(cache.get(url2, result));
+  }
+  SECTION("access times") {
+    // lookups don't rewrite the manifest, the access times are written with the next change
+    const std::string manifest = util::read_file(cache_dir + "/manifest");
+    REQUIRE(cache.get(url, result));
+    REQUIRE(util::read_file(cache_dir + "/manifest") == manifest);
+    REQUIRE(cache.put(url + "2", "x"));
+    REQUIRE(util::read_file(cache_dir + "/manifest") != manifest);
+  }
+  SECTION("files of a cache without manifest") {
+    char old_path[] = "/tmp/test_file_cache_XXXXXX";
+    const std::string old_dir = mkdtemp(old_path);
+    FileCache old_cache(old_dir);
+    REQUIRE(util::write_file(old_cache.filePath(url).c_str(), content.data(), content.size(), O_WRONLY | O_CREAT) == 0);
+    REQUIRE(util::write_file((old_dir + "/stray").c_str(), "x", 1, O_WRONLY | O_CREAT) == 0);
+    // adopted when the manifest is created, and evicted as the other entries
+    old_cache.setBudget(content.size() + 1);
+    REQUIRE(old_cache.put(url + "2", "x"));
+    REQUIRE(util::file_exists(old_dir + "/stray") == false);
+    REQUIRE(old_cache.get(url, result));
+    REQUIRE(result == content);
+    old_cache.setBudget(2);
+    REQUIRE(old_cache.put(url + "3", "x"));
+    REQUIRE(util::file_exists(old_cache.filePath(url)) == false);
+    system(("rm " + old_dir + " -rf").c_str());
+  }
+  system(("rm " + cache_dir + " -rf").c_str());
+}
+
 TEST_CASE("LogReader") {
   SECTION("corrupt log") {
     FileReader reader(true);
@@ -68,6 +270,169 @@ TEST_CASE("LogReader") {
     REQUIRE(log.load((std::byte *)corrupt_content.data(), corrupt_content.size()));
     REQUIRE(log.events.size() > 0);
   }
+  SECTION("zstd log") {
+    FileReader reader(true);
+    std::string content = decompressBZ2(reader.read(TEST_RLOG_URL));
+    std::string compressed(ZSTD_compressBound(content.size()), '\0');
+    compressed.resize(ZSTD_compress(compressed.data(), compressed.size(), content.data(), content.size(), 1));
+    REQUIRE(decompressZST(compressed) == content);
+
+    char filename[] = "/tmp/XXXXXX";
+    close(mkstemp(filename));
+    const std::string zst_file = std::string(filename) + "--rlog.zst";
+    REQUIRE(util::write_file(zst_file.c_str(), compressed.data(), compressed.size(), O_WRONLY | O_CREAT) == 0);
+
+    LogReader log, zst_log;
+    REQUIRE(log.load((std::byte *)content.data(), content.size()));
+    REQUIRE(zst_log.load(zst_file));
+    REQUIRE(zst_log.events.size() == log.events.size());
+    for (int i = 0; i < log.events.size(); ++i) {
+      REQUIRE(zst_log.events[i].mono_time == log.events[i].mono_time);
+      REQUIRE(zst_log.events[i].which == log.events[i].which);
+    }
+    unlink(zst_file.c_str());
+    unlink(filename);
+  }
+  SECTION("parallel decompression") {
+    FileReader reader(true);
+    const std::string compressed = reader.read(TEST_RLOG_URL);
+    std::string content;
+    StreamDecompressor decompressor(StreamDecompressor::BZ2, [&](const char *data, size_t size) {
+      content.append(data, size);
+      return true;
+    });
+    REQUIRE(decompressor.push(compressed.data(), compressed.size()));
+    REQUIRE(decompressor.finish());
+    REQUIRE(decompressBZ2(compressed) == content);
+
+    // a zstd log of several frames
+    std::string zst_frames;
+    for (size_t pos = 0; pos < content.size(); pos += content.size() / 4 + 1) {
+      const size_t size = std::min(content.size() - pos, content.size() / 4 + 1);
+      std::string frame(ZSTD_compressBound(size), '\0');
+      frame.resize(ZSTD_compress(frame.data(), frame.size(), content.data() + pos, size, 1));
+      zst_frames += frame;
+    }
+    REQUIRE(decompressZST(zst_frames) == content);
+  }
+  SECTION("filters") {
+    FileReader reader(true);
+    std::string content = decompressBZ2(reader.read(TEST_RLOG_URL));
+    std::vector<bool> filters(capnp::Schema::from<cereal::Event>().asStruct().getUnionFields().size(), false);
+    filters[cereal::Event::Which::CAN] = filters[cereal::Event::Which::CAR_STATE] = true;
+
+    LogReader log, filtered_log(filters);
+    REQUIRE(log.load((std::byte *)content.data(), content.size()));
+    REQUIRE(filtered_log.load((std::byte *)content.data(), content.size()));
+    std::vector<Event> expected;
+    std::copy_if(log.events.begin(), log.events.end(), std::back_inserter(expected), [&](auto &e) { return filters[e.which]; });
+    REQUIRE(expected.size() > 0);
+    REQUIRE(filtered_log.events.size() == expected.size());
+    for (int i = 0; i < expected.size(); ++i) {
+      REQUIRE(filtered_log.events[i].mono_time == expected[i].mono_time);
+      REQUIRE(filtered_log.events[i].which == expected[i].which);
+    }
+  }
+}
+
+TEST_CASE("MergedEvents") {
+  // segments overlap at their boundaries
+  std::vector<std::vector<Event>> segments(3);
+  for (int i = 0; i < 300; ++i) {
+    segments[i % 3].emplace_back(cereal::Event::Which::CAN, i / 3 * 10 + i % 3 * 300);
+  }
+  MergedEvents merged;
+  for (int n = 0; n < segments.size(); ++n) {
+    merged.insert(n, std::make_shared<std::vector<Event>>(segments[n]));
+  }
+  REQUIRE(merged.size() == 300);
+  REQUIRE(merged.back()->mono_time == 99 * 10 + 2 * 300);
+
+  auto check_sorted = [](MergedEvents::Cursor it) {
+    size_t count = 0;
+    for (const Event *prev = nullptr; !it.end(); ++it, ++count) {
+      REQUIRE((!prev || !(*it < *prev)));
+      prev = &(*it);
+    }
+    return count;
+  };
+  REQUIRE(check_sorted(merged.begin()) == 300);
+  REQUIRE(check_sorted(merged.upperBound(Event(cereal::Event::Which::CAN, 500))) == 228);
+
+  merged.erase(1);
+  REQUIRE(merged.size() == 200);
+  REQUIRE(!merged.contains(1));
+  REQUIRE(check_sorted(merged.begin()) == 200);
+}
+
+TEST_CASE("Timeline") {
+  const uint64_t s = 1e9;
+  std::vector<kj::Array<capnp::word>> messages;
+  auto event = [&](cereal::Event::Which which, uint64_t mono_time, bool enabled = false) {
+    MessageBuilder msg;
+    auto evt = msg.initEvent();
+    evt.setLogMonoTime(mono_time);
+    if (which == cereal::Event::Which::CONTROLS_STATE) {
+      evt.initControlsState().setEnabled(enabled);
+    } else {
+      evt.initUserFlag();
+    }
+    messages.push_back(capnp::messageToFlatArray(msg));
+    return Event(which, mono_time, messages.back().asPtr());
+  };
+
+  // engaged across the boundary of two segments, with a user flag in the first one
+  SegmentTimeline seg0, seg1;
+  seg0.build({event(cereal::Event::Which::CONTROLS_STATE, 1 * s, false),
+              event(cereal::Event::Which::CONTROLS_STATE, 2 * s, true),
+              event(cereal::Event::Which::USER_FLAG, 2.5 * s),
+              event(cereal::Event::Which::CONTROLS_STATE, 3 * s, true)});
+  seg1.build({event(cereal::Event::Which::CONTROLS_STATE, 61 * s, true),
+              event(cereal::Event::Which::CONTROLS_STATE, 62 * s, false)});
+  REQUIRE(seg0.entries.size() == 2);
+  REQUIRE(seg0.entries[0].type == TimelineType::Engaged);
+  REQUIRE((!seg0.entries[0].open_begin && seg0.entries[0].open_end));
+  REQUIRE(seg1.entries.size() == 1);
+  REQUIRE((seg1.entries[0].open_begin && !seg1.entries[0].open_end));
+
+  SECTION("save and load") {
+    char filename[] = "/tmp/XXXXXX";
+    close(mkstemp(filename));
+    REQUIRE(seg0.save(filename));
+    SegmentTimeline loaded;
+    REQUIRE(loaded.load(filename));
+    REQUIRE(loaded.entries.size() == seg0.entries.size());
+    REQUIRE(loaded.entries[1].begin == 2.5 * s);
+    REQUIRE(loaded.index == seg0.index);
+
+    // the timeline of a local log is a cache entry of its own, keyed by the state of the log
+    const std::string url = SegmentTimeline::cacheUrl(filename);
+    REQUIRE(!url.empty());
+    REQUIRE(seg0.saveCached(filename));
+    SegmentTimeline cached;
+    REQUIRE(cached.loadCached(filename));
+    REQUIRE(cached.entries.size() == seg0.entries.size());
+    REQUIRE(util::write_file(filename, "changed", 7, O_WRONLY | O_TRUNC) == 0);
+    REQUIRE(SegmentTimeline::cacheUrl(filename) != url);
+    REQUIRE(!cached.loadCached(filename));
+    FileCache::instance().remove(url);
+    unlink(filename);
+  }
+  SECTION("merge segments") {
+    Timeline timeline;
+    timeline.insert(1, std::make_shared<SegmentTimeline>(seg1));
+    // the range continued from a missing segment is not an engagement
+    REQUIRE(!timeline.next(TimelineType::Engaged, 0));
+    timeline.insert(0, std::make_shared<SegmentTimeline>(seg0));
+    auto entries = timeline.entries();
+    REQUIRE(entries.size() == 2);
+    REQUIRE((entries[0].begin == 2 * s && entries[0].end == 62 * s));
+    REQUIRE(timeline.next(TimelineType::Engaged, 0)->begin == 2 * s);
+    REQUIRE(timeline.next(TimelineType::Engaged, 2 * s, true)->end == 62 * s);
+    REQUIRE(!timeline.next(TimelineType::Engaged, 2 * s));
+    REQUIRE(timeline.nextEvent(cereal::Event::Which::USER_FLAG, 0) == 2.5 * s);
+    REQUIRE(!timeline.nextEvent(cereal::Event::Which::USER_FLAG, 2.5 * s));
+  }
 }
 
 void read_segment(int n, const SegmentFile &segment_file, uint32_t flags) {
@@ -86,7 +451,7 @@ void read_segment(int n, const SegmentFile &segment_file, uint32_t flags) {
 
     // test LogReader & FrameReader
     REQUIRE(segment.log->events.size() > 0);
-    REQUIRE(std::is_sorted(segment.log->events.begin(), segment.log->events.end(), Event::lessThan()));
+    REQUIRE(std::is_sorted(segment.log->events.begin(), segment.log->events.end()));
 
     for (auto cam : ALL_CAMERAS) {
       auto &fr = segment.frames[cam];
@@ -148,6 +513,151 @@ TEST_CASE("Local route") {
   }
 }
 
+TEST_CASE("FrameReader index") {
+  // the index is stored next to the cache entry of a remote video
+  Route route(DEMO_ROUTE);
+  REQUIRE(route.load());
+  const std::string video_file = route.at(0).wide_road_cam.toStdString();
+  const std::string index_file = FileCache::instance().filePath(video_file) + FRAME_INDEX_SUFFIX;
+  system(("rm " + index_file + " -f").c_str());
+
+  // the first load builds the index, the second one maps it
+  FrameReader fr_build, fr_index;
+  REQUIRE(fr_build.load(video_file, true, nullptr, true));
+  REQUIRE(util::file_exists(index_file));
+  REQUIRE(fr_index.load(video_file, true, nullptr, true));
+  REQUIRE(fr_index.getFrameCount() == fr_build.getFrameCount());
+  REQUIRE(fr_index.width == fr_build.width);
+  REQUIRE(fr_index.height == fr_build.height);
+
+  auto [nv12_width, nv12_height, nv12_buffer_size] = get_nv12_info(fr_build.width, fr_build.height);
+  VisionBuf buf1, buf2;
+  for (auto buf : {&buf1, &buf2}) {
+    buf->allocate(nv12_buffer_size);
+    buf->init_yuv(fr_build.width, fr_build.height, nv12_width, nv12_width * nv12_height);
+  }
+  // seek straight into a GOP
+  for (int i : {500, 3, 1199}) {
+    REQUIRE(fr_build.get(i, &buf1));
+    REQUIRE(fr_index.get(i, &buf2));
+    REQUIRE(memcmp(buf1.addr, buf2.addr, nv12_buffer_size) == 0);
+  }
+
+  // GOPs decoded in parallel into the cache match sequential decoding
+  fr_index.setCache(std::make_shared<FrameCache>(512 * 1024 * 1024));
+  for (int i = 0; i < 100;) {
+    i = fr_index.prefetch(i, 99);
+  }
+  for (int i : {0, 42, 99}) {
+    REQUIRE(fr_build.get(i, &buf1));
+    REQUIRE(fr_index.get(i, &buf2));
+    REQUIRE(memcmp(buf1.addr, buf2.addr, nv12_buffer_size) == 0);
+  }
+
+  // a range past the last frame is done, the look-ahead loop ends at the end of the video
+  const int frame_count = fr_index.getFrameCount();
+  REQUIRE(fr_index.prefetch(frame_count - 2, frame_count + 10) > frame_count - 2);
+  REQUIRE(fr_index.prefetch(frame_count, frame_count + 10) == frame_count + 11);
+  int prefetched = frame_count - 5;
+  for (int n = 0; n < 10 && prefetched <= frame_count + 10; ++n) {
+    prefetched = fr_index.prefetch(prefetched, frame_count + 10);
+  }
+  REQUIRE(prefetched > frame_count + 10);
+  buf1.free();
+  buf2.free();
+
+  // a local file has no cache entry, no index is written for it
+  const std::string data_dir = download_demo_route();
+  const std::string local_file = util::string_format("%s/%s--0/ecamera.hevc", data_dir.c_str(), DEMO_ROUTE.mid(17).toStdString().c_str());
+  FrameReader fr_local;
+  REQUIRE(fr_local.load(local_file, true, nullptr, true));
+  REQUIRE(util::file_exists(FileCache::instance().filePath(local_file) + FRAME_INDEX_SUFFIX) == false);
+}
+
+TEST_CASE("RouteExporter") {
+  const std::string data_dir = download_demo_route();
+  Route route(DEMO_ROUTE, QString::fromStdString(data_dir));
+  REQUIRE(route.load());
+  char tmp_path[] = "/tmp/test_export_XXXXXX";
+  const std::string output_dir = mkdtemp(tmp_path);
+  const std::string segment_dir = output_dir + "/" + route.identifier().timestamp.toStdString() + "--0/";
+  const std::string video_file = route.at(0).wide_road_cam.toStdString();
+
+  auto encode_ids = [](const LogReader &log, uint64_t begin_ts, uint64_t end_ts) {
+    std::map<uint32_t, int> ids;  // frame id -> index in the video
+    for (const Event &e : log.events) {
+      if (e.which != cereal::Event::Which::WIDE_ROAD_ENCODE_IDX || e.frame || e.mono_time < begin_ts || e.mono_time >= end_ts) continue;
+      capnp::FlatArrayMessageReader reader(e.data);
+      auto idx = reader.getRoot<cereal::Event>().getWideRoadEncodeIdx();
+      ids[idx.getFrameId()] = idx.getSegmentId();
+    }
+    return ids;
+  };
+
+  LogReader log;
+  REQUIRE(log.load(route.at(0).rlog.toStdString()));
+  const uint64_t begin_ts = log.events.front().mono_time + 20 * 1e9;
+  const uint64_t end_ts = log.events.front().mono_time + 30 * 1e9;
+
+  SECTION("range") {
+    ExportOptions options = {.output_dir = output_dir, .start_seconds = 20, .end_seconds = 30, .segments = {0},
+                             .flags = REPLAY_FLAG_ECAM | REPLAY_FLAG_NO_FILE_CACHE};
+    REQUIRE(RouteExporter(route, options).run() == 1);
+    Route exported(DEMO_ROUTE, QString::fromStdString(output_dir));
+    REQUIRE(exported.load());
+    REQUIRE(exported.segments().size() == 1);
+    REQUIRE(exported.at(0).rlog.toStdString() == segment_dir + "rlog.zst");
+
+    // the events of the range, and the ones a route needs to load
+    LogReader exported_log;
+    REQUIRE(exported_log.load(exported.at(0).rlog.toStdString()));
+    for (const Event &e : exported_log.events) {
+      if (e.which == cereal::Event::Which::INIT_DATA || e.which == cereal::Event::Which::CAR_PARAMS) continue;
+      REQUIRE(e.mono_time >= begin_ts);
+      REQUIRE(e.mono_time < end_ts);
+    }
+
+    // the frames are indexed from the key frame the video starts with
+    auto ids = encode_ids(log, begin_ts, end_ts);
+    auto exported_ids = encode_ids(exported_log, 0, std::numeric_limits<uint64_t>::max());
+    REQUIRE(!ids.empty());
+    REQUIRE(exported_ids.size() == ids.size());
+    const int key_frame = ids.begin()->second - exported_ids.begin()->second;
+    REQUIRE(key_frame >= 0);
+    for (auto [frame_id, index] : ids) {
+      REQUIRE(exported_ids.at(frame_id) == index - key_frame);
+    }
+
+    // the first frame of the range decodes as in the source
+    FrameReader fr, exported_fr;
+    REQUIRE(fr.load(video_file));
+    REQUIRE(exported_fr.load(exported.at(0).wide_road_cam.toStdString()));
+    REQUIRE(exported_fr.getFrameCount() == exported_ids.rbegin()->second + 1);
+    auto [nv12_width, nv12_height, nv12_buffer_size] = get_nv12_info(fr.width, fr.height);
+    VisionBuf buf1, buf2;
+    for (auto buf : {&buf1, &buf2}) {
+      buf->allocate(nv12_buffer_size);
+      buf->init_yuv(fr.width, fr.height, nv12_width, nv12_width * nv12_height);
+    }
+    REQUIRE(fr.get(ids.begin()->second, &buf1));
+    REQUIRE(exported_fr.get(exported_ids.begin()->second, &buf2));
+    REQUIRE(memcmp(buf1.addr, buf2.addr, nv12_buffer_size) == 0);
+    buf1.free();
+    buf2.free();
+  }
+  SECTION("range without frames") {
+    // every exported camera still has a video, with the GOP at the start of the range
+    ExportOptions options = {.output_dir = output_dir, .start_seconds = 20, .end_seconds = 20, .segments = {0},
+                             .flags = REPLAY_FLAG_ECAM | REPLAY_FLAG_NO_FILE_CACHE};
+    REQUIRE(RouteExporter(route, options).run() == 1);
+    FrameReader exported_fr;
+    REQUIRE(exported_fr.load(segment_dir + "ecamera.hevc"));
+    REQUIRE(exported_fr.getFrameCount() > 0);
+    REQUIRE(util::file_exists(segment_dir + "qcamera.ts"));
+  }
+  system(("rm " + output_dir + " -rf").c_str());
+}
+
 TEST_CASE("Remote route") {
   auto flags = GENERATE(REPLAY_FLAG_DCAM | REPLAY_FLAG_ECAM, REPLAY_FLAG_QCAMERA);
   Route route(DEMO_ROUTE);
@@ -178,16 +688,21 @@ void TestReplay::testSeekTo(int seek_to) {
       continue;
     }
 
-    Event cur_event(cereal::Event::Which::INIT_DATA, cur_mono_time_);
-    auto eit = std::upper_bound(events_->begin(), events_->end(), &cur_event, Event::lessThan());
-    if (eit == events_->end()) {
+    auto snapshot = std::atomic_load(&snapshot_);
+    Event cur_event(cereal::Event::Which::INIT_DATA, seek_mono_time_);
+    auto eit = snapshot->events.upperBound(cur_event);
+    if (eit.end()) {
       qDebug() << "waiting for events...";
       continue;
     }
 
-    REQUIRE(std::is_sorted(events_->begin(), events_->end(), Event::lessThan()));
+    const Event *prev = nullptr;
+    for (auto it = snapshot->events.begin(); !it.end(); ++it) {
+      REQUIRE((!prev || !(*it < *prev)));
+      prev = &(*it);
+    }
     const int seek_to_segment = seek_to / 60;
-    const int event_seconds = ((*eit)->mono_time - route_start_ts_) / 1e9;
+    const int event_seconds = (eit->mono_time - route_start_ts_) / 1e9;
     current_segment_ = event_seconds / 60;
     INFO("seek to [" << seek_to << "s segment " << seek_to_segment << "], events [" << event_seconds << "s segment" << current_segment_ << "]");
     REQUIRE(event_seconds >= seek_to);
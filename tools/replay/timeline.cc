@@ -0,0 +1,295 @@
+#include "tools/replay/timeline.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <tuple>
+
+#include "common/util.h"
+#include "tools/replay/filecache.h"
+#include "tools/replay/util.h"
+
+namespace {
+
+struct TimelineFileHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t entry_count;
+  uint32_t service_count;
+  // followed by entry_count TimelineFileEntry, then for each service a
+  // TimelineFileService and its count mono times
+};
+
+struct TimelineFileEntry {
+  uint64_t begin;
+  uint64_t end;
+  uint32_t type;
+  uint8_t open_begin;
+  uint8_t open_end;
+  uint16_t reserved;
+};
+
+struct TimelineFileService {
+  uint32_t which;
+  uint32_t count;
+};
+
+bool entryLess(const SegmentTimeline::Entry &l, const SegmentTimeline::Entry &r) {
+  return std::tie(l.type, l.begin) < std::tie(r.type, r.begin);
+}
+
+}  // namespace
+
+void SegmentTimeline::build(const std::vector<Event> &events) {
+  const TimelineType timeline_types[] = {
+    [(int)cereal::ControlsState::AlertStatus::NORMAL] = TimelineType::AlertInfo,
+    [(int)cereal::ControlsState::AlertStatus::USER_PROMPT] = TimelineType::AlertWarning,
+    [(int)cereal::ControlsState::AlertStatus::CRITICAL] = TimelineType::AlertCritical,
+  };
+
+  bool engaged = false, engaged_open = false;
+  uint64_t engaged_begin = 0, last_mono_time = 0;
+  auto alert_status = cereal::ControlsState::AlertStatus::NORMAL;
+  auto alert_size = cereal::ControlsState::AlertSize::NONE;
+  uint64_t alert_begin = 0;
+  bool alert_open = false;
+  std::string alert_type;
+
+  entries.clear();
+  index.clear();
+  for (const Event &e : events) {
+    if (e.frame) continue;
+
+    if (e.which == cereal::Event::Which::CONTROLS_STATE) {
+      capnp::FlatArrayMessageReader reader(e.data);
+      auto cs = reader.getRoot<cereal::Event>().getControlsState();
+
+      if (last_mono_time == 0) {
+        // the state at the start of the segment continues from the previous one
+        engaged = engaged_open = cs.getEnabled();
+        engaged_begin = alert_begin = e.mono_time;
+        alert_open = true;
+        alert_type = cs.getAlertType().cStr();
+        alert_size = cs.getAlertSize();
+        alert_status = cs.getAlertStatus();
+      }
+
+      if (engaged != cs.getEnabled()) {
+        if (engaged) {
+          entries.push_back({engaged_begin, e.mono_time, TimelineType::Engaged, engaged_open, false});
+        }
+        engaged_begin = e.mono_time;
+        engaged = cs.getEnabled();
+        engaged_open = false;
+      }
+
+      if (alert_type != cs.getAlertType().cStr() || alert_status != cs.getAlertStatus()) {
+        if (!alert_type.empty() && alert_size != cereal::ControlsState::AlertSize::NONE) {
+          entries.push_back({alert_begin, e.mono_time, timeline_types[(int)alert_status], alert_open, false});
+        }
+        alert_begin = e.mono_time;
+        alert_open = false;
+        alert_type = cs.getAlertType().cStr();
+        alert_size = cs.getAlertSize();
+        alert_status = cs.getAlertStatus();
+      }
+      last_mono_time = e.mono_time;
+    } else if (e.which == cereal::Event::Which::USER_FLAG) {
+      entries.push_back({e.mono_time, e.mono_time, TimelineType::UserFlag, false, false});
+    }
+
+    if (std::find(std::begin(TIMELINE_INDEXED_SERVICES), std::end(TIMELINE_INDEXED_SERVICES), e.which) != std::end(TIMELINE_INDEXED_SERVICES)) {
+      index[e.which].push_back(e.mono_time);
+    }
+  }
+
+  // the ranges still open at the end of the log continue in the next segment
+  if (engaged) {
+    entries.push_back({engaged_begin, last_mono_time, TimelineType::Engaged, engaged_open, true});
+  }
+  if (!alert_type.empty() && alert_size != cereal::ControlsState::AlertSize::NONE) {
+    entries.push_back({alert_begin, last_mono_time, timeline_types[(int)alert_status], alert_open, true});
+  }
+  std::sort(entries.begin(), entries.end(), entryLess);
+}
+
+std::string SegmentTimeline::cacheUrl(const std::string &log_file) {
+  struct stat st = {};
+  if (stat(log_file.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return {};
+
+  return util::string_format("timeline:%s:%lld:%lld.%09ld", log_file.c_str(), (long long)st.st_size,
+                             (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+}
+
+bool SegmentTimeline::loadCached(const std::string &log_url) {
+  auto &cache = FileCache::instance();
+  std::string file, hash, content;
+  if (cache.sidecar(log_url, TIMELINE_SUFFIX, file, hash)) {
+    return load(file);
+  }
+  const std::string url = cacheUrl(log_url);
+  return !url.empty() && cache.get(url, content) && parse(content, url);
+}
+
+bool SegmentTimeline::saveCached(const std::string &log_url) const {
+  auto &cache = FileCache::instance();
+  std::string file, hash;
+  if (cache.sidecar(log_url, TIMELINE_SUFFIX, file, hash)) {
+    return save(file);
+  }
+  const std::string url = cacheUrl(log_url);
+  return !url.empty() && cache.put(url, serialize());
+}
+
+bool SegmentTimeline::load(const std::string &file) {
+  return parse(util::read_file(file), file);
+}
+
+bool SegmentTimeline::parse(const std::string &content, const std::string &name) {
+  if (content.size() < sizeof(TimelineFileHeader)) return false;
+
+  TimelineFileHeader header;
+  memcpy(&header, content.data(), sizeof(header));
+  if (memcmp(header.magic, "TLNE", 4) != 0 || header.version != TIMELINE_VERSION) {
+    rWarning("ignoring outdated timeline %s", name.c_str());
+    return false;
+  }
+
+  size_t pos = sizeof(header);
+  auto read = [&](void *dst, size_t size) {
+    if (content.size() - pos < size) return false;
+    memcpy(dst, content.data() + pos, size);
+    pos += size;
+    return true;
+  };
+
+  std::vector<Entry> loaded_entries;
+  for (uint32_t i = 0; i < header.entry_count; ++i) {
+    TimelineFileEntry entry;
+    if (!read(&entry, sizeof(entry)) || entry.type > (uint32_t)TimelineType::UserFlag) return false;
+    loaded_entries.push_back({entry.begin, entry.end, (TimelineType)entry.type, entry.open_begin != 0, entry.open_end != 0});
+  }
+  std::map<cereal::Event::Which, std::vector<uint64_t>> loaded_index;
+  for (uint32_t i = 0; i < header.service_count; ++i) {
+    TimelineFileService service;
+    if (!read(&service, sizeof(service)) || service.count > content.size() / sizeof(uint64_t)) return false;
+
+    auto &times = loaded_index[(cereal::Event::Which)service.which];
+    times.resize(service.count);
+    if (!read(times.data(), service.count * sizeof(uint64_t))) return false;
+  }
+  if (pos != content.size()) return false;
+
+  entries = std::move(loaded_entries);
+  index = std::move(loaded_index);
+  return true;
+}
+
+std::string SegmentTimeline::serialize() const {
+  TimelineFileHeader header = {
+    .version = TIMELINE_VERSION,
+    .entry_count = (uint32_t)entries.size(),
+    .service_count = (uint32_t)index.size(),
+  };
+  memcpy(header.magic, "TLNE", 4);
+
+  std::string content((const char *)&header, sizeof(header));
+  for (const auto &e : entries) {
+    TimelineFileEntry entry = {.begin = e.begin, .end = e.end, .type = (uint32_t)e.type,
+                               .open_begin = e.open_begin, .open_end = e.open_end};
+    content.append((const char *)&entry, sizeof(entry));
+  }
+  for (const auto &[which, times] : index) {
+    TimelineFileService service = {.which = (uint32_t)which, .count = (uint32_t)times.size()};
+    content.append((const char *)&service, sizeof(service));
+    content.append((const char *)times.data(), times.size() * sizeof(uint64_t));
+  }
+  return content;
+}
+
+bool SegmentTimeline::save(const std::string &file) const {
+  const std::string content = serialize();
+  // write to a temporary file first, a reader never sees a partial timeline
+  const std::string tmp_file = file + ".tmp" + std::to_string(getpid());
+  if (util::write_file(tmp_file.c_str(), content.data(), content.size(), O_WRONLY | O_CREAT | O_TRUNC) != 0 ||
+      ::rename(tmp_file.c_str(), file.c_str()) != 0) {
+    rWarning("failed to write timeline %s", file.c_str());
+    ::unlink(tmp_file.c_str());
+    return false;
+  }
+  return true;
+}
+
+// class Timeline
+
+void Timeline::insert(int seg, std::shared_ptr<const SegmentTimeline> timeline, bool replace) {
+  std::lock_guard lk(lock_);
+  if (!replace && segments_.count(seg)) return;
+
+  segments_[seg] = timeline;
+  merge();
+}
+
+bool Timeline::contains(int seg) const {
+  std::lock_guard lk(lock_);
+  return segments_.count(seg) > 0;
+}
+
+std::vector<SegmentTimeline::Entry> Timeline::entries() const {
+  std::lock_guard lk(lock_);
+  return entries_;
+}
+
+void Timeline::merge() {
+  entries_.clear();
+  // ranges of the previous segment that continue into the next one, by type
+  std::map<TimelineType, size_t> open;
+  int prev_seg = -1;
+  for (const auto &[seg, timeline] : segments_) {
+    if (seg != prev_seg + 1) open.clear();
+
+    std::map<TimelineType, size_t> next_open;
+    for (const auto &e : timeline->entries) {
+      auto it = open.find(e.type);
+      if (e.open_begin && it != open.end()) {
+        auto &range = entries_[it->second];
+        range.end = e.end;
+        range.open_end = e.open_end;
+        if (e.open_end) next_open[e.type] = it->second;
+        open.erase(it);
+      } else {
+        entries_.push_back(e);
+        if (e.open_end) next_open[e.type] = entries_.size() - 1;
+      }
+    }
+    open = std::move(next_open);
+    prev_seg = seg;
+  }
+  std::sort(entries_.begin(), entries_.end(), entryLess);
+}
+
+std::optional<SegmentTimeline::Entry> Timeline::next(TimelineType type, uint64_t mono_time, bool by_end) const {
+  std::lock_guard lk(lock_);
+  auto first = std::partition_point(entries_.begin(), entries_.end(), [=](auto &e) { return e.type < type; });
+  auto last = std::partition_point(first, entries_.end(), [=](auto &e) { return e.type == type; });
+  // ranges of one type don't overlap, so their ends are sorted as well
+  auto it = std::partition_point(first, last, [=](auto &e) { return (by_end ? e.end : e.begin) <= mono_time; });
+  for (; it != last; ++it) {
+    if (!(by_end ? it->open_end : it->open_begin)) return *it;
+  }
+  return std::nullopt;
+}
+
+std::optional<uint64_t> Timeline::nextEvent(cereal::Event::Which which, uint64_t mono_time) const {
+  std::lock_guard lk(lock_);
+  for (const auto &[_, timeline] : segments_) {
+    auto it = timeline->index.find(which);
+    if (it == timeline->index.end()) continue;
+
+    auto time_it = std::upper_bound(it->second.begin(), it->second.end(), mono_time);
+    if (time_it != it->second.end()) return *time_it;
+  }
+  return std::nullopt;
+}
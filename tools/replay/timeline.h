@@ -0,0 +1,71 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "tools/replay/logreader.h"
+
+enum class TimelineType { None, Engaged, AlertInfo, AlertWarning, AlertCritical, UserFlag };
+
+// services whose events are indexed by mono time, to find the next one quickly
+const cereal::Event::Which TIMELINE_INDEXED_SERVICES[] = {
+  cereal::Event::Which::USER_FLAG,
+  cereal::Event::Which::ERROR_LOG_MESSAGE,
+};
+// bump when the format or TIMELINE_INDEXED_SERVICES change
+constexpr uint32_t TIMELINE_VERSION = 1;
+
+// The timeline of one segment, built from the events of its log right after they are parsed.
+// It is kept in the download cache, so a route shows its timeline without reading the log again.
+struct SegmentTimeline {
+  struct Entry {
+    uint64_t begin;  // mono time
+    uint64_t end;
+    TimelineType type;
+    bool open_begin;  // the range continues from the previous segment
+    bool open_end;    // the range continues in the next segment
+  };
+
+  void build(const std::vector<Event> &events);
+  bool load(const std::string &file);
+  bool save(const std::string &file) const;
+  // the timeline of a downloaded log is saved next to its cache entry and evicted with it.
+  // the one of a local log is an entry of its own, keyed by cacheUrl.
+  bool loadCached(const std::string &log_url);
+  bool saveCached(const std::string &log_url) const;
+  // the cache url of the timeline of a local log, from its path, size and mtime. empty if it doesn't exist.
+  static std::string cacheUrl(const std::string &log_file);
+
+  std::vector<Entry> entries;  // sorted by type, then by time
+  std::map<cereal::Event::Which, std::vector<uint64_t>> index;
+
+private:
+  bool parse(const std::string &content, const std::string &name);
+  std::string serialize() const;
+};
+
+// The timeline of a route, merged from the timelines of its segments as they become available.
+class Timeline {
+public:
+  // a timeline built from the rlog replaces one built from the qlog, unless replace is false
+  void insert(int seg, std::shared_ptr<const SegmentTimeline> timeline, bool replace = true);
+  bool contains(int seg) const;
+  // ranges continued across segments are merged. sorted by type, then by time
+  std::vector<SegmentTimeline::Entry> entries() const;
+  // the first range of type that begins (or ends) after mono_time. ranges continued
+  // from (or into) another segment don't begin (or end) there and are skipped.
+  std::optional<SegmentTimeline::Entry> next(TimelineType type, uint64_t mono_time, bool by_end = false) const;
+  // the first indexed event of a service after mono_time
+  std::optional<uint64_t> nextEvent(cereal::Event::Which which, uint64_t mono_time) const;
+
+private:
+  void merge();
+
+  mutable std::mutex lock_;
+  std::map<int, std::shared_ptr<const SegmentTimeline>> segments_;
+  std::vector<SegmentTimeline::Entry> entries_;
+};
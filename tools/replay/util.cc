@@ -3,17 +3,30 @@
 #include <bzlib.h>
 #include <curl/curl.h>
 #include <openssl/sha.h>
+#include <strings.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+#include <unistd.h>
+#include <zstd.h>
 
 #include <cstdarg>
 #include <cstring>
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <mutex>
 #include <numeric>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #include "common/timing.h"
 #include "common/util.h"
@@ -58,38 +71,6 @@ struct CURLGlobalInitializer {
 
 static CURLGlobalInitializer curl_initializer;
 
-template <class T>
-struct MultiPartWriter {
-  T *buf;
-  size_t *total_written;
-  size_t offset;
-  size_t end;
-
-  size_t write(char *data, size_t size, size_t count) {
-    size_t bytes = size * count;
-    if ((offset + bytes) > end) return 0;
-
-    if constexpr (std::is_same<T, std::string>::value) {
-      memcpy(buf->data() + offset, data, bytes);
-    } else if constexpr (std::is_same<T, std::ofstream>::value) {
-      buf->seekp(offset);
-      buf->write(data, bytes);
-    }
-
-    offset += bytes;
-    *total_written += bytes;
-    return bytes;
-  }
-};
-
-template <class T>
-size_t write_cb(char *data, size_t size, size_t count, void *userp) {
-  auto w = (MultiPartWriter<T> *)userp;
-  return w->write(data, size, count);
-}
-
-size_t dumy_write_cb(char *data, size_t size, size_t count, void *userp) { return size * count; }
-
 struct DownloadStats {
   void installDownloadProgressHandler(DownloadProgressHandler handler) {
     std::lock_guard lk(lock);
@@ -128,6 +109,212 @@ struct DownloadStats {
 
 static DownloadStats download_stats;
 
+// a range of a file being downloaded. filled by the curl thread, consumed by the caller of httpStream.
+struct HttpPart {
+  struct Shared {
+    std::mutex lock;
+    std::condition_variable cv;
+    size_t content_length = 0;  // 0 until a response tells the size
+    bool ranges = true;         // false if the server ignored the range and sends the whole file
+  };
+
+  std::shared_ptr<Shared> shared;
+  CURL *eh = nullptr;
+  size_t begin = 0;
+  size_t end = 0;   // exclusive. 0 reads to the end of the file
+  size_t skip = 0;  // bytes to drop before begin, if the range was ignored
+  std::string data;  // received and not yet consumed
+  size_t received = 0;
+  bool responded = false;
+  bool done = false;
+  bool failed = false;
+  std::atomic<bool> cancelled = false;
+};
+
+size_t http_write_cb(char *data, size_t size, size_t count, void *userp) {
+  auto part = (HttpPart *)userp;
+  if (part->cancelled) return 0;
+
+  size_t bytes = size * count;
+  {
+    std::lock_guard lk(part->shared->lock);
+    if (!part->responded) {
+      part->responded = true;
+      long status = 0;
+      curl_easy_getinfo(part->eh, CURLINFO_RESPONSE_CODE, &status);
+      if (status == 200) {
+        // the whole file, from the start
+        curl_off_t length = -1;
+        curl_easy_getinfo(part->eh, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        part->shared->ranges = false;
+        part->shared->content_length = length > 0 ? length : 0;
+        part->skip = part->begin;
+        part->end = 0;
+      } else if (status != 206) {
+        rWarning("Download failed: http error code: %ld", status);
+        return 0;
+      }
+    }
+    const size_t skipped = std::min(part->skip, bytes);
+    part->skip -= skipped;
+    part->data.append(data + skipped, bytes - skipped);
+    part->received += bytes - skipped;
+  }
+  part->shared->cv.notify_all();
+  return bytes;
+}
+
+size_t http_header_cb(char *data, size_t size, size_t count, void *userp) {
+  auto part = (HttpPart *)userp;
+  const size_t bytes = size * count;
+  // Content-Range: bytes 0-1023/9112651
+  const std::string header(data, bytes);
+  if (strncasecmp(header.c_str(), "Content-Range:", 14) == 0) {
+    if (size_t pos = header.find('/'); pos != std::string::npos && header[pos + 1] != '*') {
+      std::lock_guard lk(part->shared->lock);
+      part->shared->content_length = std::strtoull(header.c_str() + pos + 1, nullptr, 10);
+    }
+  }
+  return bytes;
+}
+
+// One curl multi handle shared by every download and driven by its own thread.
+// Finished connections stay in its connection cache, so requests for the next ranges
+// and the next files of a route reuse them instead of connecting again.
+class HttpClient {
+public:
+  static HttpClient &instance() {
+    static HttpClient client;
+    return client;
+  }
+
+  void add(const std::string &url, std::shared_ptr<HttpPart> part) {
+    CURL *eh = part->eh = curl_easy_init();
+    curl_easy_setopt(eh, CURLOPT_URL, url.c_str());
+    if (part->begin > 0 || part->end > 0) {
+      std::string range = std::to_string(part->begin) + "-" + (part->end > 0 ? std::to_string(part->end - 1) : "");
+      curl_easy_setopt(eh, CURLOPT_RANGE, range.c_str());
+    }
+    curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, http_write_cb);
+    curl_easy_setopt(eh, CURLOPT_WRITEDATA, (void *)part.get());
+    curl_easy_setopt(eh, CURLOPT_HEADERFUNCTION, http_header_cb);
+    curl_easy_setopt(eh, CURLOPT_HEADERDATA, (void *)part.get());
+    curl_easy_setopt(eh, CURLOPT_HTTPGET, 1);
+    curl_easy_setopt(eh, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1);
+    curl_easy_setopt(eh, CURLOPT_FAILONERROR, 1);
+    curl_easy_setopt(eh, CURLOPT_TCP_KEEPALIVE, 1);
+    curl_easy_setopt(eh, CURLOPT_PIPEWAIT, 1);
+    // fail stalled connections, so the caller can retry
+    curl_easy_setopt(eh, CURLOPT_LOW_SPEED_LIMIT, 1);
+    curl_easy_setopt(eh, CURLOPT_LOW_SPEED_TIME, 30);
+
+    std::lock_guard lk(lock_);
+    added_.push_back(part);
+    curl_multi_wakeup(multi_);
+  }
+
+  void cancel(std::shared_ptr<HttpPart> part) {
+    part->cancelled = true;
+    std::lock_guard lk(lock_);
+    cancelled_.push_back(part);
+    curl_multi_wakeup(multi_);
+  }
+
+private:
+  HttpClient() {
+    multi_ = curl_multi_init();
+    curl_multi_setopt(multi_, CURLMOPT_MAXCONNECTS, 32L);
+    curl_multi_setopt(multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    thread_ = std::thread(&HttpClient::run, this);
+  }
+
+  ~HttpClient() {
+    {
+      std::lock_guard lk(lock_);
+      exit_ = true;
+      curl_multi_wakeup(multi_);
+    }
+    thread_.join();
+    for (auto &[eh, _] : transfers_) {
+      curl_multi_remove_handle(multi_, eh);
+      curl_easy_cleanup(eh);
+    }
+    curl_multi_cleanup(multi_);
+  }
+
+  void run() {
+    while (true) {
+      {
+        std::lock_guard lk(lock_);
+        if (exit_) break;
+
+        for (auto &part : added_) {
+          curl_multi_add_handle(multi_, part->eh);
+          transfers_[part->eh] = part;
+        }
+        for (auto &part : cancelled_) {
+          // a finished part has no handle, its address may already belong to another transfer
+          if (part->eh && transfers_.erase(part->eh) > 0) {
+            curl_multi_remove_handle(multi_, part->eh);
+            curl_easy_cleanup(part->eh);
+          }
+        }
+        added_.clear();
+        cancelled_.clear();
+      }
+
+      int still_running = 0;
+      curl_multi_perform(multi_, &still_running);
+      CURLMsg *msg;
+      int msgs_left = -1;
+      while ((msg = curl_multi_info_read(multi_, &msgs_left))) {
+        if (msg->msg == CURLMSG_DONE) {
+          finish(msg->easy_handle, msg->data.result);
+        }
+      }
+      curl_multi_poll(multi_, nullptr, 0, 1000, nullptr);
+    }
+  }
+
+  void finish(CURL *eh, CURLcode result) {
+    auto it = transfers_.find(eh);
+    if (it == transfers_.end()) return;
+
+    auto part = it->second;
+    {
+      std::lock_guard lk(part->shared->lock);
+      part->done = true;
+      part->failed = result != CURLE_OK;
+      if (part->failed && !part->cancelled) {
+        long status = 0;
+        curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &status);
+        if (result == CURLE_HTTP_RETURNED_ERROR) {
+          rWarning("Download failed: http error code: %ld", status);
+        } else {
+          rWarning("Download failed: connection failure: %d", result);
+        }
+      }
+    }
+    part->shared->cv.notify_all();
+    part->eh = nullptr;
+    transfers_.erase(it);
+    curl_multi_remove_handle(multi_, eh);
+    curl_easy_cleanup(eh);
+  }
+
+  CURLM *multi_ = nullptr;
+  std::thread thread_;
+  std::mutex lock_;
+  bool exit_ = false;
+  std::vector<std::shared_ptr<HttpPart>> added_, cancelled_;
+  std::map<CURL *, std::shared_ptr<HttpPart>> transfers_;  // only used by the curl thread
+};
+
+// connections of a download, adapted to the measured throughput. shared so the next file starts from it.
+const int MAX_HTTP_CONNECTIONS = 8;
+std::atomic<int> http_connections = 2;
+
 } // namespace
 
 void installDownloadProgressHandler(DownloadProgressHandler handler) {
@@ -144,180 +331,582 @@ std::string formattedDataSize(size_t size) {
   }
 }
 
-size_t getRemoteFileSize(const std::string &url, std::atomic<bool> *abort) {
-  CURL *curl = curl_easy_init();
-  if (!curl) return -1;
+std::string getUrlWithoutQuery(const std::string &url) {
+  size_t idx = url.find("?");
+  return (idx == std::string::npos ? url : url.substr(0, idx));
+}
 
-  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, dumy_write_cb);
-  curl_easy_setopt(curl, CURLOPT_HEADER, 1);
-  curl_easy_setopt(curl, CURLOPT_NOBODY, 1);
+bool httpStream(const std::string &url, const DownloadChunkHandler &handler, size_t chunk_size, size_t offset, std::atomic<bool> *abort) {
+  auto &client = HttpClient::instance();
+  auto shared = std::make_shared<HttpPart::Shared>();
+  std::deque<std::shared_ptr<HttpPart>> parts;  // in file order
+  size_t next_offset = offset;  // start of the next range to request
+  auto request = [&](size_t end) {
+    auto part = std::make_shared<HttpPart>();
+    part->shared = shared;
+    part->begin = next_offset;
+    part->end = end;
+    client.add(url, part);
+    parts.push_back(part);
+    next_offset = end;
+  };
+
+  // the size of the file comes with the first range, there is no separate HEAD request
+  request(chunk_size > 0 ? offset + chunk_size : 0);
+  download_stats.add(url, 0);
+
+  int connections = http_connections;
+  double window_start = millis_since_boot(), prev_throughput = 0;
+  size_t window_bytes = 0, window_parts = 0, delivered = 0;
+  bool stats_added = false, success = false;
+  std::unique_lock lk(shared->lock);
+  while (!(abort && *abort)) {
+    if (shared->content_length > 0 && !stats_added) {
+      download_stats.add(url, shared->content_length - offset);
+      stats_added = true;
+    }
+    // keep the next ranges in flight once the size is known
+    while (shared->ranges && chunk_size > 0 && shared->content_length > 0 && next_offset < shared->content_length &&
+           (int)parts.size() < connections) {
+      request(std::min(next_offset + chunk_size, shared->content_length));
+    }
 
-  CURLM *cm = curl_multi_init();
-  curl_multi_add_handle(cm, curl);
-  int still_running = 1;
-  while (still_running > 0 && !(abort && *abort)) {
-    CURLMcode mc = curl_multi_perform(cm, &still_running);
-    if (!mc) curl_multi_wait(cm, nullptr, 0, 1000, nullptr);
+    auto &head = parts.front();
+    if (!head->data.empty()) {
+      // hand over everything received so far, the rest of the range keeps downloading meanwhile
+      std::string data;
+      data.swap(head->data);
+      lk.unlock();
+      bool ret = handler(data.data(), data.size());
+      delivered += data.size();
+      download_stats.update(url, delivered);
+      lk.lock();
+      if (!ret) break;
+    } else if (head->failed) {
+      break;
+    } else if (head->done) {
+      if (shared->content_length == 0) {
+        shared->content_length = head->begin + head->received;
+      }
+      const size_t end = head->end > 0 ? std::min(head->end, shared->content_length) : shared->content_length;
+      if (end < head->begin || head->received != end - head->begin) {
+        rWarning("Download failed: incomplete range %zu-%zu", head->begin, end);
+        break;
+      }
+      // hill climbing: add a connection while it raises the throughput by 10%, drop one when it falls
+      window_bytes += head->received;
+      if (++window_parts >= (size_t)connections) {
+        double now = millis_since_boot();
+        double throughput = window_bytes / std::max(now - window_start, 1.0);
+        if (throughput > prev_throughput * 1.1) {
+          connections = std::min(connections + 1, MAX_HTTP_CONNECTIONS);
+        } else if (throughput < prev_throughput * 0.9) {
+          connections = std::max(connections - 1, 1);
+        }
+        prev_throughput = throughput;
+        window_start = now;
+        window_bytes = window_parts = 0;
+      }
+      const bool last = head->end == 0 || head->end >= shared->content_length;
+      parts.pop_front();
+      if (last) {
+        success = true;
+        break;
+      }
+    } else {
+      shared->cv.wait_for(lk, std::chrono::milliseconds(100));
+    }
   }
+  for (auto &part : parts) {
+    if (!part->done) client.cancel(part);
+  }
+  lk.unlock();
+
+  http_connections = connections;
+  download_stats.update(url, delivered, success);
+  download_stats.remove(url);
+  return success;
+}
 
-  double content_length = -1;
-  curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &content_length);
-  curl_multi_remove_handle(cm, curl);
-  curl_easy_cleanup(curl);
-  curl_multi_cleanup(cm);
-  return content_length > 0 ? (size_t)content_length : 0;
+std::string httpGet(const std::string &url, size_t chunk_size, std::atomic<bool> *abort) {
+  std::string result;
+  bool ret = httpStream(url, [&](const char *data, size_t size) {
+    result.append(data, size);
+    return true;
+  }, chunk_size, 0, abort);
+  return ret ? result : "";
 }
 
-std::string getUrlWithoutQuery(const std::string &url) {
-  size_t idx = url.find("?");
-  return (idx == std::string::npos ? url : url.substr(0, idx));
+bool httpDownload(const std::string &url, const std::string &file, size_t chunk_size, std::atomic<bool> *abort) {
+  std::ofstream of(file, std::ios::binary | std::ios::out | std::ios::trunc);
+  if (!of.is_open()) {
+    rWarning("failed to open %s for writing", file.c_str());
+    return false;
+  }
+  return httpStream(url, [&](const char *data, size_t size) {
+    return (bool)of.write(data, size);
+  }, chunk_size, 0, abort);
 }
 
-template <class T>
-bool httpDownload(const std::string &url, T &buf, size_t chunk_size, size_t content_length, std::atomic<bool> *abort) {
-  download_stats.add(url, content_length);
+namespace {
 
-  int parts = 1;
-  if (chunk_size > 0 && content_length > 10 * 1024 * 1024) {
-    parts = std::nearbyint(content_length / (float)chunk_size);
-    parts = std::clamp(parts, 1, 5);
-  }
+const uint64_t BZ2_BLOCK_MAGIC = 0x314159265359;  // BCD of pi
+const uint64_t BZ2_EOS_MAGIC = 0x177245385090;    // BCD of sqrt(pi)
 
-  CURLM *cm = curl_multi_init();
-  size_t written = 0;
-  std::map<CURL *, MultiPartWriter<T>> writers;
-  const int part_size = content_length / parts;
-  for (int i = 0; i < parts; ++i) {
-    CURL *eh = curl_easy_init();
-    writers[eh] = {
-        .buf = &buf,
-        .total_written = &written,
-        .offset = (size_t)(i * part_size),
-        .end = i == parts - 1 ? content_length : (i + 1) * part_size,
-    };
-    curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, write_cb<T>);
-    curl_easy_setopt(eh, CURLOPT_WRITEDATA, (void *)(&writers[eh]));
-    curl_easy_setopt(eh, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(eh, CURLOPT_RANGE, util::string_format("%d-%d", writers[eh].offset, writers[eh].end - 1).c_str());
-    curl_easy_setopt(eh, CURLOPT_HTTPGET, 1);
-    curl_easy_setopt(eh, CURLOPT_NOSIGNAL, 1);
-    curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1);
+inline size_t decompressThreads() {
+  return std::clamp<size_t>(std::thread::hardware_concurrency(), 1, MAX_DECOMPRESS_THREADS);
+}
+
+// decodes count independent pieces of the input on worker threads. the output of each piece is
+// handed to handler on the calling thread in order as soon as it and all pieces before it are done.
+bool decompressParallel(size_t count, const std::function<bool(size_t, std::string &)> &decode,
+                        const DecompressBlockHandler &handler, std::atomic<bool> *abort) {
+  struct Piece {
+    std::string out;
+    bool done = false;
+    bool ok = false;
+  };
+  const size_t threads = decompressThreads();
+  // bound the memory of pieces waiting to be handed over
+  const size_t window = threads * 2;
+  std::vector<Piece> pieces(count);
+  std::mutex lock;
+  std::condition_variable cv;
+  size_t next_piece = 0, delivered = 0;
+  bool stop = false;
+
+  auto worker = [&]() {
+    while (true) {
+      size_t i = 0;
+      {
+        std::unique_lock lk(lock);
+        cv.wait(lk, [&]() { return stop || next_piece >= count || next_piece < delivered + window; });
+        if (stop || next_piece >= count) return;
+        i = next_piece++;
+      }
+      std::string out;
+      bool ok = !(abort && *abort) && decode(i, out);
+      {
+        std::lock_guard lk(lock);
+        pieces[i] = {.out = std::move(out), .done = true, .ok = ok};
+      }
+      cv.notify_all();
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < std::min(threads, count); ++i) {
+    workers.emplace_back(worker);
+  }
 
-    curl_multi_add_handle(cm, eh);
+  bool ret = true;
+  for (size_t i = 0; i < count && ret; ++i) {
+    std::string out;
+    {
+      std::unique_lock lk(lock);
+      cv.wait(lk, [&]() { return pieces[i].done; });
+      ret = pieces[i].ok;
+      out = std::move(pieces[i].out);
+    }
+    ret = ret && !(abort && *abort) && (out.empty() || handler(out.data(), out.size()));
+    {
+      std::lock_guard lk(lock);
+      delivered = i + 1;
+      stop = !ret;
+    }
+    cv.notify_all();
   }
+  {
+    std::lock_guard lk(lock);
+    stop = true;
+  }
+  cv.notify_all();
+  for (auto &t : workers) t.join();
+  return ret;
+}
 
-  int still_running = 1;
-  while (still_running > 0 && !(abort && *abort)) {
-    curl_multi_wait(cm, nullptr, 0, 1000, nullptr);
-    curl_multi_perform(cm, &still_running);
-    download_stats.update(url, written);
+class BitWriter {
+public:
+  void put(uint64_t value, int bits) {
+    for (int i = bits - 1; i >= 0; --i) {
+      if (bit_pos_ % 8 == 0) buf_.push_back(0);
+      buf_.back() |= ((value >> i) & 1) << (7 - bit_pos_ % 8);
+      ++bit_pos_;
+    }
+  }
+  // append the bits [from, to) of data, starting byte aligned
+  void copy(const uint8_t *data, size_t from, size_t to) {
+    assert(bit_pos_ % 8 == 0);
+    const int shift = from % 8;
+    const size_t bytes = (to - from + 7) / 8, first = from / 8;
+    for (size_t i = 0; i < bytes; ++i) {
+      uint8_t b = data[first + i] << shift;
+      if (shift > 0 && (first + i + 1) * 8 < to) b |= data[first + i + 1] >> (8 - shift);
+      buf_.push_back(b);
+    }
+    bit_pos_ += to - from;
+    // clear the bits past the end
+    if (bit_pos_ % 8 != 0) buf_.back() &= 0xFF << (8 - bit_pos_ % 8);
   }
+  inline std::string &buffer() { return buf_; }
 
-  CURLMsg *msg;
-  int msgs_left = -1;
-  int complete = 0;
-  while ((msg = curl_multi_info_read(cm, &msgs_left)) && !(abort && *abort)) {
-    if (msg->msg == CURLMSG_DONE) {
-      if (msg->data.result == CURLE_OK) {
-        long res_status = 0;
-        curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &res_status);
-        if (res_status == 206) {
-          complete++;
-        } else {
-          rWarning("Download failed: http error code: %d", res_status);
-        }
-      } else {
-        rWarning("Download failed: connection failure: %d",  msg->data.result);
+private:
+  std::string buf_;
+  size_t bit_pos_ = 0;
+};
+
+// bit offsets of the blocks of a single bz2 stream, followed by the offset of its end of stream
+// marker. empty if the input is not one complete stream.
+std::vector<size_t> findBZ2Blocks(const uint8_t *data, size_t size) {
+  std::vector<size_t> blocks;
+  if (size < 14 || memcmp(data, "BZh", 3) != 0 || data[3] < '1' || data[3] > '9') return {};
+
+  // the markers are not byte aligned, test the 48 bits ending at each bit of each byte
+  uint64_t window = 0;
+  for (size_t i = 4; i < size; ++i) {
+    window = (window << 8) | data[i];
+    if (i < 4 + 5) continue;
+
+    for (int shift = 7; shift >= 0; --shift) {
+      const uint64_t bits = (window >> shift) & 0xFFFFFFFFFFFF;
+      if (bits != BZ2_BLOCK_MAGIC && bits != BZ2_EOS_MAGIC) continue;
+
+      blocks.push_back((i + 1) * 8 - shift - 48);
+      if (bits == BZ2_EOS_MAGIC) {
+        // a single stream: the combined crc and the padding are all that follow the marker
+        const size_t end = (blocks.back() + 48 + 32 + 7) / 8;
+        return end == size ? blocks : std::vector<size_t>{};
       }
     }
   }
+  return {};
+}
 
-  bool success = complete == parts;
-  download_stats.update(url, written, success);
-  download_stats.remove(url);
+bool decompressBZ2Stream(const std::string &in, std::string &out, size_t reserve, std::atomic<bool> *abort) {
+  bz_stream strm = {};
+  int bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
+  assert(bzerror == BZ_OK);
+
+  out.resize(reserve);
+  strm.next_in = (char *)in.data();
+  strm.avail_in = in.size();
+  size_t out_size = 0;
+  do {
+    if (out_size == out.size()) out.resize(out.size() * 2);
+    strm.next_out = out.data() + out_size;
+    strm.avail_out = out.size() - out_size;
+    const unsigned int prev_avail_in = strm.avail_in;
+    bzerror = BZ2_bzDecompress(&strm);
+    const size_t written = out.size() - out_size - strm.avail_out;
+    out_size += written;
+    if (bzerror == BZ_OK && written == 0 && strm.avail_in == prev_avail_in) bzerror = BZ_DATA_ERROR;
+  } while (bzerror == BZ_OK && !(abort && *abort));
+  BZ2_bzDecompressEnd(&strm);
+  out.resize(out_size);
+  return bzerror == BZ_STREAM_END;
+}
+
+}  // namespace
+
+std::string decompressBZ2(const std::string &in, std::atomic<bool> *abort) {
+  return decompressBZ2((std::byte *)in.data(), in.size(), abort);
+}
+
+std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool> *abort) {
+  std::string out;
+  out.reserve(in_size * 5);
+  // a corrupt or truncated stream returns what was decompressed before the error
+  decompressBZ2(in, in_size, [&out](const char *data, size_t size) {
+    out.append(data, size);
+    return true;
+  }, abort);
+  return out;
+}
 
-  for (const auto &[e, w] : writers) {
-    curl_multi_remove_handle(cm, e);
-    curl_easy_cleanup(e);
+bool decompressBZ2(const std::byte *in, size_t in_size, const DecompressBlockHandler &handler, std::atomic<bool> *abort) {
+  if (in_size == 0) return false;
+
+  // each block of a bz2 stream is compressed on its own. a block is decoded in parallel with the
+  // others by wrapping it into a stream of its own, with the block crc as the crc of the stream.
+  const uint8_t *data = (const uint8_t *)in;
+  std::vector<size_t> blocks = decompressThreads() > 1 ? findBZ2Blocks(data, in_size) : std::vector<size_t>{};
+  size_t delivered = 0;
+  if (blocks.size() > 2) {
+    const size_t block_size = (data[3] - '0') * 100000;
+    bool stopped = false;
+    auto counted = [&](const char *out, size_t size) {
+      stopped = !handler(out, size);
+      delivered += size;
+      return !stopped;
+    };
+    bool ret = decompressParallel(blocks.size() - 1, [&](size_t i, std::string &out) {
+      BitWriter writer;
+      writer.copy(data, 0, 32);  // "BZh" and the block size
+      writer.copy(data, blocks[i], blocks[i + 1]);
+      uint64_t block_crc = 0;
+      for (int bit = 0; bit < 32; ++bit) {
+        const size_t pos = blocks[i] + 48 + bit;
+        block_crc = (block_crc << 1) | ((data[pos / 8] >> (7 - pos % 8)) & 1);
+      }
+      writer.put(BZ2_EOS_MAGIC, 48);
+      writer.put(block_crc, 32);
+      return decompressBZ2Stream(writer.buffer(), out, block_size + block_size / 4, abort);
+    }, counted, abort);
+    if (ret || stopped || (abort && *abort)) return ret;
+
+    // a block magic may also occur inside the compressed data. the blocks found then don't split
+    // the stream, so it is decoded again in order, past the output already handed to the handler.
+    rDebug("decompressBZ2: parallel decoding failed, decoding in order");
   }
-  curl_multi_cleanup(cm);
 
-  return success;
+  // a small, truncated or multi-stream input, or one on a single core, is decoded in order
+  size_t skip = delivered;
+  StreamDecompressor decompressor(StreamDecompressor::BZ2, [&](const char *out, size_t size) {
+    const size_t n = std::min(skip, size);
+    skip -= n;
+    return n == size || handler(out + n, size - n);
+  }, abort);
+  return decompressor.push((const char *)in, in_size) && decompressor.finish();
 }
 
-std::string httpGet(const std::string &url, size_t chunk_size, std::atomic<bool> *abort) {
-  size_t size = getRemoteFileSize(url, abort);
-  if (size == 0) return {};
+std::string decompressZST(const std::string &in, std::atomic<bool> *abort) {
+  return decompressZST((std::byte *)in.data(), in.size(), abort);
+}
 
-  std::string result(size, '\0');
-  return httpDownload(url, result, chunk_size, size, abort) ? result : "";
+std::string decompressZST(const std::byte *in, size_t in_size, std::atomic<bool> *abort) {
+  std::string out;
+  unsigned long long content_size = ZSTD_getFrameContentSize(in, in_size);
+  out.reserve(content_size != ZSTD_CONTENTSIZE_UNKNOWN && content_size != ZSTD_CONTENTSIZE_ERROR ? content_size : in_size * 5);
+  bool ret = decompressZST(in, in_size, [&out](const char *data, size_t size) {
+    out.append(data, size);
+    return true;
+  }, abort);
+  return ret ? out : "";
 }
 
-bool httpDownload(const std::string &url, const std::string &file, size_t chunk_size, std::atomic<bool> *abort) {
-  size_t size = getRemoteFileSize(url, abort);
-  if (size == 0) return false;
+bool decompressZST(const std::byte *in, size_t in_size, const DecompressBlockHandler &handler, std::atomic<bool> *abort) {
+  if (in_size == 0) return false;
 
-  std::ofstream of(file, std::ios::binary | std::ios::out);
-  of.seekp(size - 1).write("\0", 1);
-  return httpDownload(url, of, chunk_size, size, abort);
+  // the frames of a zstd log are independent of each other and decoded in parallel
+  std::vector<std::pair<size_t, size_t>> frames;
+  for (size_t pos = 0; pos < in_size && decompressThreads() > 1;) {
+    const size_t frame_size = ZSTD_findFrameCompressedSize(in + pos, in_size - pos);
+    if (ZSTD_isError(frame_size)) {
+      frames.clear();
+      break;
+    }
+    frames.push_back({pos, frame_size});
+    pos += frame_size;
+  }
+  if (frames.size() > 1) {
+    return decompressParallel(frames.size(), [&](size_t i, std::string &out) {
+      auto [pos, frame_size] = frames[i];
+      const unsigned long long content_size = ZSTD_getFrameContentSize(in + pos, frame_size);
+      out.reserve(content_size != ZSTD_CONTENTSIZE_UNKNOWN && content_size != ZSTD_CONTENTSIZE_ERROR ? content_size : frame_size * 5);
+      StreamDecompressor decompressor(StreamDecompressor::ZST, [&out](const char *data, size_t size) {
+        out.append(data, size);
+        return true;
+      }, abort);
+      return decompressor.push((const char *)in + pos, frame_size) && decompressor.finish();
+    }, handler, abort);
+  }
+
+  // a single or truncated frame, or frames on a single core, are decoded in order
+  StreamDecompressor decompressor(StreamDecompressor::ZST, handler, abort);
+  return decompressor.push((const char *)in, in_size) && decompressor.finish();
 }
 
-std::string decompressBZ2(const std::string &in, std::atomic<bool> *abort) {
-  return decompressBZ2((std::byte *)in.data(), in.size(), abort);
+struct StreamDecompressor::Impl {
+  Format format;
+  DecompressBlockHandler handler;
+  std::atomic<bool> *abort;
+  bz_stream bz = {};
+  std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> zst = {nullptr, ZSTD_freeDCtx};
+  size_t zst_ret = 1;  // 0 once a frame is completely decoded and flushed
+  std::string out;
+  bool ended = false;  // end of a bz2 stream
+  bool failed = false;
+
+  inline bool aborted() const { return abort && *abort; }
+  // a zstd log may hold several frames, it is complete when the last one is
+  inline bool complete() const { return format == BZ2 ? ended : zst_ret == 0; }
+  bool pushBZ2(const char *data, size_t size);
+  bool pushZST(const char *data, size_t size);
+};
+
+StreamDecompressor::StreamDecompressor(Format format, const DecompressBlockHandler &handler, std::atomic<bool> *abort)
+    : impl_(new Impl{.format = format, .handler = handler, .abort = abort}) {
+  if (format == BZ2) {
+    int bzerror = BZ2_bzDecompressInit(&impl_->bz, 0, 0);
+    assert(bzerror == BZ_OK);
+    impl_->out.resize(DECOMPRESS_BLOCK_SIZE);
+  } else {
+    impl_->zst.reset(ZSTD_createDCtx());
+    assert(impl_->zst);
+    impl_->out.resize(std::max(DECOMPRESS_BLOCK_SIZE, ZSTD_DStreamOutSize()));
+  }
 }
 
-std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool> *abort) {
-  if (in_size == 0) return {};
+StreamDecompressor::~StreamDecompressor() {
+  if (impl_->format == BZ2) {
+    BZ2_bzDecompressEnd(&impl_->bz);
+  }
+}
 
-  bz_stream strm = {};
-  int bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
-  assert(bzerror == BZ_OK);
+bool StreamDecompressor::push(const char *data, size_t size) {
+  if (impl_->failed || impl_->aborted()) return false;
+  // anything after the end of the stream is ignored
+  if (impl_->ended || size == 0) return true;
 
-  strm.next_in = (char *)in;
-  strm.avail_in = in_size;
-  std::string out(in_size * 5, '\0');
-  do {
-    strm.next_out = (char *)(&out[strm.total_out_lo32]);
-    strm.avail_out = out.size() - strm.total_out_lo32;
+  bool ret = impl_->format == BZ2 ? impl_->pushBZ2(data, size) : impl_->pushZST(data, size);
+  impl_->failed = !ret;
+  return ret && !impl_->aborted();
+}
 
-    const char *prev_write_pos = strm.next_out;
-    bzerror = BZ2_bzDecompress(&strm);
-    if (bzerror == BZ_OK && prev_write_pos == strm.next_out) {
-      // content is corrupt
-      bzerror = BZ_STREAM_END;
+bool StreamDecompressor::finish() {
+  if (!impl_->complete() && !impl_->failed && !impl_->aborted()) {
+    rWarning("%s error : content is truncated", impl_->format == BZ2 ? "decompressBZ2" : "decompressZST");
+  }
+  return impl_->complete() && !impl_->failed && !impl_->aborted();
+}
+
+bool StreamDecompressor::Impl::pushBZ2(const char *data, size_t size) {
+  bz.next_in = (char *)data;
+  bz.avail_in = size;
+  while (!aborted()) {
+    const unsigned int prev_avail_in = bz.avail_in;
+    bz.next_out = out.data();
+    bz.avail_out = out.size();
+
+    int bzerror = BZ2_bzDecompress(&bz);
+    const size_t out_size = out.size() - bz.avail_out;
+    if ((bzerror != BZ_OK && bzerror != BZ_STREAM_END) || (bzerror == BZ_OK && out_size == 0 && bz.avail_in == prev_avail_in && prev_avail_in > 0)) {
       rWarning("decompressBZ2 error : content is corrupt");
+      return false;
+    }
+    if (out_size > 0 && !handler(out.data(), out_size)) {
+      return false;
+    }
+    if (bzerror == BZ_STREAM_END) {
+      ended = true;
       break;
     }
+    // all input consumed and nothing left to flush
+    if (bz.avail_in == 0 && bz.avail_out > 0) break;
+  }
+  return true;
+}
 
-    if (bzerror == BZ_OK && strm.avail_in > 0 && strm.avail_out == 0) {
-      out.resize(out.size() * 2);
+bool StreamDecompressor::Impl::pushZST(const char *data, size_t size) {
+  ZSTD_inBuffer input = {.src = data, .size = size, .pos = 0};
+  while (!aborted()) {
+    ZSTD_outBuffer output = {.dst = out.data(), .size = out.size(), .pos = 0};
+    zst_ret = ZSTD_decompressStream(zst.get(), &output, &input);
+    if (ZSTD_isError(zst_ret)) {
+      rWarning("decompressZST error : %s", ZSTD_getErrorName(zst_ret));
+      return false;
     }
-  } while (bzerror == BZ_OK && !(abort && *abort));
+    if (output.pos > 0 && !handler(out.data(), output.pos)) {
+      return false;
+    }
+    // all input consumed and nothing left to flush
+    if (input.pos == input.size && output.pos < output.size) break;
+  }
+  return true;
+}
 
-  BZ2_bzDecompressEnd(&strm);
-  if (bzerror == BZ_STREAM_END && !(abort && *abort)) {
-    out.resize(strm.total_out_lo32);
-    return out;
+MappedFile::MappedFile(const std::string &fn) {
+  unique_fd fd(HANDLE_EINTR(open(fn.c_str(), O_RDONLY | O_CLOEXEC)));
+  if (fd == -1) return;
+
+  struct stat st = {};
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) return;
+
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    rWarning("failed to mmap %s", fn.c_str());
+    return;
   }
-  return {};
+  madvise(addr, st.st_size, MADV_SEQUENTIAL);
+  data_ = (std::byte *)addr;
+  size_ = st.st_size;
 }
 
-void precise_nano_sleep(long sleep_ns) {
-  const long estimate_ns = 1 * 1e6;  // 1ms
-  struct timespec req = {.tv_nsec = estimate_ns};
-  uint64_t start_sleep = nanos_since_boot();
-  while (sleep_ns > estimate_ns) {
-    nanosleep(&req, nullptr);
-    uint64_t end_sleep = nanos_since_boot();
-    sleep_ns -= (end_sleep - start_sleep);
-    start_sleep = end_sleep;
+MappedFile::~MappedFile() {
+  if (data_) {
+    munmap(data_, size_);
   }
-  // spin wait
-  if (sleep_ns > 0) {
-    while ((nanos_since_boot() - start_sleep) <= sleep_ns) {
-      std::this_thread::yield();
+}
+
+// class PrecisePacer
+
+namespace {
+
+timespec toTimespec(uint64_t ns) {
+  return {.tv_sec = (time_t)(ns / 1000000000ULL), .tv_nsec = (long)(ns % 1000000000ULL)};
+}
+
+}  // namespace
+
+PrecisePacer::PrecisePacer(bool use_timerfd) {
+#ifdef __linux__
+  if (use_timerfd) {
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer_fd_ < 0) rWarning("failed to create timerfd, using clock_nanosleep");
+  }
+#endif
+}
+
+PrecisePacer::~PrecisePacer() {
+  if (timer_fd_ >= 0) close(timer_fd_);
+}
+
+uint64_t PrecisePacer::now() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+void PrecisePacer::calibrate() {
+  // wake up early by the 90th percentile of the lateness of short sleeps
+  std::vector<uint64_t> overshoots;
+  for (int i = 0; i < 20; ++i) {
+    const uint64_t wake_ns = now() + 1000 * 1000;
+    sleep(wake_ns);
+    const uint64_t woke_ns = now();
+    overshoots.push_back(woke_ns > wake_ns ? woke_ns - wake_ns : 0);
+  }
+  std::sort(overshoots.begin(), overshoots.end());
+  overshoot_ns_ = overshoots[overshoots.size() * 9 / 10];
+  rDebug("sleep overshoot %.1f us", overshoot_ns_ / 1e3);
+}
+
+void PrecisePacer::sleep(uint64_t wake_ns) {
+#ifdef __linux__
+  if (timer_fd_ >= 0) {
+    itimerspec spec = {.it_value = toTimespec(wake_ns)};
+    uint64_t expirations = 0;
+    if (timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr) == 0) {
+      while (read(timer_fd_, &expirations, sizeof(expirations)) < 0 && errno == EINTR) {}
     }
+    return;
+  }
+  const timespec deadline = toTimespec(wake_ns);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR) {}
+#else
+  const uint64_t cur_ns = now();
+  if (wake_ns > cur_ns) {
+    std::this_thread::sleep_for(std::chrono::nanoseconds(wake_ns - cur_ns));
+  }
+#endif
+}
+
+void PrecisePacer::sleepUntil(uint64_t deadline_ns) {
+  if (deadline_ns > overshoot_ns_ && now() < deadline_ns - overshoot_ns_) {
+    sleep(deadline_ns - overshoot_ns_);
+  }
+  // spin wait
+  while (now() < deadline_ns) {
+    std::this_thread::yield();
   }
 }
 
@@ -2,6 +2,7 @@
 
 #include <atomic>
 #include <functional>
+#include <memory>
 #include <string>
 
 enum class ReplyMsgType {
@@ -20,15 +21,88 @@ void logMessage(ReplyMsgType type, const char* fmt, ...);
 #define rWarning(fmt, ...) ::logMessage(ReplyMsgType::Warning, fmt,  ## __VA_ARGS__)
 #define rError(fmt, ...) ::logMessage(ReplyMsgType::Critical , fmt,  ## __VA_ARGS__)
 
+// time spent in each stage of loading a file, in milliseconds
+struct LoadStats {
+  double read_ms = 0;  // download or read from disk
+  double decompress_ms = 0;
+  double parse_ms = 0;
+};
+
 std::string sha256(const std::string &str);
-void precise_nano_sleep(long sleep_ns);
 std::string decompressBZ2(const std::string &in, std::atomic<bool> *abort = nullptr);
 std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool> *abort = nullptr);
+std::string decompressZST(const std::string &in, std::atomic<bool> *abort = nullptr);
+std::string decompressZST(const std::byte *in, size_t in_size, std::atomic<bool> *abort = nullptr);
+
+const size_t DECOMPRESS_BLOCK_SIZE = 4 * 1024 * 1024;
+// the blocks of a bz2 log and the frames of a zstd log are decoded on up to this many threads
+const size_t MAX_DECOMPRESS_THREADS = 8;
+
+// streaming decompression. the handler is called with each decompressed block and returns false to stop.
+// blocks are decoded in parallel when the input allows it, and handed over in order as they finish.
+typedef std::function<bool(const char *data, size_t size)> DecompressBlockHandler;
+bool decompressBZ2(const std::byte *in, size_t in_size, const DecompressBlockHandler &handler, std::atomic<bool> *abort = nullptr);
+bool decompressZST(const std::byte *in, size_t in_size, const DecompressBlockHandler &handler, std::atomic<bool> *abort = nullptr);
+
+// Sleeps until absolute deadlines on CLOCK_MONOTONIC. It wakes up early by the calibrated overshoot of
+// the sleep on this host and spins for the rest, so deadlines are met within microseconds.
+class PrecisePacer {
+public:
+  // a timerfd is used to sleep instead of clock_nanosleep if use_timerfd is set
+  PrecisePacer(bool use_timerfd = false);
+  ~PrecisePacer();
+  static uint64_t now();
+  // measure how late sleeps wake up, takes about 20 ms
+  void calibrate();
+  void sleepUntil(uint64_t deadline_ns);
+  inline uint64_t overshootNs() const { return overshoot_ns_; }
+
+private:
+  void sleep(uint64_t wake_ns);
+  int timer_fd_ = -1;
+  uint64_t overshoot_ns_ = 100 * 1000;
+};
+
+// incremental decompression of input that arrives in pieces, e.g. a log that is still downloading.
+class StreamDecompressor {
+public:
+  enum Format { BZ2, ZST };
+  StreamDecompressor(Format format, const DecompressBlockHandler &handler, std::atomic<bool> *abort = nullptr);
+  ~StreamDecompressor();
+  // returns false on corrupt input or when the handler stops
+  bool push(const char *data, size_t size);
+  // returns true if the input was a complete stream
+  bool finish();
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
 std::string getUrlWithoutQuery(const std::string &url);
-size_t getRemoteFileSize(const std::string &url, std::atomic<bool> *abort = nullptr);
 std::string httpGet(const std::string &url, size_t chunk_size = 0, std::atomic<bool> *abort = nullptr);
 
+// streaming download of [offset, end of file). the handler is called with the content in order
+// as it arrives and returns false to stop. files are fetched in ranges of chunk_size on parallel
+// connections, which are kept alive and reused by later downloads.
+typedef std::function<bool(const char *data, size_t size)> DownloadChunkHandler;
+bool httpStream(const std::string &url, const DownloadChunkHandler &handler, size_t chunk_size = 0, size_t offset = 0,
+                std::atomic<bool> *abort = nullptr);
+
 typedef std::function<void(uint64_t cur, uint64_t total, bool success)> DownloadProgressHandler;
 void installDownloadProgressHandler(DownloadProgressHandler);
 bool httpDownload(const std::string &url, const std::string &file, size_t chunk_size = 0, std::atomic<bool> *abort = nullptr);
 std::string formattedDataSize(size_t size);
+
+class MappedFile {
+public:
+  MappedFile(const std::string &fn);
+  ~MappedFile();
+  inline bool valid() const { return data_ != nullptr; }
+  inline const std::byte *data() const { return data_; }
+  inline size_t size() const { return size_; }
+
+private:
+  std::byte *data_ = nullptr;
+  size_t size_ = 0;
+};